@@ -0,0 +1,506 @@
+#include "head.h"
+#include "looper.h"
+#include "stereo_looper.h"
+#include "looper_bank.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <x86intrin.h>
+#define WREATH_BENCH_CYCLES
+#endif
+
+using namespace wreath;
+
+constexpr int32_t kBenchSampleRate{48000};
+constexpr int32_t kBenchBufferSamples{kBenchSampleRate * 10};
+constexpr int32_t kBenchSamples{kBenchSampleRate * 20};
+constexpr size_t kBenchBlockSize{48};
+constexpr size_t kBenchVoices{32};
+constexpr int32_t kBenchVoiceBufferSamples{kBenchSampleRate * 2};
+constexpr int32_t kBenchBankSamples{kBenchSampleRate * 5};
+
+float buffer[kBenchBufferSamples];
+float buffer2[kBenchBufferSamples];
+uint8_t formatBuffer[kBenchBufferSamples * 4];
+uint8_t formatBuffer2[kBenchBufferSamples * 4];
+float block[kMaxBlockSize];
+
+// Synthetic stereo input, one second long.
+float leftInput[kBenchSampleRate];
+float rightInput[kBenchSampleRate];
+float leftOutput[kBenchBlockSize];
+float rightOutput[kBenchBlockSize];
+
+// Stereo looper buffers.
+float leftBuffer[kBenchBufferSamples];
+float rightBuffer[kBenchBufferSamples];
+float leftFreezeBuffer[kBenchBufferSamples];
+float rightFreezeBuffer[kBenchBufferSamples];
+float stereoBuffer[kBenchBufferSamples * 2];
+float stereoFreezeBuffer[kBenchBufferSamples * 2];
+
+StereoLooper stereoLooper;
+Looper looper;
+
+// Keeps the compiler from optimizing the reads away.
+volatile float sink;
+
+struct Timing
+{
+    double nsPerSample{};
+    double cyclesPerSample{};
+};
+
+/**
+ * @brief Measures the time taken by the given function, that processes
+ * the given number of samples.
+ */
+template <typename Function>
+Timing Measure(int32_t samples, Function function)
+{
+    auto start = std::chrono::steady_clock::now();
+#ifdef WREATH_BENCH_CYCLES
+    uint64_t cycles = __rdtsc();
+#endif
+
+    function();
+
+    Timing timing{};
+#ifdef WREATH_BENCH_CYCLES
+    timing.cyclesPerSample = static_cast<double>(__rdtsc() - cycles) / samples;
+#endif
+    timing.nsPerSample = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / samples;
+
+    return timing;
+}
+
+void PrintTiming(const char *desc, const char *path, Timing timing)
+{
+    double perSecond = 1e9 / timing.nsPerSample;
+    std::printf("%-34s  %-11s  %12.0f  %9.1f  %8.1f\n", desc, path, perSecond, timing.nsPerSample, perSecond / kBenchSampleRate);
+}
+
+const char *MapInterpolation(Interpolation interpolation)
+{
+    switch (interpolation)
+    {
+    case Interpolation::HERMITE:
+        return "Hermite";
+    case Interpolation::LAGRANGE:
+        return "Lagrange";
+    case Interpolation::SINC:
+        return "Sinc";
+    default:
+        return "Linear";
+    }
+}
+
+void InitHead(Head &head, Interpolation interpolation, float rate, SampleFormat format = SampleFormat::FLOAT)
+{
+    if (SampleFormat::FLOAT == format)
+    {
+        head.Init(buffer, buffer2, kBenchBufferSamples);
+    }
+    else
+    {
+        head.Init(formatBuffer, formatBuffer2, kBenchBufferSamples, 1, format);
+    }
+    head.InitBuffer(kBenchBufferSamples);
+    head.SetActive(true);
+    head.SetLooping(true);
+    head.SetLoopStartAndLength(kBenchSampleRate, kBenchSampleRate * 5);
+    head.SetRate(rate);
+    head.SetInterpolation(interpolation);
+    head.SetIndex(kBenchSampleRate);
+}
+
+/**
+ * @brief Reads the loop one sample at a time, as the per-sample path does.
+ */
+void ReadSamples(Head &head, int32_t samples)
+{
+    float sum{};
+    for (int32_t i = 0; i < samples; i++)
+    {
+        sum += head.Read();
+        if (Head::Action::LOOP == head.UpdatePosition())
+        {
+            head.ResetPosition();
+        }
+    }
+    sink = sum;
+}
+
+/**
+ * @brief Reads the loop in blocks, as the steady path does.
+ */
+void ReadBlocks(Head &head, int32_t samples)
+{
+    float sum{};
+    for (int32_t i = 0; i < samples;)
+    {
+        size_t size = head.SamplesToBoundary(kMaxBlockSize);
+        if (size > 0)
+        {
+            head.ReadBlock(block, size);
+            head.Advance(size);
+            sum += block[0];
+        }
+        else
+        {
+            sum += head.Read();
+            if (Head::Action::LOOP == head.UpdatePosition())
+            {
+                head.ResetPosition();
+            }
+            size = 1;
+        }
+        i += size;
+    }
+    sink = sum;
+}
+
+/**
+ * @brief Cost of each interpolation at different rates, to choose the
+ * quality/CPU trade-off.
+ */
+void BenchInterpolation()
+{
+    static Interpolation interpolations[] = {LINEAR, HERMITE, LAGRANGE, SINC};
+    static float rates[] = {0.5f, 1.f, 1.37f, 2.5f};
+
+    std::printf("Interpolation  Rate   Per-sample ns  Block ns  Block cycles\n");
+    for (Interpolation interpolation : interpolations)
+    {
+        for (float rate : rates)
+        {
+            Head head{Type::READ};
+            InitHead(head, interpolation, rate);
+            Timing samples = Measure(kBenchSamples, [&head]()
+                                     { ReadSamples(head, kBenchSamples); });
+            InitHead(head, interpolation, rate);
+            Timing blocks = Measure(kBenchSamples, [&head]()
+                                    { ReadBlocks(head, kBenchSamples); });
+            std::printf("%-13s  %4.2f  %14.2f  %8.2f  %12.1f\n", MapInterpolation(interpolation), rate, samples.nsPerSample, blocks.nsPerSample, blocks.cyclesPerSample);
+        }
+    }
+    std::printf("\n");
+}
+
+const char *MapSampleFormat(SampleFormat format)
+{
+    switch (format)
+    {
+    case SampleFormat::INT16:
+        return "Int16";
+    case SampleFormat::INT24:
+        return "Int24";
+    case SampleFormat::BFLOAT16:
+        return "BFloat16";
+    default:
+        return "Float";
+    }
+}
+
+/**
+ * @brief Cost of reading each storage format, that is converted while
+ * interpolating.
+ */
+void BenchSampleFormats()
+{
+    static SampleFormat formats[] = {FLOAT, INT16, INT24, BFLOAT16};
+    static Interpolation interpolations[] = {LINEAR, HERMITE};
+
+    std::printf("Format    Interpolation  Rate   Per-sample ns  Block ns  Block cycles\n");
+    for (SampleFormat format : formats)
+    {
+        Head writer{Type::WRITE};
+        writer.Init(formatBuffer, formatBuffer2, kBenchBufferSamples, 1, format);
+        for (int32_t i = 0; i < kBenchBufferSamples; i++)
+        {
+            writer.Buffer(buffer[i]);
+        }
+
+        for (Interpolation interpolation : interpolations)
+        {
+            float rate = 1.37f;
+            Head head{Type::READ};
+            InitHead(head, interpolation, rate, format);
+            Timing samples = Measure(kBenchSamples, [&head]()
+                                     { ReadSamples(head, kBenchSamples); });
+            InitHead(head, interpolation, rate, format);
+            Timing blocks = Measure(kBenchSamples, [&head]()
+                                    { ReadBlocks(head, kBenchSamples); });
+            std::printf("%-8s  %-13s  %4.2f  %14.2f  %8.2f  %12.1f\n", MapSampleFormat(format), MapInterpolation(interpolation), rate, samples.nsPerSample, blocks.nsPerSample, blocks.cyclesPerSample);
+        }
+    }
+    std::printf("\n");
+}
+
+struct Scenario
+{
+    const char *desc{};
+    StereoLooper::Mode mode{StereoLooper::Mode::MONO};
+    Movement movement{Movement::NORMAL};
+    Direction direction{Direction::FORWARD};
+    float rate{1.f};
+    float loopLength{kBenchSampleRate * 4.f};
+    float freeze{};
+    float feedback{};
+    float degradation{};
+};
+
+static Scenario scenarios[] =
+{
+    { "Mono, 1x, forward", StereoLooper::Mode::MONO, NORMAL, FORWARD, 1.f },
+    { "Mono, 1.37x, forward", StereoLooper::Mode::MONO, NORMAL, FORWARD, 1.37f },
+    { "Mono, 0.5x, backwards", StereoLooper::Mode::MONO, NORMAL, BACKWARDS, 0.5f },
+    { "Cross, 2.5x, pendulum", StereoLooper::Mode::CROSS, PENDULUM, FORWARD, 2.5f },
+    { "Dual, 1x, short loop", StereoLooper::Mode::DUAL, NORMAL, FORWARD, 1.f, 1000.f },
+    { "Mono, 1x, half frozen", StereoLooper::Mode::MONO, NORMAL, FORWARD, 1.f, kBenchSampleRate * 4.f, 0.5f },
+    { "Mono, 1x, frozen", StereoLooper::Mode::MONO, NORMAL, FORWARD, 1.f, kBenchSampleRate * 4.f, 1.f },
+    { "Mono, 1x, feedback", StereoLooper::Mode::MONO, NORMAL, FORWARD, 1.f, kBenchSampleRate * 4.f, 0.f, 0.7f },
+    { "Mono, 0.73x, feedback, degradation", StereoLooper::Mode::MONO, NORMAL, BACKWARDS, 0.73f, kBenchSampleRate * 4.f, 0.f, 0.7f, 0.5f },
+};
+
+/**
+ * @brief Runs the stereo looper through the buffering (with no startup), then
+ * sets up the scenario.
+ */
+void PrepareStereoLooper(const Scenario &scenario, bool interleaved = false)
+{
+    StereoLooper::Conf conf{scenario.mode, scenario.movement, scenario.direction, 1.f, 0.f};
+    if (interleaved)
+    {
+        stereoLooper.Init(kBenchSampleRate, conf, {stereoBuffer, nullptr, stereoFreezeBuffer, nullptr, kBenchBufferSamples, true});
+    }
+    else
+    {
+        stereoLooper.Init(kBenchSampleRate, conf, {leftBuffer, rightBuffer, leftFreezeBuffer, rightFreezeBuffer, kBenchBufferSamples});
+    }
+
+    int32_t t{};
+    while (!stereoLooper.IsReady())
+    {
+        if (stereoLooper.IsBuffering() && stereoLooper.GetBufferSamples(StereoLooper::LEFT) >= kBenchBufferSamples)
+        {
+            stereoLooper.StopBuffering();
+        }
+        stereoLooper.ProcessBlock(leftInput + t, rightInput + t, leftOutput, rightOutput, kBenchBlockSize);
+        t = (t + kBenchBlockSize) % (kBenchSampleRate - kBenchBlockSize);
+    }
+
+    stereoLooper.Start();
+    stereoLooper.SetLoopLength(StereoLooper::BOTH, scenario.loopLength);
+    stereoLooper.SetLoopStart(StereoLooper::BOTH, kBenchSampleRate);
+    stereoLooper.SetReadRate(StereoLooper::BOTH, scenario.rate);
+    stereoLooper.SetDirection(StereoLooper::BOTH, scenario.direction);
+    stereoLooper.SetMovement(StereoLooper::BOTH, scenario.movement);
+    stereoLooper.SetFreeze(StereoLooper::BOTH, scenario.freeze);
+    stereoLooper.SetDegradation(scenario.degradation);
+    stereoLooper.SetFilterValue(1000.f);
+    stereoLooper.feedback = scenario.feedback;
+    stereoLooper.crossedFeedback = StereoLooper::Mode::CROSS == scenario.mode;
+}
+
+/**
+ * @brief Throughput of the whole stereo looper, per-sample and in blocks.
+ */
+void BenchStereoLooper()
+{
+    std::printf("StereoLooper                        Path         Frames/s      ns/frame  RT factor\n");
+    for (const Scenario &scenario : scenarios)
+    {
+        PrepareStereoLooper(scenario);
+        Timing samples = Measure(kBenchSamples, []()
+                                 {
+                                     for (int32_t i = 0; i < kBenchSamples; i++)
+                                     {
+                                         int32_t t = i % kBenchSampleRate;
+                                         stereoLooper.Process(leftInput[t], rightInput[t], leftOutput[0], rightOutput[0]);
+                                     } });
+        PrintTiming(scenario.desc, "Per-sample", samples);
+
+        PrepareStereoLooper(scenario);
+        Timing blocks = Measure(kBenchSamples, []()
+                                {
+                                    for (int32_t i = 0; i < kBenchSamples; i += kBenchBlockSize)
+                                    {
+                                        int32_t t = i % (kBenchSampleRate - kBenchBlockSize);
+                                        stereoLooper.ProcessBlock(leftInput + t, rightInput + t, leftOutput, rightOutput, kBenchBlockSize);
+                                    } });
+        PrintTiming(scenario.desc, "Block", blocks);
+
+        PrepareStereoLooper(scenario, true);
+        Timing interleaved = Measure(kBenchSamples, []()
+                                     {
+                                         for (int32_t i = 0; i < kBenchSamples; i += kBenchBlockSize)
+                                         {
+                                             int32_t t = i % (kBenchSampleRate - kBenchBlockSize);
+                                             stereoLooper.ProcessBlock(leftInput + t, rightInput + t, leftOutput, rightOutput, kBenchBlockSize);
+                                         } });
+        PrintTiming(scenario.desc, "Interleaved", interleaved);
+    }
+    std::printf("\n");
+}
+
+/**
+ * @brief Buffers the looper and sets up the scenario.
+ */
+void PrepareLooper(const Scenario &scenario)
+{
+    looper.Init(kBenchSampleRate, buffer, buffer2, kBenchBufferSamples);
+    for (int32_t i = 0; !looper.Buffer(leftInput[i % kBenchSampleRate]); i++)
+    {
+    }
+    looper.StopBuffering();
+    looper.SetLoopLength(scenario.loopLength);
+    looper.SetLoopStart(kBenchSampleRate);
+    looper.SetReadRate(scenario.rate);
+    looper.SetDirection(scenario.direction);
+    looper.SetMovement(scenario.movement);
+    looper.SetFreeze(scenario.freeze);
+    looper.SetDegradation(scenario.degradation);
+}
+
+/**
+ * @brief Throughput of a single looper, per-sample and in blocks.
+ */
+void BenchLooper()
+{
+    std::printf("Looper                              Path         Frames/s      ns/frame  RT factor\n");
+    for (const Scenario &scenario : scenarios)
+    {
+        PrepareLooper(scenario);
+        Timing samples = Measure(kBenchSamples, [&scenario]()
+                                 {
+                                     float sum{};
+                                     for (int32_t i = 0; i < kBenchSamples; i++)
+                                     {
+                                         float value = looper.Read();
+                                         looper.UpdateReadPos();
+                                         looper.Write(leftInput[i % kBenchSampleRate] + looper.Degrade(value * scenario.feedback));
+                                         looper.UpdateWritePos();
+                                         sum += value;
+                                     }
+                                     sink = sum; });
+        PrintTiming(scenario.desc, "Per-sample", samples);
+
+        PrepareLooper(scenario);
+        Timing blocks = Measure(kBenchSamples, [&scenario]()
+                                {
+                                    float sum{};
+                                    for (int32_t i = 0; i < kBenchSamples;)
+                                    {
+                                        size_t size = scenario.degradation > 0.f ? 0 : looper.GetSteadySamples(kBenchBlockSize);
+                                        if (size > 0)
+                                        {
+                                            int32_t t = i % (kBenchSampleRate - kBenchBlockSize);
+                                            looper.ReadBlock(block, size);
+                                            for (size_t j = 0; j < size; j++)
+                                            {
+                                                block[j] = leftInput[t + j] + block[j] * scenario.feedback;
+                                            }
+                                            looper.WriteBlock(block, size);
+                                            sum += block[0];
+                                        }
+                                        else
+                                        {
+                                            float value = looper.Read();
+                                            looper.UpdateReadPos();
+                                            looper.Write(leftInput[i % kBenchSampleRate] + looper.Degrade(value * scenario.feedback));
+                                            looper.UpdateWritePos();
+                                            sum += value;
+                                            size = 1;
+                                        }
+                                        i += size;
+                                    }
+                                    sink = sum; });
+        PrintTiming(scenario.desc, "Block", blocks);
+    }
+    std::printf("\n");
+}
+
+/**
+ * @brief Runs the voices through the buffering (with no startup), then starts
+ * them with different rates.
+ */
+void PrepareLooperBank(LooperBank &bank, size_t threads)
+{
+    bank.Init(kBenchSampleRate, {StereoLooper::Mode::MONO, Movement::NORMAL, Direction::FORWARD, 1.f, 0.f}, kBenchVoices, kBenchVoiceBufferSamples, threads);
+
+    for (int32_t t = 0; !bank.GetVoice(kBenchVoices - 1).IsReady(); t = (t + kBenchBlockSize) % (kBenchSampleRate - kBenchBlockSize))
+    {
+        bank.ProcessBlock(leftInput + t, rightInput + t, leftOutput, rightOutput, kBenchBlockSize);
+    }
+
+    for (size_t i = 0; i < kBenchVoices; i++)
+    {
+        StereoLooper &voice = bank.GetVoice(i);
+        voice.Start();
+        voice.SetLoopLength(StereoLooper::BOTH, kBenchSampleRate * (0.5f + (i % 4) * 0.25f));
+        voice.SetReadRate(StereoLooper::BOTH, 0.5f + (i % 8) * 0.25f);
+        voice.SetFilterValue(1000.f);
+        voice.feedback = 0.5f;
+    }
+}
+
+/**
+ * @brief Scaling of the looper bank with the number of threads.
+ */
+void BenchLooperBank()
+{
+    size_t maxThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    double singleThread{};
+
+    std::printf("LooperBank (%zu voices)  Threads  Voice frames/s  ns/voice frame  RT factor  Speedup\n", kBenchVoices);
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        LooperBank bank;
+        PrepareLooperBank(bank, threads);
+        Timing timing = Measure(kBenchBankSamples * kBenchVoices, [&bank]()
+                                {
+                                    for (int32_t i = 0; i < kBenchBankSamples; i += kBenchBlockSize)
+                                    {
+                                        // Keep the control queue busy, as a host would.
+                                        bank.Push(i / kBenchBlockSize % kBenchVoices, [](StereoLooper &voice, float value)
+                                                  { voice.SetReadRate(StereoLooper::BOTH, value); }, 0.75f + (i % 7) * 0.125f);
+                                        int32_t t = i % (kBenchSampleRate - kBenchBlockSize);
+                                        bank.ProcessBlock(leftInput + t, rightInput + t, leftOutput, rightOutput, kBenchBlockSize);
+                                    } });
+        double perSecond = 1e9 / timing.nsPerSample;
+        if (1 == threads)
+        {
+            singleThread = perSecond;
+        }
+        std::printf("%-22s  %7zu  %14.0f  %14.2f  %9.1f  %7.2f\n", "", threads, perSecond, timing.nsPerSample, perSecond / kBenchVoices / kBenchSampleRate, perSecond / singleThread);
+    }
+    std::printf("\n");
+}
+
+int main()
+{
+    std::srand(1);
+    for (int32_t i = 0; i < kBenchBufferSamples; i++)
+    {
+        buffer[i] = std::rand() / static_cast<float>(RAND_MAX) * 2.f - 1.f;
+    }
+    for (int32_t i = 0; i < kBenchSampleRate; i++)
+    {
+        float noise = std::rand() / static_cast<float>(RAND_MAX) * 0.1f - 0.05f;
+        leftInput[i] = 0.5f * std::sin(i * 0.0314f) + noise;
+        rightInput[i] = 0.5f * std::sin(i * 0.0471f) - noise;
+    }
+
+    BenchInterpolation();
+    BenchSampleFormats();
+    BenchLooper();
+    BenchStereoLooper();
+    BenchLooperBank();
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace wreath
+{
+    /**
+     * @brief A lock-free single-producer/single-consumer ring, used to send
+     * commands from a control thread to the audio one without blocking either.
+     * The size must be a power of 2.
+     */
+    template <typename T, size_t kSize>
+    class CommandQueue
+    {
+        static_assert(kSize > 0 && (kSize & (kSize - 1)) == 0, "The size of the queue must be a power of 2");
+
+    public:
+        /**
+         * @brief Adds an item to the queue (producer side).
+         *
+         * @param item
+         * @return false if the queue is full
+         */
+        bool Push(const T &item)
+        {
+            size_t write = write_.load(std::memory_order_relaxed);
+            if (write - read_.load(std::memory_order_acquire) >= kSize)
+            {
+                return false;
+            }
+            items_[write & (kSize - 1)] = item;
+            write_.store(write + 1, std::memory_order_release);
+
+            return true;
+        }
+
+        /**
+         * @brief Returns the oldest item without removing it (consumer side).
+         *
+         * @return const T* nullptr if the queue is empty
+         */
+        const T *Front()
+        {
+            size_t read = read_.load(std::memory_order_relaxed);
+            if (read == write_.load(std::memory_order_acquire))
+            {
+                return nullptr;
+            }
+
+            return &items_[read & (kSize - 1)];
+        }
+
+        /**
+         * @brief Removes the oldest item (consumer side). Only call this after
+         * Front() has returned it.
+         */
+        void Pop()
+        {
+            read_.store(read_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        /**
+         * @brief Empties the queue. Only call this when neither side is using
+         * it.
+         */
+        void Clear()
+        {
+            read_.store(0);
+            write_.store(0);
+        }
+
+    private:
+        T items_[kSize]{};
+        alignas(64) std::atomic<size_t> read_{};
+        alignas(64) std::atomic<size_t> write_{};
+    };
+} // namespace wreath
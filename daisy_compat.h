@@ -0,0 +1,13 @@
+#pragma once
+
+// The DSP bits come from DaisySP, that builds both on the Daisy and on the
+// host (only its headers are needed).
+#include "Utility/dsp.h"
+
+// The external SDRAM is only there on the Daisy: when building for the host
+// (tests, benchmarks, offline rendering) the looper buffers must be supplied
+// by the caller (see StereoLooper::Buffers).
+#if defined(__arm__) && !defined(WREATH_NO_SDRAM)
+#include "dev/sdram.h"
+#define WREATH_SDRAM_BUFFERS
+#endif
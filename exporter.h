@@ -0,0 +1,238 @@
+#pragma once
+
+#include "stereo_looper.h"
+#include "loop_snapshot.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace wreath
+{
+    constexpr int32_t kExportFrames{4096}; // Frames written to the file at a time
+    constexpr int32_t kExportPeriodMs{2};  // How often the exporter checks for new pages
+
+    /**
+     * @brief Writes the current loops of a looper to a WAV file while it keeps
+     * running. The loops are captured when the audio thread applies the
+     * export command, as copy-on-write snapshots (see LoopSnapshot): the
+     * audio thread only copies memory, a background thread streams the pages
+     * to the file as soon as they are published. Not available on the Daisy.
+     */
+    class Exporter
+    {
+    public:
+        Exporter() {}
+        ~Exporter()
+        {
+            Wait();
+        }
+
+        Exporter(const Exporter &) = delete;
+        Exporter &operator=(const Exporter &) = delete;
+
+        /**
+         * @brief Starts exporting the loops of the looper to the given file,
+         * as a stereo 32-bit float WAV. When the loops of the channels have
+         * different lengths, the shorter one is followed by silence. The
+         * looper must keep being processed until the export is done, and must
+         * outlive it. Not real-time safe.
+         *
+         * @param path
+         * @param looper
+         * @return false if an export is running, the file can't be opened or
+         * the command queue is full
+         */
+        bool Start(const char *path, StereoLooper &looper)
+        {
+            if (IsRunning())
+            {
+                return false;
+            }
+            Wait();
+
+            FILE *file = std::fopen(path, "wb");
+            if (!file)
+            {
+                return false;
+            }
+            int32_t samples = looper.GetBuffers().samples;
+            for (size_t i = 0; i < 2; i++)
+            {
+                samples_[i].resize(samples);
+                snapshots_[i].samples = samples_[i].data();
+                snapshots_[i].capacity = samples;
+                snapshots_[i].status.store(LoopSnapshot::WAITING, std::memory_order_relaxed);
+            }
+            if (!looper.Export(snapshots_))
+            {
+                std::fclose(file);
+                std::remove(path);
+                snapshots_[0].status.store(LoopSnapshot::IDLE);
+                snapshots_[1].status.store(LoopSnapshot::IDLE);
+                return false;
+            }
+            path_ = path;
+            file_ = file;
+            written_ = false;
+            done_.store(false);
+            thread_ = std::thread(&Exporter::Work, this, looper.GetSampleRate());
+
+            return true;
+        }
+
+        /**
+         * @brief Waits for the export to end.
+         *
+         * @return true if the file has been written
+         */
+        bool Wait()
+        {
+            if (thread_.joinable())
+            {
+                thread_.join();
+            }
+
+            return written_;
+        }
+
+        inline bool IsRunning() { return thread_.joinable() && !done_.load(std::memory_order_acquire); }
+
+    private:
+        // Waits until the looper has set the snapshot up.
+        static void WaitForStart(const LoopSnapshot &snapshot)
+        {
+            while (LoopSnapshot::WAITING == snapshot.status.load(std::memory_order_acquire))
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(kExportPeriodMs));
+            }
+        }
+
+        // Waits until the page holding the given sample is published.
+        // Returns false if the snapshot has been cancelled.
+        static bool WaitForSample(const LoopSnapshot &snapshot, int32_t index)
+        {
+            while (!snapshot.IsPublished(index))
+            {
+                if (LoopSnapshot::CANCELLED == snapshot.status.load(std::memory_order_acquire))
+                {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(kExportPeriodMs));
+            }
+
+            return true;
+        }
+
+        static void WaitForRelease(const LoopSnapshot &snapshot)
+        {
+            while (!snapshot.IsReleased())
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(kExportPeriodMs));
+            }
+        }
+
+        static void PutU32(uint8_t *p, uint32_t value)
+        {
+            for (size_t i = 0; i < 4; i++)
+            {
+                p[i] = (value >> (8 * i)) & 0xff;
+            }
+        }
+
+        static void PutU16(uint8_t *p, uint16_t value)
+        {
+            p[0] = value & 0xff;
+            p[1] = value >> 8;
+        }
+
+        // A WAVE_FORMAT_IEEE_FLOAT header, with the fact chunk it requires.
+        static bool WriteHeader(FILE *file, int32_t sampleRate, uint32_t frames)
+        {
+            uint8_t header[58];
+            uint32_t bytes = frames * 2 * sizeof(float);
+            std::memcpy(header, "RIFF", 4);
+            PutU32(header + 4, sizeof(header) - 8 + bytes);
+            std::memcpy(header + 8, "WAVEfmt ", 8);
+            PutU32(header + 16, 18);
+            PutU16(header + 20, 3); // IEEE float
+            PutU16(header + 22, 2);
+            PutU32(header + 24, sampleRate);
+            PutU32(header + 28, sampleRate * 2 * sizeof(float));
+            PutU16(header + 32, 2 * sizeof(float));
+            PutU16(header + 34, 32);
+            PutU16(header + 36, 0);
+            std::memcpy(header + 38, "fact", 4);
+            PutU32(header + 42, 4);
+            PutU32(header + 46, frames);
+            std::memcpy(header + 50, "data", 4);
+            PutU32(header + 54, bytes);
+
+            return std::fwrite(header, sizeof(header), 1, file) == 1;
+        }
+
+        void Work(int32_t sampleRate)
+        {
+            WaitForStart(snapshots_[0]);
+            WaitForStart(snapshots_[1]);
+
+            bool ok = !snapshots_[0].IsReleased() || LoopSnapshot::COMPLETE == snapshots_[0].status.load();
+            ok = ok && (!snapshots_[1].IsReleased() || LoopSnapshot::COMPLETE == snapshots_[1].status.load());
+            int32_t frames = std::max(snapshots_[0].loopLength, snapshots_[1].loopLength);
+            ok = ok && WriteHeader(file_, sampleRate, frames);
+
+            // The samples are little-endian floats, as on all the supported
+            // platforms.
+            std::vector<float> chunk(kExportFrames * 2);
+            for (int32_t frame = 0; ok && frame < frames; frame += kExportFrames)
+            {
+                int32_t count = std::min(kExportFrames, frames - frame);
+                for (size_t c = 0; c < 2 && ok; c++)
+                {
+                    const LoopSnapshot &snapshot = snapshots_[c];
+                    for (int32_t i = 0; i < count; i++)
+                    {
+                        float value = 0.f;
+                        if (frame + i < snapshot.loopLength)
+                        {
+                            int32_t index = (snapshot.loopStart + frame + i) % snapshot.bufferSamples;
+                            if (!WaitForSample(snapshot, index))
+                            {
+                                ok = false;
+                                break;
+                            }
+                            value = snapshot.samples[index];
+                        }
+                        chunk[i * 2 + c] = value;
+                    }
+                }
+                ok = ok && std::fwrite(chunk.data(), sizeof(float) * 2, count, file_) == static_cast<size_t>(count);
+            }
+            ok = std::fclose(file_) == 0 && ok;
+            file_ = nullptr;
+            if (!ok)
+            {
+                std::remove(path_.c_str());
+            }
+
+            // The looper may still be copying the pages that weren't needed.
+            WaitForRelease(snapshots_[0]);
+            WaitForRelease(snapshots_[1]);
+            written_ = ok;
+            done_.store(true, std::memory_order_release);
+        }
+
+        LoopSnapshot snapshots_[2];
+        std::vector<float> samples_[2];
+        std::string path_;
+        FILE *file_{};
+        bool written_{};
+        std::atomic<bool> done_{};
+        std::thread thread_;
+    };
+} // namespace wreath
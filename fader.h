@@ -1,12 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstddef>
+#include <limits>
 
 namespace wreath
 {
     constexpr float kSamplesToFade{48.f * 100};       // 100ms @ 48KHz
     constexpr float kSamplesToFadeTrigger{48.f * 10}; // 10ms @ 48KHz
     constexpr float kEqualCrossFadeP{1.25f};
+    constexpr size_t kCrossFadeTableSize{256}; // Segments of the crossfade table
 
     /**
      * @brief Handles different types of cross-fading between two sources.
@@ -66,7 +71,17 @@ namespace wreath
         }
 
         /**
-         * @brief Equal-power crossfade.
+         * @brief The gains applied to the two sources of a crossfade.
+         */
+        struct Gains
+        {
+            float from;
+            float to;
+        };
+
+        /**
+         * @brief Equal-power crossfade. The quarter sine is looked up in a
+         * table, interpolated.
          *
          * @param from
          * @param to
@@ -75,8 +90,8 @@ namespace wreath
          */
         static float CrossFade(float from, float to, float pos)
         {
-            float in = std::sin(pos * 1.570796326794897);
-            float out = std::sin((1.f - pos) * 1.570796326794897);
+            float in = QuarterSine(pos);
+            float out = QuarterSine(1.f - pos);
 
             return from * out + to * in;
         }
@@ -94,6 +109,25 @@ namespace wreath
             return from * (1.f - pos) + to;
         }
 
+        /**
+         * @brief The gains of the energy preserving crossfade at the given
+         * position.
+         * @see https://signalsmith-audio.co.uk/writing/2021/cheap-energy-crossfade/
+         *
+         * @param pos
+         * @return Gains
+         */
+        static constexpr Gains EqualCrossFadeGains(float pos)
+        {
+            float invPos = 1.f - pos;
+            float a = pos * invPos;
+            float b = a * (1.f + kEqualCrossFadeK * a);
+            float c = (b + pos);
+            float d = (b + invPos);
+
+            return {d * d, c * c};
+        }
+
         /**
          * @brief Energy preserving crossfade
          * @see https://signalsmith-audio.co.uk/writing/2021/cheap-energy-crossfade/
@@ -105,14 +139,31 @@ namespace wreath
          */
         static float EqualCrossFade(float from, float to, float pos)
         {
-            float invPos = 1.f - pos;
-            float k = -6.0026608f + kEqualCrossFadeP * (6.8773512f - 1.5838104f * kEqualCrossFadeP);
-            float a = pos * invPos;
-            float b = a * (1.f + k * a);
-            float c = (b + pos);
-            float d = (b + invPos);
+            Gains gains = EqualCrossFadeGains(pos);
+
+            return from * gains.from + to * gains.to;
+        }
 
-            return from * d * d + to * c * c;
+        /**
+         * @brief Fills the gains of the energy preserving crossfade for a
+         * block of positions, starting from the given one and advancing by
+         * step each sample, so that a whole segment of a fade can be applied
+         * at once. The loop has no branches and is vectorized.
+         *
+         * @param pos
+         * @param step
+         * @param fromGains
+         * @param toGains
+         * @param size
+         */
+        static void EqualCrossFadeRamp(float pos, float step, float *fromGains, float *toGains, size_t size)
+        {
+            for (size_t i = 0; i < size; i++)
+            {
+                Gains gains = EqualCrossFadeGains(pos + step * i);
+                fromGains[i] = gains.from;
+                toGains[i] = gains.to;
+            }
         }
 
         /**
@@ -165,6 +216,67 @@ namespace wreath
             return status_;
         }
 
+        /**
+         * @brief Processes up to size samples of a single fade at once, as
+         * Process() does, but returns the gains to apply to the signal fading
+         * in (or out) instead of mixing it with silence. Stops at the end of
+         * the fade, the rest of the gains keep the last value (see
+         * GetSamplesBeforeEnd()). Only for FADE_SINGLE faders.
+         *
+         * @param gains
+         * @param size
+         * @param in true if the signal fades in
+         * @return size_t The processed samples, fewer than size if the fade
+         * has ended
+         */
+        size_t ProcessGains(float *gains, size_t size, bool in)
+        {
+            if (0 == size)
+            {
+                return 0;
+            }
+            status_ = FadeStatus::FADING;
+            // The positions accumulate as in Process(), the gains are then
+            // computed all at once.
+            size_t samples = 0;
+            while (samples < size)
+            {
+                gains[samples++] = index_ * freq_;
+                index_ += rate_;
+                if (index_ >= samples_)
+                {
+                    status_ = FadeStatus::ENDED;
+                    break;
+                }
+            }
+            for (size_t i = 0; i < samples; i++)
+            {
+                Gains g = EqualCrossFadeGains(gains[i]);
+                gains[i] = in ? g.to : g.from;
+            }
+            std::fill(gains + samples, gains + size, gains[samples - 1]);
+
+            return samples;
+        }
+
+        /**
+         * @brief Returns how many samples can surely be processed before the
+         * one that ends the fade.
+         *
+         * @return size_t
+         */
+        size_t GetSamplesBeforeEnd()
+        {
+            if (rate_ <= 0.f)
+            {
+                return std::numeric_limits<size_t>::max();
+            }
+            // Keep clear of the end, the positions accumulate rounding errors.
+            float samples = (samples_ - index_) / rate_ - 2.f;
+
+            return samples > 0.f ? static_cast<size_t>(samples) : 0;
+        }
+
         float GetIndex()
         {
             return index_;
@@ -186,6 +298,48 @@ namespace wreath
         }
 
     private:
+        static constexpr float kEqualCrossFadeK{-6.0026608f + kEqualCrossFadeP * (6.8773512f - 1.5838104f * kEqualCrossFadeP)};
+
+        // sin(x * pi / 2) for x in [0, 1], from its Taylor series, so that
+        // the table is built at compile time.
+        static constexpr float Sine(double x)
+        {
+            double t = x * 1.570796326794897;
+            double t2 = t * t;
+            double term = t;
+            double sum = t;
+            for (int n = 1; n < 10; n++)
+            {
+                term *= -t2 / ((2 * n) * (2 * n + 1));
+                sum += term;
+            }
+
+            return static_cast<float>(sum);
+        }
+
+        static constexpr std::array<float, kCrossFadeTableSize + 2> MakeSineTable()
+        {
+            std::array<float, kCrossFadeTableSize + 2> table{};
+            for (size_t i = 0; i <= kCrossFadeTableSize; i++)
+            {
+                table[i] = Sine(static_cast<double>(i) / kCrossFadeTableSize);
+            }
+            // Guard for the interpolation at 1.
+            table[kCrossFadeTableSize + 1] = table[kCrossFadeTableSize];
+
+            return table;
+        }
+
+        static float QuarterSine(float pos)
+        {
+            static constexpr std::array<float, kCrossFadeTableSize + 2> table = MakeSineTable();
+            pos = (pos < 0.f ? 0.f : (pos > 1.f ? 1.f : pos)) * kCrossFadeTableSize;
+            size_t i = static_cast<size_t>(pos);
+            float frac = pos - i;
+
+            return table[i] + (table[i + 1] - table[i]) * frac;
+        }
+
         FadeType type_{FadeType::FADE_SINGLE};
         FadeStatus status_{FadeStatus::CREATED};
         float index_{};
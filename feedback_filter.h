@@ -0,0 +1,214 @@
+#pragma once
+
+#include "daisy_compat.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WREATH_STEREO_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WREATH_STEREO_NEON
+#endif
+
+namespace wreath
+{
+    /**
+     * @brief The left and right samples of a frame, in the lanes of a vector
+     * register where available, so that both the channels go through the
+     * same instructions.
+     */
+#if defined(WREATH_STEREO_SSE2)
+    struct StereoPair
+    {
+        __m128 v;
+
+        static StereoPair Set(float f) { return {_mm_set1_ps(f)}; }
+        static StereoPair Set(float left, float right) { return {_mm_setr_ps(left, right, 0.f, 0.f)}; }
+        float Left() const { return _mm_cvtss_f32(v); }
+        float Right() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))); }
+        StereoPair Abs() const { return {_mm_andnot_ps(_mm_set1_ps(-0.f), v)}; }
+        friend StereoPair operator+(StereoPair a, StereoPair b) { return {_mm_add_ps(a.v, b.v)}; }
+        friend StereoPair operator-(StereoPair a, StereoPair b) { return {_mm_sub_ps(a.v, b.v)}; }
+        friend StereoPair operator*(StereoPair a, StereoPair b) { return {_mm_mul_ps(a.v, b.v)}; }
+    };
+#elif defined(WREATH_STEREO_NEON)
+    struct StereoPair
+    {
+        float32x2_t v;
+
+        static StereoPair Set(float f) { return {vdup_n_f32(f)}; }
+        static StereoPair Set(float left, float right) { return {vset_lane_f32(right, vdup_n_f32(left), 1)}; }
+        float Left() const { return vget_lane_f32(v, 0); }
+        float Right() const { return vget_lane_f32(v, 1); }
+        StereoPair Abs() const { return {vabs_f32(v)}; }
+        friend StereoPair operator+(StereoPair a, StereoPair b) { return {vadd_f32(a.v, b.v)}; }
+        friend StereoPair operator-(StereoPair a, StereoPair b) { return {vsub_f32(a.v, b.v)}; }
+        friend StereoPair operator*(StereoPair a, StereoPair b) { return {vmul_f32(a.v, b.v)}; }
+    };
+#else
+    struct StereoPair
+    {
+        float left;
+        float right;
+
+        static StereoPair Set(float f) { return {f, f}; }
+        static StereoPair Set(float left, float right) { return {left, right}; }
+        float Left() const { return left; }
+        float Right() const { return right; }
+        StereoPair Abs() const { return {std::fabs(left), std::fabs(right)}; }
+        friend StereoPair operator+(StereoPair a, StereoPair b) { return {a.left + b.left, a.right + b.right}; }
+        friend StereoPair operator-(StereoPair a, StereoPair b) { return {a.left - b.left, a.right - b.right}; }
+        friend StereoPair operator*(StereoPair a, StereoPair b) { return {a.left * b.left, a.right * b.right}; }
+    };
+#endif
+
+    /**
+     * @brief The filter of the feedback, with its envelope follower, for both
+     * the channels at once. Each channel has its own state, while the
+     * parameters are shared.
+     *
+     * The filter is the double sampled state variable filter of DaisySP (see
+     * daisysp::Svf), the envelope is an average of the rectified signal with
+     * its DC offset removed.
+     */
+    class FeedbackFilter
+    {
+    public:
+        enum Output
+        {
+            LOW,
+            BAND,
+            HIGH,
+        };
+
+        FeedbackFilter() {}
+        ~FeedbackFilter() {}
+
+        void Init(float sampleRate)
+        {
+            sampleRate_ = sampleRate;
+            maxFreq_ = sampleRate_ / 3.f;
+            res_ = 0.5f;
+            preDrive_ = 0.5f;
+            drive_ = 0.5f;
+            freq_ = 0.25f;
+            damp_ = 0.f;
+            Reset();
+        }
+
+        /**
+         * @brief Clears the state of both the channels.
+         */
+        void Reset()
+        {
+            low_ = StereoPair::Set(0.f);
+            band_ = StereoPair::Set(0.f);
+            average_ = StereoPair::Set(0.f);
+            envelope_ = StereoPair::Set(0.f);
+        }
+
+        /**
+         * @brief Sets the cutoff frequency, in Hz.
+         *
+         * @param freq
+         */
+        void SetFreq(float freq)
+        {
+            float cutoff = daisysp::fclamp(freq, 1.0e-6f, maxFreq_);
+            // The sample rate is doubled, as the filter runs twice per sample.
+            freq_ = 2.f * std::sin(PI_F * std::min(0.25f, cutoff / (sampleRate_ * 2.f)));
+            UpdateDamp();
+        }
+
+        /**
+         * @brief Sets the resonance, in [0, 1].
+         *
+         * @param res
+         */
+        void SetRes(float res)
+        {
+            res_ = daisysp::fclamp(res, 0.f, 1.f);
+            drive_ = preDrive_ * res_;
+            UpdateDamp();
+        }
+
+        /**
+         * @brief Sets the drive, in [0, 10].
+         *
+         * @param drive
+         */
+        void SetDrive(float drive)
+        {
+            preDrive_ = daisysp::fclamp(drive * 0.1f, 0.f, 1.f);
+            drive_ = preDrive_ * res_;
+        }
+
+        /**
+         * @brief Filters a frame and returns the given output of the filter.
+         *
+         * @param input
+         * @param output
+         * @return StereoPair
+         */
+        inline StereoPair Process(StereoPair input, Output output)
+        {
+            StereoPair freq = StereoPair::Set(freq_);
+            StereoPair damp = StereoPair::Set(damp_);
+            StereoPair drive = StereoPair::Set(drive_);
+
+            StereoPair sum = StereoPair::Set(0.f);
+            for (int pass = 0; pass < 2; pass++)
+            {
+                StereoPair notch = input - damp * band_;
+                low_ = low_ + freq * band_;
+                StereoPair high = notch - low_;
+                band_ = freq * high + band_ - drive * band_ * band_ * band_;
+                sum = sum + (LOW == output ? low_ : (HIGH == output ? high : band_));
+            }
+
+            return sum * StereoPair::Set(0.5f);
+        }
+
+        /**
+         * @brief Follows the envelope of a frame and returns it.
+         *
+         * @param sample
+         * @return StereoPair
+         */
+        inline StereoPair GetEnv(StereoPair sample)
+        {
+            StereoPair weight = StereoPair::Set(kEnvWeight);
+            StereoPair rest = StereoPair::Set(1.f - kEnvWeight);
+
+            // Remove the average DC offset, then the ripple.
+            average_ = weight * sample + rest * average_;
+            envelope_ = weight * (sample - average_).Abs() + rest * envelope_;
+
+            return envelope_;
+        }
+
+    private:
+        static constexpr float kEnvWeight{0.0001f};
+
+        void UpdateDamp()
+        {
+            damp_ = std::min(2.f * (1.f - std::pow(res_, 0.25f)), std::min(2.f, 2.f / freq_ - freq_ * 0.5f));
+        }
+
+        float sampleRate_{};
+        float maxFreq_{};
+        float res_{};
+        float preDrive_{};
+        float drive_{};
+        float freq_{};
+        float damp_{};
+
+        StereoPair low_{};
+        StereoPair band_{};
+        StereoPair average_{};
+        StereoPair envelope_{};
+    };
+} // namespace wreath
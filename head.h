@@ -1,16 +1,20 @@
 #pragma once
 
 #include "fader.h"
+#include "interpolation.h"
+#include "sample_format.h"
 #include <algorithm>
 #include <cmath>
 #include <cstdint>
 #include <cstring>
+#include <limits>
 
 namespace wreath
 {
     constexpr float kMinLoopLengthSamples{46.f}; // ~C1 @ 48KHz
     constexpr float kMinSamplesForTone{91.f};    // ~C2 @ 48KHz
     constexpr float kMinSamplesForFlanger{1722.f};
+    constexpr size_t kMaxBlockSize{128}; // Max samples processed in one go
 
     enum Type
     {
@@ -61,20 +65,37 @@ namespace wreath
             intLoopEnd_ = 0;
         }
 
-        void Init(float *buffer, float *buffer2, int32_t maxBufferSamples)
+        /**
+         * @brief Inits the head with its buffers. With a stride of 2 the
+         * samples of the head's channel are interleaved with those of another
+         * one, so the buffers must hold twice the samples. The buffers in a
+         * compact format must be sized with storage::BufferBytes().
+         *
+         * @param buffer
+         * @param buffer2
+         * @param maxBufferSamples
+         * @param stride
+         * @param format
+         */
+        void Init(void *buffer, void *buffer2, int32_t maxBufferSamples, int32_t stride = 1, SampleFormat format = SampleFormat::FLOAT)
         {
-            buffer_ = buffer;
-            freezeBuffer_ = buffer2;
+            buffer_ = static_cast<uint8_t *>(buffer);
+            freezeBuffer_ = static_cast<uint8_t *>(buffer2);
             maxBufferSamples_ = maxBufferSamples;
+            format_ = format;
+            bytes_ = storage::BytesPerSample(format);
+            pitch_ = stride * bytes_;
             rate_ = 1.f;
             looping_ = false;
             movement_ = Movement::NORMAL;
             direction_ = Direction::FORWARD;
-            samplesToFade_ = std::min(kSamplesToFade, loopLength_ / 2.f);
+            samplesToFade_ = std::min(kSamplesToFade, static_cast<float>(loopLength_ / 2));
             Reset();
+            // Build the sinc table now, and not in the audio callback.
+            interpolation::GetSincTable();
         }
 
-        float SetLoopStart(float start)
+        double SetLoopStart(double start)
         {
             loopStart_ = start;
             intLoopStart_ = loopStart_;
@@ -86,24 +107,24 @@ namespace wreath
             return loopStart_;
         }
 
-        float SetLoopLength(float length)
+        double SetLoopLength(double length)
         {
             loopLength_ = length;
             intLoopLength_ = loopLength_;
             CalculateLoopEnd();
-            samplesToFade_ = std::min(kSamplesToFade, loopLength_ / 2.f);
+            samplesToFade_ = std::min(kSamplesToFade, static_cast<float>(loopLength_ / 2));
 
             return loopLength_;
         }
 
-        void SetLoopStartAndLength(float start, float length)
+        void SetLoopStartAndLength(double start, double length)
         {
             loopStart_ = start;
             intLoopStart_ = loopStart_;
             loopLength_ = length;
             intLoopLength_ = loopLength_;
             CalculateLoopEnd();
-            samplesToFade_ = std::min(kSamplesToFade, loopLength_ / 2.f);
+            samplesToFade_ = std::min(kSamplesToFade, static_cast<float>(loopLength_ / 2));
         }
 
         inline void SetFreeze(float amount)
@@ -131,6 +152,22 @@ namespace wreath
             }
         }
 
+        /**
+         * @brief Sets the freeze amount without fading the recording in the
+         * freeze buffer, for when it already holds the frozen content (e.g. a
+         * restored session).
+         *
+         * @param amount
+         */
+        inline void SetFrozen(float amount)
+        {
+            freezeAmount_ = amount;
+            frozen_ = amount > 0;
+            mustFreeze_ = false;
+            mustUnfreeze_ = false;
+            freezeFadeIndex_ = 0;
+        }
+
         inline void SetRate(float rate)
         {
             rate_ = std::abs(rate);
@@ -145,7 +182,12 @@ namespace wreath
             direction_ = direction;
         }
 
-        inline void SetIndex(float index)
+        inline void SetInterpolation(Interpolation interpolation)
+        {
+            interpolation_ = interpolation;
+        }
+
+        inline void SetIndex(double index)
         {
             index_ = index;
             intIndex_ = std::floor(index_);
@@ -173,7 +215,7 @@ namespace wreath
                 return Action::NO_ACTION;
             }
 
-            float index = index_ + (rate_ * direction_);
+            double index = index_ + (rate_ * direction_);
             SetIndex(index);
             Action action = HandleLoopAction();
 
@@ -202,6 +244,71 @@ namespace wreath
             return action;
         }
 
+        /**
+         * @brief Returns how many of the next position updates (up to size)
+         * are guaranteed to cause no loop action and no buffer wrapping, so
+         * that they can be done in one go with Advance().
+         *
+         * @param size
+         * @return size_t
+         */
+        size_t SamplesToBoundary(size_t size)
+        {
+            if (!active_)
+            {
+                return size;
+            }
+
+            double distance{};
+            float stop = looping_ ? 0.f : samplesToFade_;
+            bool forward = Direction::FORWARD == direction_;
+            // Normal loop, the head stops or loops at the boundary.
+            if (intLoopEnd_ > intLoopStart_)
+            {
+                distance = forward ? (loopEnd_ - stop) - index_ : index_ - (loopStart_ + stop);
+            }
+            // Inverted loop, the head is in the segment at the end of the
+            // buffer and wraps around it.
+            else if (index_ >= loopStart_)
+            {
+                distance = forward ? bufferSamples_ - index_ : index_ - (loopStart_ + stop);
+            }
+            // Inverted loop, the head is in the segment at the start of the
+            // buffer and wraps around it.
+            else if (index_ <= loopEnd_)
+            {
+                distance = forward ? (loopEnd_ - stop) - index_ : index_;
+            }
+
+            if (distance <= 0)
+            {
+                return 0;
+            }
+            if (rate_ <= 0.f)
+            {
+                return size;
+            }
+
+            // Keep a sample of margin for the rounding errors.
+            size_t samples = static_cast<size_t>(distance / rate_);
+
+            return samples > 1 ? std::min(size, samples - 1) : 0;
+        }
+
+        /**
+         * @brief Moves the head by the given number of samples, that must not
+         * exceed the value returned by SamplesToBoundary().
+         *
+         * @param samples
+         */
+        inline void Advance(size_t samples)
+        {
+            if (active_)
+            {
+                SetIndex(index_ + rate_ * direction_ * samples);
+            }
+        }
+
         float GetSamplesToFade()
         {
             return samplesToFade_;
@@ -209,7 +316,7 @@ namespace wreath
 
         void SetSamplesToFade(float samples)
         {
-            samplesToFade_ = loopLength_ ? std::min(samples, loopLength_ / 2.f) : samples;
+            samplesToFade_ = loopLength_ ? std::min(samples, static_cast<float>(loopLength_ / 2)) : samples;
         }
 
         float ReadFrozen()
@@ -222,47 +329,67 @@ namespace wreath
             return ReadAt(buffer_, index_);
         }
 
-        bool toggleOnset{true};
-        int32_t previousE_{};
         /**
-         * @brief Bresenham implementation of an Euclidean Rhythm Algorithm.
+         * @brief Reads a block of samples starting from the current position,
+         * at the current rate plus the given increment per sample. The
+         * position is not updated, and the loop boundaries are not handled:
+         * the block must end before the next loop action.
+         *
+         * @param out
+         * @param size
+         * @param rateIncrement
          */
-        bool BresenhamEuclidean(float pulses, float onsetAmount)
+        void ReadBlock(float *out, size_t size, float rateIncrement = 0.f)
         {
-            float ratio = bufferSamples_ / pulses;
-            float onsets = onsetAmount * pulses;
-            if (onsets == pulses)
-            {
-                toggleOnset = false;
-            }
-            else if (onsets == 0)
+            ReadBlockAt(buffer_, out, size, rateIncrement);
+        }
+
+        /**
+         * @brief Same as ReadBlock, but from the freeze buffer.
+         *
+         * @param out
+         * @param size
+         * @param rateIncrement
+         */
+        void ReadFrozenBlock(float *out, size_t size, float rateIncrement = 0.f)
+        {
+            if (frozen_)
             {
-                toggleOnset = true;
+                ReadBlockAt(freezeBuffer_, out, size, rateIncrement);
             }
             else
             {
-                float slope = onsets / pulses;
-                int32_t current = (index_ / ratio) * slope;
-                if (current != previousE_)
-                {
-                    toggleOnset = !toggleOnset;
-                }
-                previousE_ = current;
+                std::fill(out, out + size, 0.f);
             }
-            return toggleOnset;
         }
 
         /**
-         * @brief Handles the freeze buffer on writing.
+         * @brief Returns the index of the given sample of a block starting
+         * from the current position, as written by WriteBlock().
+         *
+         * @param i
+         * @return int32_t
+         */
+        inline int32_t GetBlockIndex(size_t i)
+        {
+            float step = rate_ * direction_;
+
+            return static_cast<int32_t>(std::floor(index_ + step * i));
+        }
+
+        /**
+         * @brief Handles the freeze buffer on writing at the given index.
          *
          * @param input
+         * @param index
          */
-        void HandleFreeze(float input)
+        void HandleFreeze(float input, int32_t index)
         {
-            float frozenValue = freezeBuffer_[intIndex_];
+            // Out of the fades the freeze buffer is left alone: it's a snapshot
+            // of the buffer, taken by the looper when freezing.
             if (mustFreeze_)
             {
-                input = Fader::EqualCrossFade(input, frozenValue, freezeFadeIndex_ * (1.f / samplesToFade_));
+                input = Fader::EqualCrossFade(input, Load(freezeBuffer_, index), freezeFadeIndex_ * (1.f / samplesToFade_));
                 if (freezeFadeIndex_ >= samplesToFade_)
                 {
                     mustFreeze_ = false;
@@ -272,7 +399,7 @@ namespace wreath
             }
             else if (mustUnfreeze_)
             {
-                input = Fader::EqualCrossFade(frozenValue, input, freezeFadeIndex_ * (1.f / samplesToFade_));
+                input = Fader::EqualCrossFade(Load(freezeBuffer_, index), input, freezeFadeIndex_ * (1.f / samplesToFade_));
                 if (freezeFadeIndex_ >= samplesToFade_)
                 {
                     mustUnfreeze_ = false;
@@ -280,10 +407,64 @@ namespace wreath
                 }
                 freezeFadeIndex_ += rate_;
             }
-            if (!frozen_ || mustUnfreeze_)
+            else
             {
-                freezeBuffer_[intIndex_] = input;
+                return;
             }
+            Store(freezeBuffer_, index, input);
+        }
+
+        /**
+         * @brief Writes a stretch of a block while the freeze buffer is being
+         * faded, as HandleFreeze() does for each sample but with the gains of
+         * the whole stretch computed at once. Stops at the sample that ends
+         * the fade.
+         *
+         * @param input
+         * @param offset The samples of the block before the stretch
+         * @param size
+         * @return size_t The written samples
+         */
+        size_t WriteFreezeFade(const float *input, size_t offset, size_t size)
+        {
+            // The fade ends on the first sample whose position reaches its
+            // length, that sample included.
+            size_t samples = size;
+            bool end{};
+            if (rate_ > 0)
+            {
+                float remaining = std::max(std::ceil((samplesToFade_ - freezeFadeIndex_) / rate_), 0.f);
+                if (remaining < size)
+                {
+                    samples = static_cast<size_t>(remaining) + 1;
+                    end = true;
+                }
+            }
+
+            float gains[2][kMaxBlockSize];
+            float scale = 1.f / samplesToFade_;
+            Fader::EqualCrossFadeRamp(freezeFadeIndex_ * scale, rate_ * scale, gains[0], gains[1], samples);
+            // Freezing fades the input out of the freeze buffer, unfreezing
+            // fades it back in.
+            const float *inputGains = mustFreeze_ ? gains[0] : gains[1];
+            const float *frozenGains = mustFreeze_ ? gains[1] : gains[0];
+            float step = rate_ * direction_;
+            for (size_t i = 0; i < samples; i++)
+            {
+                int32_t index = static_cast<int32_t>(std::floor(index_ + step * (offset + i)));
+                Store(freezeBuffer_, index, input[i] * inputGains[i] + Load(freezeBuffer_, index) * frozenGains[i]);
+                Store(buffer_, index, input[i]);
+            }
+            freezeFadeIndex_ += rate_ * samples;
+
+            if (end)
+            {
+                frozen_ = mustFreeze_;
+                mustFreeze_ = false;
+                mustUnfreeze_ = false;
+            }
+
+            return samples;
         }
 
         /**
@@ -293,20 +474,112 @@ namespace wreath
          */
         void Write(float input)
         {
-            HandleFreeze(input);
-            buffer_[intIndex_] = input;
+            HandleFreeze(input, intIndex_);
+            Store(buffer_, intIndex_, input);
+        }
+
+        /**
+         * @brief Writes a block of values, starting from the current position
+         * and moving at the current rate. The position is not updated, and the
+         * block must end before the next loop action.
+         *
+         * @param input
+         * @param size
+         */
+        void WriteBlock(const float *input, size_t size)
+        {
+            float step = rate_ * direction_;
+            size_t i = 0;
+            while (i < size && (mustFreeze_ || mustUnfreeze_))
+            {
+                i += WriteFreezeFade(input + i, i, std::min(size - i, kMaxBlockSize));
+            }
+            for (; i < size; i++)
+            {
+                int32_t index = static_cast<int32_t>(std::floor(index_ + step * i));
+                Store(buffer_, index, input[i]);
+            }
         }
 
         /**
-         * @brief Clears the buffers.
+         * @brief Clears the given range of both the buffers.
          *
+         * @param start
+         * @param end Excluded
          */
-        void ClearBuffer()
+        void ClearBuffer(int32_t start, int32_t end)
         {
-            memset(buffer_, 0.f, maxBufferSamples_);
-            memset(freezeBuffer_, 0.f, maxBufferSamples_);
+            start = std::max(start, 0);
+            end = std::min(end, maxBufferSamples_);
+            if (start >= end)
+            {
+                return;
+            }
+            // Zero is all bits clear in every format.
+            if (pitch_ == bytes_)
+            {
+                std::memset(buffer_ + Offset(start), 0, Offset(end - start));
+                std::memset(freezeBuffer_ + Offset(start), 0, Offset(end - start));
+                return;
+            }
+            for (int32_t i = start; i < end; i++)
+            {
+                std::memset(buffer_ + Offset(i), 0, bytes_);
+                std::memset(freezeBuffer_ + Offset(i), 0, bytes_);
+            }
         }
 
+        /**
+         * @brief Copies the given range of the buffer to the freeze buffer.
+         *
+         * @param start
+         * @param end Excluded
+         */
+        void CopyToFreezeBuffer(int32_t start, int32_t end)
+        {
+            start = std::max(start, 0);
+            end = std::min(end, maxBufferSamples_);
+            if (start >= end)
+            {
+                return;
+            }
+            if (pitch_ == bytes_)
+            {
+                std::memcpy(freezeBuffer_ + Offset(start), buffer_ + Offset(start), Offset(end - start));
+                return;
+            }
+            for (int32_t i = start; i < end; i++)
+            {
+                std::memcpy(freezeBuffer_ + Offset(i), buffer_ + Offset(i), bytes_);
+            }
+        }
+
+        /**
+         * @brief Copies the given range of the buffer to output, converted to
+         * float, at the same indexes.
+         *
+         * @param output
+         * @param start
+         * @param end Excluded
+         */
+        void ReadSamples(float *output, int32_t start, int32_t end)
+        {
+            start = std::max(start, 0);
+            end = std::min(end, maxBufferSamples_);
+            if (SampleFormat::FLOAT == format_ && pitch_ == bytes_ && start < end)
+            {
+                std::memcpy(output + start, buffer_ + Offset(start), Offset(end - start));
+                return;
+            }
+            for (int32_t i = start; i < end; i++)
+            {
+                output[i] = Load(buffer_, i);
+            }
+        }
+
+        inline int32_t GetMaxBufferSamples() { return maxBufferSamples_; }
+        inline SampleFormat GetSampleFormat() { return format_; }
+
         /**
          * @brief This is used by the buffering procedure, not sure if could be
          * replaced with the regular writing.
@@ -317,8 +590,7 @@ namespace wreath
          */
         bool Buffer(float value)
         {
-            buffer_[intIndex_] = value;
-            freezeBuffer_[intIndex_] = value;
+            Store(buffer_, intIndex_, value);
             bufferSamples_ = intIndex_ + 1;
 
             // End of available buffer?
@@ -332,6 +604,34 @@ namespace wreath
             return false;
         }
 
+        /**
+         * @brief Buffers a block of values at once, as Buffer() does for a
+         * single one. The values past the end of the buffer are dropped.
+         *
+         * @param input
+         * @param size
+         * @return true if the end of the buffer has been reached
+         */
+        bool BufferBlock(const float *input, size_t size)
+        {
+            int32_t count = static_cast<int32_t>(std::min(size, static_cast<size_t>(maxBufferSamples_ - intIndex_)));
+            if (SampleFormat::FLOAT == format_ && pitch_ == bytes_)
+            {
+                std::memcpy(buffer_ + Offset(intIndex_), input, Offset(count));
+            }
+            else
+            {
+                for (int32_t i = 0; i < count; i++)
+                {
+                    Store(buffer_, intIndex_ + i, input[i]);
+                }
+            }
+            bufferSamples_ = intIndex_ + count;
+            intIndex_ = std::min(bufferSamples_, maxBufferSamples_ - 1);
+
+            return bufferSamples_ >= maxBufferSamples_;
+        }
+
         /**
          * @brief Inits the buffer used by this head by passing its length.
          *
@@ -344,7 +644,7 @@ namespace wreath
             intLoopLength_ = loopLength_;
             loopEnd_ = loopLength_ - 1.f;
             intLoopEnd_ = loopEnd_;
-            samplesToFade_ = std::min(kSamplesToFade, loopLength_ / 2.f);
+            samplesToFade_ = std::min(kSamplesToFade, static_cast<float>(loopLength_ / 2));
         }
 
         /**
@@ -361,7 +661,7 @@ namespace wreath
             loopEnd_ = loopLength_ - 1.f;
             intLoopEnd_ = loopEnd_;
             ResetPosition();
-            samplesToFade_ = std::min(kSamplesToFade, loopLength_ / 2.f);
+            samplesToFade_ = std::min(kSamplesToFade, static_cast<float>(loopLength_ / 2));
 
             return bufferSamples_;
         }
@@ -389,33 +689,42 @@ namespace wreath
         }
 
         inline int32_t GetBufferSamples() { return bufferSamples_; }
-        inline float GetLoopEnd() { return loopEnd_; }
-        inline float GetLoopLength() { return loopLength_; }
+        inline double GetLoopEnd() { return loopEnd_; }
+        inline double GetLoopLength() { return loopLength_; }
         inline float GetRate() { return rate_; }
-        inline float GetPosition() { return index_; }
+        inline Interpolation GetInterpolation() { return interpolation_; }
+        inline double GetPosition() { return index_; }
         inline float GetOffset() { return offset_; }
         inline int32_t GetIntPosition() { return intIndex_; }
+        inline bool IsActive() { return active_; }
+        inline bool IsFrozen() { return frozen_; }
+        inline Direction GetDirection() { return direction_; }
         bool IsGoingForward() { return Direction::FORWARD == direction_; }
 
     private:
         const Type type_;
-        float *buffer_;
-        float *freezeBuffer_;
+        uint8_t *buffer_;
+        uint8_t *freezeBuffer_;
 
         int32_t maxBufferSamples_{}; // The whole buffer length in samples
+        SampleFormat format_{};      // How the samples are stored in the buffers
+        int32_t bytes_{4};           // The size of a sample
+        int32_t pitch_{4};           // The distance in bytes between two samples in the buffers
         int32_t bufferSamples_{};    // The written buffer length in samples
 
         int32_t intIndex_{};
-        float index_{};
+        double index_{}; // Double, to keep the fractional part in long buffers
         float rate_{};
         float fadeIndex_{};
         bool loopSync_{};
 
-        float loopStart_{};
+        // Double as the index, so that the loop points don't lose precision in
+        // long buffers.
+        double loopStart_{};
         int32_t intLoopStart_{};
-        float loopEnd_{};
+        double loopEnd_{};
         int32_t intLoopEnd_{};
-        float loopLength_{};
+        double loopLength_{};
         int32_t intLoopLength_{};
 
         bool active_{};
@@ -423,6 +732,7 @@ namespace wreath
 
         Movement movement_{};
         Direction direction_{};
+        Interpolation interpolation_{};
 
         float freezeAmount_{};
         bool frozen_{};
@@ -565,6 +875,63 @@ namespace wreath
             intLoopEnd_ = loopEnd_;
         }
 
+        inline ptrdiff_t Offset(int32_t index)
+        {
+            return static_cast<ptrdiff_t>(index) * pitch_;
+        }
+
+        /**
+         * @brief Reads the sample at the given (integral) index of the buffer
+         * of choice, converting it from the storage format.
+         *
+         * @param buffer
+         * @param index
+         * @return float
+         */
+        float Load(const uint8_t *buffer, int32_t index)
+        {
+            const uint8_t *p = buffer + Offset(index);
+            switch (format_)
+            {
+            case SampleFormat::INT16:
+                return storage::Int16::Load(p);
+            case SampleFormat::INT24:
+                return storage::Int24::Load(p);
+            case SampleFormat::BFLOAT16:
+                return storage::BFloat16::Load(p);
+            default:
+                return storage::Float::Load(p);
+            }
+        }
+
+        /**
+         * @brief Writes the sample at the given index of the buffer of choice,
+         * converting it to the storage format.
+         *
+         * @param buffer
+         * @param index
+         * @param value
+         */
+        void Store(uint8_t *buffer, int32_t index, float value)
+        {
+            uint8_t *p = buffer + Offset(index);
+            switch (format_)
+            {
+            case SampleFormat::INT16:
+                storage::Int16::Store(p, value);
+                break;
+            case SampleFormat::INT24:
+                storage::Int24::Store(p, value);
+                break;
+            case SampleFormat::BFLOAT16:
+                storage::BFloat16::Store(p, value);
+                break;
+            default:
+                storage::Float::Store(p, value);
+                break;
+            }
+        }
+
         /**
          * @brief Reads the value in the buffer of choice at the given index.
          * Uses interpolation if the index is not integral.
@@ -573,19 +940,274 @@ namespace wreath
          * @param index
          * @return float
          */
-        float ReadAt(float *buffer, float index)
+        float ReadAt(const uint8_t *buffer, double index)
         {
+            switch (format_)
+            {
+            case SampleFormat::INT16:
+                return ReadAt<storage::Int16>(buffer, index);
+            case SampleFormat::INT24:
+                return ReadAt<storage::Int24>(buffer, index);
+            case SampleFormat::BFLOAT16:
+                return ReadAt<storage::BFloat16>(buffer, index);
+            default:
+                return ReadAt<storage::Float>(buffer, index);
+            }
+        }
+
+        template <typename Storage>
+        float ReadAt(const uint8_t *buffer, double index)
+        {
+            switch (interpolation_)
+            {
+            case Interpolation::HERMITE:
+                return ReadPointsAt<interpolation::Hermite, Storage>(buffer, index);
+            case Interpolation::LAGRANGE:
+                return ReadPointsAt<interpolation::Lagrange, Storage>(buffer, index);
+            case Interpolation::SINC:
+            {
+                int32_t intPos = std::floor(index);
+                return interpolation::Sinc([this, buffer, intPos](int32_t j)
+                                           { return Storage::Load(buffer + Offset(WrapTap(intPos, intPos + j))); },
+                                           index - intPos, interpolation::SincScale(rate_));
+            }
+            default:
+                break;
+            }
+
             int32_t intPos = index;
-            float value = buffer[intPos];
+            float value = Storage::Load(buffer + Offset(intPos));
             float frac = index - intPos;
 
             // Interpolate value only it the index has a fractional part.
             if (frac > std::numeric_limits<float>::epsilon())
             {
-                value = value + (buffer[WrapIndex(intPos + direction_)] - value) * frac;
+                value = value + (Storage::Load(buffer + Offset(WrapIndex(intPos + direction_))) - value) * frac;
             }
 
             return value;
         }
+
+        /**
+         * @brief Reads the value at the given index with a fixed-points
+         * kernel, wrapping each point.
+         *
+         * @param buffer
+         * @param index
+         * @return float
+         */
+        template <typename Kernel, typename Storage>
+        float ReadPointsAt(const uint8_t *buffer, double index)
+        {
+            int32_t intPos = std::floor(index);
+            interpolation::Scalar y[Kernel::kPoints];
+            for (int32_t p = 0; p < Kernel::kPoints; p++)
+            {
+                y[p] = {Storage::Load(buffer + Offset(WrapTap(intPos, intPos + Kernel::Offset(p, direction_))))};
+            }
+
+            return Kernel::Interpolate(y, interpolation::Scalar{static_cast<float>(index - intPos)}).v;
+        }
+
+        /**
+         * @brief Wraps the index of a point used by the interpolation around
+         * the loop the head is in, or around the buffer.
+         *
+         * @param from The head's position
+         * @param index
+         * @return int32_t
+         */
+        int32_t WrapTap(int32_t from, int32_t index)
+        {
+            int32_t frame{bufferSamples_ - 1};
+
+            // Handle normal loop boundaries.
+            if (intLoopEnd_ > intLoopStart_)
+            {
+                if (from >= intLoopStart_ && from <= intLoopEnd_)
+                {
+                    int32_t length{intLoopEnd_ - intLoopStart_ + 1};
+                    if (index > intLoopEnd_)
+                    {
+                        index -= length;
+                    }
+                    else if (index < intLoopStart_)
+                    {
+                        index += length;
+                    }
+                }
+            }
+            // Handle inverted loop boundaries, skipping the gap between the
+            // end and the start point.
+            else if (index > intLoopEnd_ && index < intLoopStart_)
+            {
+                int32_t gap{intLoopStart_ - intLoopEnd_ - 1};
+                if (from <= intLoopEnd_)
+                {
+                    index += gap;
+                }
+                else if (from >= intLoopStart_)
+                {
+                    index -= gap;
+                }
+            }
+
+            if (index > frame)
+            {
+                index -= bufferSamples_;
+            }
+            else if (index < 0)
+            {
+                index += bufferSamples_;
+            }
+
+            return std::min(std::max(index, static_cast<int32_t>(0)), frame);
+        }
+
+        /**
+         * @brief Returns how many samples, starting at the given index and
+         * moving at most at the given rate, can be read without wrapping any
+         * of the points used by the interpolation, that go from before to
+         * after relatively to the sample.
+         *
+         * @param index
+         * @param rate
+         * @param size
+         * @param before
+         * @param after
+         * @return size_t
+         */
+        size_t SamplesToNeighbourWrap(double index, float rate, size_t size, int32_t before, int32_t after)
+        {
+            int32_t intPos = index;
+            int32_t lo{intLoopStart_};
+            int32_t hi{intLoopEnd_};
+
+            // Inverted loop, the head is in either one of the two segments.
+            if (intLoopEnd_ <= intLoopStart_)
+            {
+                if (intPos >= 0 && intPos <= intLoopEnd_)
+                {
+                    lo = 0;
+                }
+                else
+                {
+                    hi = bufferSamples_ - 1;
+                }
+            }
+            if (intPos + before < lo || intPos + after > hi)
+            {
+                return 0;
+            }
+
+            double distance = FORWARD == direction_ ? (hi - after + 1) - index : index - (lo - before);
+            if (distance <= 0)
+            {
+                return 0;
+            }
+            if (rate <= 0.f)
+            {
+                return size;
+            }
+
+            return std::min(size, static_cast<size_t>(distance / rate));
+        }
+
+        /**
+         * @brief Reads a block of samples from the buffer of choice. The
+         * samples are read with the vector kernels in segments, only the ones
+         * whose interpolation points must be wrapped are read one by one.
+         *
+         * @param buffer
+         * @param out
+         * @param size
+         * @param rateIncrement
+         */
+        void ReadBlockAt(const uint8_t *buffer, float *out, size_t size, float rateIncrement)
+        {
+            switch (format_)
+            {
+            case SampleFormat::INT16:
+                ReadBlockAt<storage::Int16>(buffer, out, size, rateIncrement);
+                break;
+            case SampleFormat::INT24:
+                ReadBlockAt<storage::Int24>(buffer, out, size, rateIncrement);
+                break;
+            case SampleFormat::BFLOAT16:
+                ReadBlockAt<storage::BFloat16>(buffer, out, size, rateIncrement);
+                break;
+            default:
+                ReadBlockAt<storage::Float>(buffer, out, size, rateIncrement);
+                break;
+            }
+        }
+
+        template <typename Storage>
+        void ReadBlockAt(const uint8_t *buffer, float *out, size_t size, float rateIncrement)
+        {
+            double index = index_;
+            float rate = rate_;
+            float scale = interpolation::SincScale(std::max(rate, rate + rateIncrement * size));
+
+            // The points used by the interpolation, relative to the sample.
+            int32_t before{std::min(0, static_cast<int32_t>(direction_))};
+            int32_t after{std::max(0, static_cast<int32_t>(direction_))};
+            if (Interpolation::HERMITE == interpolation_ || Interpolation::LAGRANGE == interpolation_)
+            {
+                before = -1;
+                after = 2;
+            }
+            else if (Interpolation::SINC == interpolation_)
+            {
+                after = interpolation::SincTaps(scale);
+                before = 1 - after;
+            }
+
+            size_t done = 0;
+            while (done < size)
+            {
+                size_t left = size - done;
+                size_t samples = SamplesToNeighbourWrap(index, std::max(rate, rate + rateIncrement * left), left, before, after);
+                if (samples > 0)
+                {
+                    float step = rate * direction_;
+                    float stepIncrement = rateIncrement * direction_;
+                    switch (interpolation_)
+                    {
+                    case Interpolation::HERMITE:
+                        interpolation::Read<interpolation::Hermite, Storage>(buffer, pitch_, index, step, stepIncrement, direction_, out + done, samples);
+                        break;
+                    case Interpolation::LAGRANGE:
+                        interpolation::Read<interpolation::Lagrange, Storage>(buffer, pitch_, index, step, stepIncrement, direction_, out + done, samples);
+                        break;
+                    case Interpolation::SINC:
+                        interpolation::ReadSinc<Storage>(buffer, pitch_, index, step, stepIncrement, scale, out + done, samples);
+                        break;
+                    default:
+                        interpolation::ReadLinear<Storage>(buffer, pitch_, index, step, stepIncrement, direction_, out + done, samples);
+                        break;
+                    }
+                    index += interpolation::Offset(samples, rate, rateIncrement) * direction_;
+                    rate += rateIncrement * samples;
+                    done += samples;
+                }
+                else
+                {
+                    out[done] = ReadAt<Storage>(buffer, index);
+                    index += rate * direction_;
+                    rate += rateIncrement;
+                    done++;
+                }
+
+                if (index >= bufferSamples_)
+                {
+                    index -= bufferSamples_;
+                }
+                else if (index < 0)
+                {
+                    index += bufferSamples_;
+                }
+            }
+        }
     };
 } // namespace wreath
\ No newline at end of file
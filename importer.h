@@ -0,0 +1,191 @@
+#pragma once
+
+#include "stereo_looper.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace wreath
+{
+    constexpr size_t kImportFrames{4096}; // Frames read from the file at a time
+
+    /**
+     * @brief Fills a looper with the content of a WAV file, without going
+     * through the audio callback, e.g. to pre-load the loops of a batch job.
+     * Not available on the Daisy.
+     */
+    class Importer
+    {
+    public:
+        /**
+         * @brief Imports the given WAV file (16, 24 or 32-bit PCM, or 32-bit
+         * float) in the looper, see StereoLooper::Import(). A mono file goes
+         * to both the channels, only the first two channels of the others
+         * are used. The sample rate is not converted. Call this when the
+         * looper is not being processed. Not real-time safe.
+         *
+         * @param path
+         * @param looper
+         * @return false if the file can't be read or its format is not
+         * supported
+         */
+        static bool Import(const char *path, StereoLooper &looper)
+        {
+            FILE *file = std::fopen(path, "rb");
+            if (!file)
+            {
+                return false;
+            }
+            bool ok = Import(file, looper);
+            std::fclose(file);
+
+            return ok;
+        }
+
+    private:
+        enum Encoding
+        {
+            PCM = 1,
+            IEEE_FLOAT = 3,
+            EXTENSIBLE = 0xfffe,
+        };
+
+        struct Format
+        {
+            uint16_t encoding;
+            uint16_t channels;
+            uint16_t bits;
+        };
+
+        static uint32_t GetU32(const uint8_t *p)
+        {
+            return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+        }
+
+        static uint16_t GetU16(const uint8_t *p)
+        {
+            return static_cast<uint16_t>(p[0] | p[1] << 8);
+        }
+
+        static float Decode(const uint8_t *p, const Format &format)
+        {
+            if (IEEE_FLOAT == format.encoding)
+            {
+                float value;
+                std::memcpy(&value, p, sizeof(value));
+
+                return value;
+            }
+            switch (format.bits)
+            {
+            case 16:
+                return static_cast<int16_t>(GetU16(p)) * (1.f / 32768.f);
+            case 24:
+                return (static_cast<int32_t>(p[0] << 8 | p[1] << 16 | static_cast<uint32_t>(p[2]) << 24) >> 8) * (1.f / 8388608.f);
+            default:
+                return static_cast<int32_t>(GetU32(p)) * (1.f / 2147483648.f);
+            }
+        }
+
+        static bool ReadFormat(FILE *file, uint32_t size, Format &format)
+        {
+            uint8_t fmt[40]{};
+            if (size < 16 || std::fread(fmt, std::min<uint32_t>(size, sizeof(fmt)), 1, file) != 1)
+            {
+                return false;
+            }
+            format.encoding = GetU16(fmt);
+            format.channels = GetU16(fmt + 2);
+            format.bits = GetU16(fmt + 14);
+            // The sub-format GUID starts with the encoding.
+            if (EXTENSIBLE == format.encoding && size >= 26)
+            {
+                format.encoding = GetU16(fmt + 24);
+            }
+            bool pcm = PCM == format.encoding && (16 == format.bits || 24 == format.bits || 32 == format.bits);
+            bool ieee = IEEE_FLOAT == format.encoding && 32 == format.bits;
+
+            return format.channels > 0 && (pcm || ieee) && (size <= sizeof(fmt) || std::fseek(file, size - sizeof(fmt), SEEK_CUR) == 0);
+        }
+
+        static bool Import(FILE *file, StereoLooper &looper)
+        {
+            uint8_t riff[12];
+            if (std::fread(riff, sizeof(riff), 1, file) != 1 || std::memcmp(riff, "RIFF", 4) != 0 || std::memcmp(riff + 8, "WAVE", 4) != 0)
+            {
+                return false;
+            }
+
+            Format format{};
+            bool hasFormat{};
+            uint8_t chunk[8];
+            while (std::fread(chunk, sizeof(chunk), 1, file) == 1)
+            {
+                uint32_t size = GetU32(chunk + 4);
+                if (std::memcmp(chunk, "fmt ", 4) == 0)
+                {
+                    if (!ReadFormat(file, size, format))
+                    {
+                        return false;
+                    }
+                    hasFormat = true;
+                }
+                else if (std::memcmp(chunk, "data", 4) == 0)
+                {
+                    return hasFormat && ReadData(file, size, format, looper);
+                }
+                else if (std::fseek(file, size, SEEK_CUR) != 0)
+                {
+                    return false;
+                }
+                // The chunks are word aligned.
+                if ((size & 1) && std::fseek(file, 1, SEEK_CUR) != 0)
+                {
+                    return false;
+                }
+            }
+
+            return false;
+        }
+
+        static bool ReadData(FILE *file, uint32_t size, const Format &format, StereoLooper &looper)
+        {
+            size_t frameBytes = static_cast<size_t>(format.channels) * (format.bits / 8);
+            size_t frames = size / frameBytes;
+            if (0 == frames)
+            {
+                return false;
+            }
+            std::vector<uint8_t> data(kImportFrames * frameBytes);
+            std::vector<float> left(kImportFrames);
+            std::vector<float> right(kImportFrames);
+            bool stereo = format.channels > 1;
+            for (size_t frame = 0; frame < frames;)
+            {
+                size_t count = std::min(kImportFrames, frames - frame);
+                if (std::fread(data.data(), frameBytes, count, file) != count)
+                {
+                    return false;
+                }
+                for (size_t i = 0; i < count; i++)
+                {
+                    const uint8_t *p = data.data() + i * frameBytes;
+                    left[i] = Decode(p, format);
+                    if (stereo)
+                    {
+                        right[i] = Decode(p + format.bits / 8, format);
+                    }
+                }
+                frame += count;
+                if (looper.Import(left.data(), stereo ? right.data() : nullptr, count, frame == frames))
+                {
+                    break;
+                }
+            }
+
+            return true;
+        }
+    };
+} // namespace wreath
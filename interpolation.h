@@ -0,0 +1,457 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WREATH_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WREATH_SIMD_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define WREATH_SIMD_NEON
+#endif
+
+namespace wreath
+{
+    enum Interpolation
+    {
+        LINEAR,
+        HERMITE,
+        LAGRANGE,
+        SINC,
+    };
+
+    constexpr int32_t kSincZeroCrossings{8}; // Half width of the sinc kernel
+    constexpr int32_t kSincResolution{64};   // Table values per zero crossing
+    constexpr int32_t kSincMaxTaps{32};      // Max taps per side (4x rate)
+
+    /**
+     * @brief Block kernels for reading interpolated samples from a buffer.
+     *
+     * The kernels don't know anything about loops: the caller must guarantee
+     * that every position and the points around it are inside the buffer. The
+     * positions are calculated relatively to the integral part of the starting
+     * index, so that the precision doesn't degrade towards the end of long
+     * buffers.
+     */
+    namespace interpolation
+    {
+        /**
+         * @brief The lanes of a vector register. The same kernels are compiled
+         * for the vector type of the target and for the scalar type, that is
+         * used for the tail samples.
+         */
+        struct Scalar
+        {
+            static constexpr size_t kSize{1};
+            float v;
+
+            static Scalar Set(float f) { return {f}; }
+            static Scalar Iota() { return {0.f}; }
+            static Scalar GatherBits(const uint8_t *origin, const int32_t *idx, int32_t offset)
+            {
+                Scalar s;
+                std::memcpy(&s.v, origin + idx[0] + offset, sizeof(s.v));
+                return s;
+            }
+            template <int kBits>
+            Scalar SignedToFloat() const
+            {
+                uint32_t i;
+                std::memcpy(&i, &v, sizeof(i));
+                return {static_cast<float>(static_cast<int32_t>(i << (32 - kBits)) >> (32 - kBits))};
+            }
+            template <int kShift>
+            Scalar ShiftLeft() const
+            {
+                uint32_t i;
+                std::memcpy(&i, &v, sizeof(i));
+                i <<= kShift;
+                Scalar s;
+                std::memcpy(&s.v, &i, sizeof(s.v));
+                return s;
+            }
+            void Store(float *p) const { p[0] = v; }
+            void StoreInt(int32_t *p) const { p[0] = static_cast<int32_t>(v); }
+            Scalar Floor() const { return {std::floor(v)}; }
+            friend Scalar operator+(Scalar a, Scalar b) { return {a.v + b.v}; }
+            friend Scalar operator-(Scalar a, Scalar b) { return {a.v - b.v}; }
+            friend Scalar operator*(Scalar a, Scalar b) { return {a.v * b.v}; }
+        };
+
+#if defined(WREATH_SIMD_AVX2)
+        struct Vector
+        {
+            static constexpr size_t kSize{8};
+            __m256 v;
+
+            static Vector Set(float f) { return {_mm256_set1_ps(f)}; }
+            static Vector Iota() { return {_mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f)}; }
+            static Vector GatherBits(const uint8_t *origin, const int32_t *idx, int32_t offset)
+            {
+                __m256i i = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx)), _mm256_set1_epi32(offset));
+                return {_mm256_castsi256_ps(_mm256_i32gather_epi32(reinterpret_cast<const int *>(origin), i, 1))};
+            }
+            template <int kBits>
+            Vector SignedToFloat() const
+            {
+                __m256i i = _mm256_slli_epi32(_mm256_castps_si256(v), 32 - kBits);
+                return {_mm256_cvtepi32_ps(_mm256_srai_epi32(i, 32 - kBits))};
+            }
+            template <int kShift>
+            Vector ShiftLeft() const { return {_mm256_castsi256_ps(_mm256_slli_epi32(_mm256_castps_si256(v), kShift))}; }
+            void Store(float *p) const { _mm256_storeu_ps(p, v); }
+            void StoreInt(int32_t *p) const { _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), _mm256_cvtps_epi32(v)); }
+            Vector Floor() const { return {_mm256_floor_ps(v)}; }
+            friend Vector operator+(Vector a, Vector b) { return {_mm256_add_ps(a.v, b.v)}; }
+            friend Vector operator-(Vector a, Vector b) { return {_mm256_sub_ps(a.v, b.v)}; }
+            friend Vector operator*(Vector a, Vector b) { return {_mm256_mul_ps(a.v, b.v)}; }
+        };
+#elif defined(WREATH_SIMD_SSE2)
+        struct Vector
+        {
+            static constexpr size_t kSize{4};
+            __m128 v;
+
+            static Vector Set(float f) { return {_mm_set1_ps(f)}; }
+            static Vector Iota() { return {_mm_setr_ps(0.f, 1.f, 2.f, 3.f)}; }
+            static Vector GatherBits(const uint8_t *origin, const int32_t *idx, int32_t offset)
+            {
+                int32_t words[4];
+                for (int32_t j = 0; j < 4; j++)
+                {
+                    std::memcpy(&words[j], origin + idx[j] + offset, sizeof(words[j]));
+                }
+                return {_mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(words)))};
+            }
+            template <int kBits>
+            Vector SignedToFloat() const
+            {
+                __m128i i = _mm_slli_epi32(_mm_castps_si128(v), 32 - kBits);
+                return {_mm_cvtepi32_ps(_mm_srai_epi32(i, 32 - kBits))};
+            }
+            template <int kShift>
+            Vector ShiftLeft() const { return {_mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(v), kShift))}; }
+            void Store(float *p) const { _mm_storeu_ps(p, v); }
+            void StoreInt(int32_t *p) const { _mm_storeu_si128(reinterpret_cast<__m128i *>(p), _mm_cvttps_epi32(v)); }
+            Vector Floor() const
+            {
+                // SSE2 has no floor, truncate and fix the negative values.
+                __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+                return {_mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.f)))};
+            }
+            friend Vector operator+(Vector a, Vector b) { return {_mm_add_ps(a.v, b.v)}; }
+            friend Vector operator-(Vector a, Vector b) { return {_mm_sub_ps(a.v, b.v)}; }
+            friend Vector operator*(Vector a, Vector b) { return {_mm_mul_ps(a.v, b.v)}; }
+        };
+#elif defined(WREATH_SIMD_NEON)
+        struct Vector
+        {
+            static constexpr size_t kSize{4};
+            float32x4_t v;
+
+            static Vector Set(float f) { return {vdupq_n_f32(f)}; }
+            static Vector Iota()
+            {
+                const float lanes[4]{0.f, 1.f, 2.f, 3.f};
+                return {vld1q_f32(lanes)};
+            }
+            static Vector GatherBits(const uint8_t *origin, const int32_t *idx, int32_t offset)
+            {
+                uint32_t words[4];
+                for (int32_t j = 0; j < 4; j++)
+                {
+                    std::memcpy(&words[j], origin + idx[j] + offset, sizeof(words[j]));
+                }
+                return {vreinterpretq_f32_u32(vld1q_u32(words))};
+            }
+            template <int kBits>
+            Vector SignedToFloat() const
+            {
+                int32x4_t i = vshlq_n_s32(vreinterpretq_s32_f32(v), 32 - kBits);
+                return {vcvtq_f32_s32(vshrq_n_s32(i, 32 - kBits))};
+            }
+            template <int kShift>
+            Vector ShiftLeft() const { return {vreinterpretq_f32_u32(vshlq_n_u32(vreinterpretq_u32_f32(v), kShift))}; }
+            void Store(float *p) const { vst1q_f32(p, v); }
+            void StoreInt(int32_t *p) const { vst1q_s32(p, vcvtq_s32_f32(v)); }
+            Vector Floor() const
+            {
+                // Truncate and fix the negative values.
+                float32x4_t t = vcvtq_f32_s32(vcvtq_s32_f32(v));
+                return {vsubq_f32(t, vreinterpretq_f32_u32(vandq_u32(vcgtq_f32(t, v), vreinterpretq_u32_f32(vdupq_n_f32(1.f)))))};
+            }
+            friend Vector operator+(Vector a, Vector b) { return {vaddq_f32(a.v, b.v)}; }
+            friend Vector operator-(Vector a, Vector b) { return {vsubq_f32(a.v, b.v)}; }
+            friend Vector operator*(Vector a, Vector b) { return {vmulq_f32(a.v, b.v)}; }
+        };
+#else
+        using Vector = Scalar;
+#endif
+
+        /**
+         * @brief Linear interpolation between the sample and its neighbour,
+         * that is the one in the direction of the head.
+         */
+        struct Linear
+        {
+            static constexpr int32_t kPoints{2};
+            static int32_t Offset(int32_t point, int32_t neighbour) { return point * neighbour; }
+
+            template <typename V>
+            static V Interpolate(const V *y, V t)
+            {
+                return y[0] + (y[1] - y[0]) * t;
+            }
+        };
+
+        /**
+         * @brief 4-point, 3rd-order Hermite (Catmull-Rom) interpolation.
+         */
+        struct Hermite
+        {
+            static constexpr int32_t kPoints{4};
+            static int32_t Offset(int32_t point, int32_t) { return point - 1; }
+
+            template <typename V>
+            static V Interpolate(const V *y, V t)
+            {
+                V half = V::Set(0.5f);
+                V c1 = half * (y[2] - y[0]);
+                V c2 = y[0] - V::Set(2.5f) * y[1] + V::Set(2.f) * y[2] - half * y[3];
+                V c3 = half * (y[3] - y[0]) + V::Set(1.5f) * (y[1] - y[2]);
+
+                return ((c3 * t + c2) * t + c1) * t + y[1];
+            }
+        };
+
+        /**
+         * @brief 4-point, 3rd-order Lagrange interpolation.
+         */
+        struct Lagrange
+        {
+            static constexpr int32_t kPoints{4};
+            static int32_t Offset(int32_t point, int32_t) { return point - 1; }
+
+            template <typename V>
+            static V Interpolate(const V *y, V t)
+            {
+                V one = V::Set(1.f);
+                V tp1 = t + one;
+                V tm1 = t - one;
+                V tm2 = t - V::Set(2.f);
+                V a = tm1 * tm2;
+                V b = tp1 * t;
+
+                return V::Set(-1.f / 6.f) * t * a * y[0] + V::Set(0.5f) * tp1 * a * y[1] - V::Set(0.5f) * b * tm2 * y[2] + V::Set(1.f / 6.f) * b * tm1 * y[3];
+            }
+        };
+
+        /**
+         * @brief Returns the position of the k-th sample relative to the
+         * starting one, for a step that grows by stepIncrement each sample.
+         *
+         * @param k
+         * @param step
+         * @param stepIncrement
+         * @return float
+         */
+        inline float Offset(float k, float step, float stepIncrement)
+        {
+            return k * step + stepIncrement * k * (k - 1.f) * 0.5f;
+        }
+
+        /**
+         * @brief Reads the samples from k to size, a whole vector at a time.
+         * Returns the index of the first sample that has not been read. The
+         * samples in the buffer are pitch bytes apart, and are converted from
+         * the storage format as they are gathered.
+         */
+        template <typename V, typename Kernel, typename Storage>
+        inline size_t ReadLanes(const uint8_t *origin, int32_t pitch, float frac, float step, float stepIncrement, int32_t neighbour, float *out, size_t k, size_t size)
+        {
+            int32_t idx[V::kSize];
+            V y[Kernel::kPoints];
+            for (; k + V::kSize <= size; k += V::kSize)
+            {
+                V kk = V::Set(static_cast<float>(k)) + V::Iota();
+                V pos = V::Set(frac) + kk * V::Set(step) + kk * (kk - V::Set(1.f)) * V::Set(stepIncrement * 0.5f);
+                V intPos = pos.Floor();
+                (intPos * V::Set(static_cast<float>(pitch))).StoreInt(idx);
+                for (int32_t p = 0; p < Kernel::kPoints; p++)
+                {
+                    y[p] = Storage::Decode(V::GatherBits(origin, idx, Kernel::Offset(p, neighbour) * pitch));
+                }
+                Kernel::Interpolate(y, pos - intPos).Store(out + k);
+            }
+
+            return k;
+        }
+
+        /**
+         * @brief Reads size interpolated samples, starting at index and moving
+         * by step (that changes by stepIncrement after each sample). The
+         * neighbour is the direction of the head, used by the linear kernel.
+         *
+         * @param buffer
+         * @param pitch The distance in bytes between two samples in the buffer
+         * @param index
+         * @param step
+         * @param stepIncrement
+         * @param neighbour
+         * @param out
+         * @param size
+         */
+        template <typename Kernel, typename Storage>
+        inline void Read(const uint8_t *buffer, int32_t pitch, double index, float step, float stepIncrement, int32_t neighbour, float *out, size_t size)
+        {
+            int32_t base = static_cast<int32_t>(std::floor(index));
+            float frac = index - base;
+            const uint8_t *origin = buffer + static_cast<ptrdiff_t>(base) * pitch;
+            size_t k = ReadLanes<Vector, Kernel, Storage>(origin, pitch, frac, step, stepIncrement, neighbour, out, 0, size);
+            ReadLanes<Scalar, Kernel, Storage>(origin, pitch, frac, step, stepIncrement, neighbour, out, k, size);
+        }
+
+        template <typename Storage>
+        inline void ReadLinear(const uint8_t *buffer, int32_t pitch, double index, float step, float stepIncrement, int32_t neighbour, float *out, size_t size)
+        {
+            Read<Linear, Storage>(buffer, pitch, index, step, stepIncrement, neighbour, out, size);
+        }
+
+        /**
+         * @brief The right half of a Blackman-windowed sinc, sampled with
+         * kSincResolution values per zero crossing.
+         */
+        struct SincTable
+        {
+            static constexpr int32_t kSize{kSincZeroCrossings * kSincResolution};
+            float values[kSize + 2]{};
+
+            SincTable()
+            {
+                const double pi = std::acos(-1.0);
+                values[0] = 1.f;
+                for (int32_t i = 1; i <= kSize; i++)
+                {
+                    double x = static_cast<double>(i) / kSincResolution;
+                    double w = (x / kSincZeroCrossings + 1.0) * 0.5;
+                    double window = 0.42 - 0.5 * std::cos(2.0 * pi * w) + 0.08 * std::cos(4.0 * pi * w);
+                    values[i] = static_cast<float>(std::sin(pi * x) / (pi * x) * window);
+                }
+            }
+
+            /**
+             * @brief Returns the kernel value at the given distance (in zero
+             * crossings) from the center.
+             *
+             * @param x
+             * @return float
+             */
+            inline float At(float x) const
+            {
+                x = std::abs(x) * kSincResolution;
+                if (x >= kSize)
+                {
+                    return 0.f;
+                }
+                int32_t i = static_cast<int32_t>(x);
+                float frac = x - i;
+
+                return values[i] + (values[i + 1] - values[i]) * frac;
+            }
+        };
+
+        inline const SincTable &GetSincTable()
+        {
+            static const SincTable table;
+
+            return table;
+        }
+
+        /**
+         * @brief Returns the sinc kernel's scale for the given rate. Above 1x
+         * the kernel is stretched, lowering the cutoff to avoid aliasing.
+         *
+         * @param rate
+         * @return float
+         */
+        inline float SincScale(float rate)
+        {
+            return std::max(1.f / std::max(rate, 1.f), static_cast<float>(kSincZeroCrossings) / kSincMaxTaps);
+        }
+
+        /**
+         * @brief Returns the number of taps on each side of the sample for the
+         * given kernel scale.
+         *
+         * @param scale
+         * @return int32_t
+         */
+        inline int32_t SincTaps(float scale)
+        {
+            return std::min(static_cast<int32_t>(std::ceil(kSincZeroCrossings / scale)), kSincMaxTaps);
+        }
+
+        /**
+         * @brief Windowed sinc interpolation of the value at the given
+         * fractional position. The taps are fetched through the provided
+         * function, so that the caller can wrap them.
+         *
+         * @param tap
+         * @param frac
+         * @param scale
+         * @return float
+         */
+        template <typename Tap>
+        inline float Sinc(Tap tap, float frac, float scale)
+        {
+            const SincTable &table = GetSincTable();
+            int32_t taps = SincTaps(scale);
+            float sum{};
+            float weights{};
+            for (int32_t j = 1 - taps; j <= taps; j++)
+            {
+                float w = table.At((j - frac) * scale);
+                sum += tap(j) * w;
+                weights += w;
+            }
+
+            // Normalizing keeps unity gain at any scale.
+            return weights > 0.f ? sum / weights : 0.f;
+        }
+
+        /**
+         * @brief Block version of the sinc interpolation, with no wrapping.
+         *
+         * @param buffer
+         * @param pitch
+         * @param index
+         * @param step
+         * @param stepIncrement
+         * @param scale
+         * @param out
+         * @param size
+         */
+        template <typename Storage>
+        inline void ReadSinc(const uint8_t *buffer, int32_t pitch, double index, float step, float stepIncrement, float scale, float *out, size_t size)
+        {
+            int32_t base = static_cast<int32_t>(std::floor(index));
+            float frac = index - base;
+            for (size_t k = 0; k < size; k++)
+            {
+                float pos = frac + Offset(k, step, stepIncrement);
+                float intPos = std::floor(pos);
+                const uint8_t *origin = buffer + static_cast<ptrdiff_t>(base + static_cast<int32_t>(intPos)) * pitch;
+                out[k] = Sinc([origin, pitch](int32_t j)
+                              { return Storage::Load(origin + j * pitch); },
+                              pos - intPos, scale);
+            }
+        }
+    } // namespace interpolation
+} // namespace wreath
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace wreath
+{
+    constexpr int32_t kBufferPages{4096}; // Pages of the buffers, for clearing, freezing and exporting
+
+    /**
+     * @brief A copy of the loop of a Looper, taken while it keeps running
+     * (see Looper::StartExport()). As with the freeze snapshot, the looper
+     * copies the pages of the loop a bit at a time, and any page before it's
+     * written or cleared, so the copy holds the loop as it was when the
+     * snapshot started. The pages are published one by one, so that another
+     * thread can read them while the rest are still being copied.
+     *
+     * The owner allocates the samples, sets the status to WAITING and hands
+     * the snapshot to the looper. It must not touch it again until the status
+     * is COMPLETE or CANCELLED, apart from reading the published pages.
+     */
+    struct LoopSnapshot
+    {
+        enum Status
+        {
+            IDLE,
+            WAITING,   // Handed to the looper
+            COPYING,   // The loop has been set, the pages are being published
+            COMPLETE,  // All the pages have been published, the looper has let it go
+            CANCELLED, // The looper has been reset before completing it
+        };
+
+        float *samples{};  // One per sample of the buffer, at the same index
+        int32_t capacity{}; // The size of samples
+
+        // Set by the looper before the status becomes COPYING.
+        int32_t loopStart{};
+        int32_t loopLength{};
+        int32_t bufferSamples{};
+        int32_t pageSamples{};
+
+        std::atomic<int32_t> status{IDLE};
+        std::atomic<bool> published[kBufferPages]{};
+
+        inline bool IsPublished(int32_t index) const
+        {
+            return published[index / pageSamples].load(std::memory_order_acquire);
+        }
+
+        inline bool IsReleased() const
+        {
+            int32_t s = status.load(std::memory_order_acquire);
+
+            return COMPLETE == s || CANCELLED == s;
+        }
+    };
+} // namespace wreath
@@ -4,12 +4,13 @@
 using namespace wreath;
 using namespace daisysp;
 
-void Looper::Init(int32_t sampleRate, float *buffer, float *buffer2, int32_t maxBufferSamples)
+void Looper::Init(int32_t sampleRate, void *buffer, void *buffer2, int32_t maxBufferSamples, int32_t stride, SampleFormat format)
 {
     sampleRate_ = sampleRate;
-    readHeads_[0].Init(buffer, buffer2, maxBufferSamples);
-    readHeads_[1].Init(buffer, buffer2, maxBufferSamples);
-    writeHead_.Init(buffer, buffer2, maxBufferSamples);
+    readHeads_[0].Init(buffer, buffer2, maxBufferSamples, stride, format);
+    readHeads_[1].Init(buffer, buffer2, maxBufferSamples, stride, format);
+    writeHead_.Init(buffer, buffer2, maxBufferSamples, stride, format);
+    pageSamples_ = std::max((maxBufferSamples + kBufferPages - 1) / kBufferPages, 1);
     Reset();
     movement_ = Movement::NORMAL;
     direction_ = Direction::FORWARD;
@@ -29,13 +30,19 @@ void Looper::Init(int32_t sampleRate, float *buffer, float *buffer2, int32_t max
     writeHead_.SetLooping(true);
 }
 
+void Looper::SetSeed(uint64_t seed)
+{
+    random_.Seed(seed);
+    degradationPulses_ = 1 + static_cast<int32_t>(random_.NextFloat() * kDegradationPulses);
+}
+
 void Looper::Reset()
 {
-    std::srand(static_cast<unsigned>(time(0)));
-    eRand_ = std::rand() / (float)RAND_MAX;
+    degradationPulses_ = 1 + static_cast<int32_t>(random_.NextFloat() * kDegradationPulses);
     readHeads_[0].Reset();
     readHeads_[1].Reset();
     writeHead_.Reset();
+    ReleaseExport(LoopSnapshot::CANCELLED);
     bufferSamples_ = 0;
     bufferSeconds_ = 0.f;
     loopStart_ = 0;
@@ -48,15 +55,179 @@ void Looper::Reset()
     readPos_ = 0.f;
     readPosSeconds_ = 0.f;
     writePos_ = 0.f;
+    crossingChanged_ = true;
 }
 
 void Looper::ClearBuffer()
 {
-    writeHead_.ClearBuffer();
+    std::fill(clearPending_, clearPending_ + kBufferPages, true);
+    clearPage_ = 0;
+    clearing_ = true;
+}
+
+void Looper::TakeSnapshot()
+{
+    snapshotPages_ = std::min((bufferSamples_ + pageSamples_ - 1) / pageSamples_, kBufferPages);
+    std::fill(snapshotPending_, snapshotPending_ + snapshotPages_, true);
+    snapshotPage_ = 0;
+    snapshotting_ = snapshotPages_ > 0;
+}
+
+void Looper::StartExport(LoopSnapshot *snapshot)
+{
+    ReleaseExport(LoopSnapshot::CANCELLED);
+    int32_t start = static_cast<int32_t>(loopStart_);
+    int32_t length = std::min(std::max(static_cast<int32_t>(loopLength_), 1), bufferSamples_);
+    if (bufferSamples_ <= 0 || snapshot->capacity < bufferSamples_)
+    {
+        snapshot->status.store(LoopSnapshot::CANCELLED, std::memory_order_release);
+        return;
+    }
+
+    // The loop wraps around the buffer at most once.
+    std::fill(exportPending_, exportPending_ + kBufferPages, false);
+    int32_t ranges[2][2]{{start, std::min(start + length, bufferSamples_)}, {0, start + length - bufferSamples_}};
+    for (auto &range : ranges)
+    {
+        for (int32_t page = range[0] / pageSamples_; page * pageSamples_ < range[1] && page < kBufferPages; page++)
+        {
+            exportPending_[page] = true;
+        }
+    }
+    for (int32_t page = 0; page < kBufferPages; page++)
+    {
+        snapshot->published[page].store(!exportPending_[page], std::memory_order_relaxed);
+    }
+    snapshot->loopStart = start;
+    snapshot->loopLength = length;
+    snapshot->bufferSamples = bufferSamples_;
+    snapshot->pageSamples = pageSamples_;
+    export_ = snapshot;
+    exportPage_ = 0;
+    exporting_ = true;
+    snapshot->status.store(LoopSnapshot::COPYING, std::memory_order_release);
+}
+
+void Looper::ProcessPages(size_t frames)
+{
+    if (!clearing_ && !snapshotting_ && !exporting_)
+    {
+        return;
+    }
+
+    pageBudget_ += frames * kPageSamplesPerFrame;
+    for (; clearing_ && pageBudget_ > 0; clearPage_++)
+    {
+        if (clearPage_ >= kBufferPages)
+        {
+            clearing_ = false;
+            break;
+        }
+        if (clearPending_[clearPage_])
+        {
+            ClearPage(clearPage_);
+            pageBudget_ -= pageSamples_;
+        }
+    }
+    for (; snapshotting_ && pageBudget_ > 0; snapshotPage_++)
+    {
+        if (snapshotPage_ >= snapshotPages_)
+        {
+            snapshotting_ = false;
+            break;
+        }
+        if (snapshotPending_[snapshotPage_])
+        {
+            CopyPage(snapshotPage_);
+            pageBudget_ -= pageSamples_;
+        }
+    }
+    for (; exporting_ && pageBudget_ > 0; exportPage_++)
+    {
+        if (exportPage_ >= kBufferPages)
+        {
+            ReleaseExport(LoopSnapshot::COMPLETE);
+            break;
+        }
+        if (exportPending_[exportPage_])
+        {
+            ExportPage(exportPage_);
+            pageBudget_ -= pageSamples_;
+        }
+    }
+    if (!clearing_ && !snapshotting_ && !exporting_)
+    {
+        pageBudget_ = 0;
+    }
+}
+
+void Looper::ClearPage(int32_t page)
+{
+    if (page >= 0 && page < kBufferPages && clearPending_[page])
+    {
+        if (exporting_)
+        {
+            ExportPage(page);
+        }
+        writeHead_.ClearBuffer(page * pageSamples_, (page + 1) * pageSamples_);
+        clearPending_[page] = false;
+    }
+}
+
+void Looper::CopyPage(int32_t page)
+{
+    if (page >= 0 && page < snapshotPages_ && snapshotPending_[page])
+    {
+        writeHead_.CopyToFreezeBuffer(page * pageSamples_, (page + 1) * pageSamples_);
+        snapshotPending_[page] = false;
+    }
+}
+
+void Looper::ExportPage(int32_t page)
+{
+    if (page >= 0 && page < kBufferPages && exportPending_[page])
+    {
+        writeHead_.ReadSamples(export_->samples, page * pageSamples_, std::min((page + 1) * pageSamples_, export_->bufferSamples));
+        exportPending_[page] = false;
+        export_->published[page].store(true, std::memory_order_release);
+    }
+}
+
+void Looper::ReleaseExport(LoopSnapshot::Status status)
+{
+    if (export_)
+    {
+        export_->status.store(status, std::memory_order_release);
+        export_ = nullptr;
+    }
+    exporting_ = false;
+}
+
+void Looper::PreparePagesAroundHeads(int32_t distance)
+{
+    double positions[] = {readHeads_[0].GetPosition(), readHeads_[1].GetPosition(), writeHead_.GetPosition(), loopStart_, loopEnd_};
+    for (double position : positions)
+    {
+        int32_t first = (static_cast<int32_t>(position) - distance) / pageSamples_;
+        int32_t last = (static_cast<int32_t>(position) + distance) / pageSamples_;
+        for (int32_t page = std::max(first, 0); page <= last; page++)
+        {
+            ClearPage(page);
+            CopyPage(page);
+            if (exporting_)
+            {
+                ExportPage(page);
+            }
+        }
+    }
 }
 
 bool Looper::Buffer(float value)
 {
+    if (clearing_)
+    {
+        ClearPage(writeHead_.GetIntPosition() / pageSamples_);
+    }
     bool end = writeHead_.Buffer(value);
     bufferSamples_ = writeHead_.GetBufferSamples();
     bufferSeconds_ = bufferSamples_ / static_cast<float>(sampleRate_);
@@ -64,9 +235,26 @@ bool Looper::Buffer(float value)
     return end;
 }
 
+bool Looper::BufferBlock(const float *input, size_t size)
+{
+    if (clearing_)
+    {
+        int32_t position = writeHead_.GetIntPosition();
+        for (int32_t page = position / pageSamples_; page <= (position + static_cast<int32_t>(size)) / pageSamples_; page++)
+        {
+            ClearPage(page);
+        }
+    }
+    bool end = writeHead_.BufferBlock(input, size);
+    bufferSamples_ = writeHead_.GetBufferSamples();
+    bufferSeconds_ = bufferSamples_ / static_cast<float>(sampleRate_);
+
+    return end;
+}
+
 void Looper::StopBuffering()
 {
-    float samples = writeHead_.StopBuffering();
+    int32_t samples = writeHead_.StopBuffering();
     readHeads_[0].InitBuffer(samples);
     readHeads_[1].InitBuffer(samples);
     loopStart_ = 0;
@@ -76,6 +264,29 @@ void Looper::StopBuffering()
     loopLength_ = bufferSamples_;
     intLoopLength_ = bufferSamples_;
     loopLengthSeconds_ = loopLength_ / sampleRate_;
+    crossingChanged_ = true;
+    // The freeze buffer is not filled when buffering.
+    if (freeze_ > 0.f)
+    {
+        TakeSnapshot();
+    }
+}
+
+void Looper::Restore(int32_t bufferSamples, float freeze)
+{
+    writeHead_.InitBuffer(bufferSamples);
+    bufferSamples_ = bufferSamples;
+    bufferSeconds_ = bufferSamples_ / static_cast<float>(sampleRate_);
+    StopBuffering();
+    // The freeze buffer has been restored as well, so neither a snapshot nor
+    // the write head's freeze fade must touch it.
+    freeze_ = freeze;
+    freezeGains_ = Fader::EqualCrossFadeGains(freeze);
+    readHeads_[0].SetFrozen(freeze);
+    readHeads_[1].SetFrozen(freeze);
+    writeHead_.SetFrozen(freeze);
+    crossingChanged_ = true;
+    snapshotting_ = false;
 }
 
 void Looper::StartReading(bool now)
@@ -92,6 +303,7 @@ void Looper::StartReading(bool now)
     {
         startReadingFade.Init(Fader::FadeType::FADE_SINGLE, kSamplesToFadeTrigger, readRate_);
     }
+    crossingChanged_ = true;
 }
 
 void Looper::StopReading(bool now)
@@ -106,6 +318,7 @@ void Looper::StopReading(bool now)
         readHeads_[0].SetActive(false);
         readHeads_[1].SetActive(false);
         readingActive_ = false;
+        crossingChanged_ = true;
     }
     else
     {
@@ -125,6 +338,7 @@ void Looper::StartWriting(bool now)
     {
         startWritingFade.Init(Fader::FadeType::FADE_SINGLE, kSamplesToFadeTrigger, writeRate_);
     }
+    crossingChanged_ = true;
 }
 
 void Looper::StopWriting(bool now)
@@ -137,6 +351,7 @@ void Looper::StopWriting(bool now)
     if (now)
     {
         writingActive_ = false;
+        crossingChanged_ = true;
     }
     else
     {
@@ -168,6 +383,7 @@ void Looper::Trigger(bool restart)
         }
         StartReading(false);
     }
+    crossingChanged_ = true;
 }
 
 void Looper::SetSamplesToFade(float samples)
@@ -175,9 +391,10 @@ void Looper::SetSamplesToFade(float samples)
     readHeads_[0].SetSamplesToFade(samples);
     readHeads_[1].SetSamplesToFade(samples);
     writeHead_.SetSamplesToFade(samples);
+    crossingChanged_ = true;
 }
 
-void Looper::SetLoopStart(float start)
+void Looper::SetLoopStart(double start)
 {
     // Do not change value if there's a loop fade going.
     if (loopFade.IsActive() && loopLength_ > kMinSamplesForFlanger)
@@ -211,7 +428,7 @@ void Looper::SetLoopStart(float start)
     loopStartSeconds_ = loopStart_ / static_cast<float>(sampleRate_);
     loopEnd_ = readHeads_[!activeReadHead_].GetLoopEnd();
     intLoopEnd_ = loopEnd_;
-    crossPointFound_ = false;
+    crossingChanged_ = true;
 
     // In delay mode, keep the loop synched.
     if (loopSync_)
@@ -220,7 +437,7 @@ void Looper::SetLoopStart(float start)
     }
 }
 
-void Looper::SetLoopLength(float length)
+void Looper::SetLoopLength(double length)
 {
     // Do not change value if there's a loop fade going.
     if (loopFade.IsActive() && loopLength_ > kMinSamplesForFlanger)
@@ -244,7 +461,7 @@ void Looper::SetLoopLength(float length)
     loopLengthSeconds_ = loopLength_ / sampleRate_;
     loopEnd_ = readHeads_[!activeReadHead_].GetLoopEnd();
     intLoopEnd_ = loopEnd_;
-    crossPointFound_ = false;
+    crossingChanged_ = true;
 
     // In delay mode, keep the loop synched.
     if (loopSync_)
@@ -260,7 +477,7 @@ void Looper::SetReadRate(float rate)
     readRate_ = rate;
     readSpeed_ = sampleRate_ * readRate_;
     sampleRateSpeed_ = static_cast<int32_t>(sampleRate_ / readRate_);
-    crossPointFound_ = false;
+    crossingChanged_ = true;
     // In delay mode, when setting the rate back to 1 we flag for a realignment
     // of the heads at the next loop to keep the correct delay time.
     if (loopSync_ && rate == 1.f)
@@ -274,7 +491,7 @@ void Looper::SetWriteRate(float rate)
     writeHead_.SetRate(rate);
     writeRate_ = rate;
     writeSpeed_ = sampleRate_ * writeRate_;
-    crossPointFound_ = false;
+    crossingChanged_ = true;
 }
 
 void Looper::SetMovement(Movement movement)
@@ -282,6 +499,7 @@ void Looper::SetMovement(Movement movement)
     readHeads_[0].SetMovement(movement);
     readHeads_[1].SetMovement(movement);
     movement_ = movement;
+    crossingChanged_ = true;
 }
 
 void Looper::SetDirection(Direction direction)
@@ -289,22 +507,28 @@ void Looper::SetDirection(Direction direction)
     readHeads_[0].SetDirection(direction);
     readHeads_[1].SetDirection(direction);
     direction_ = direction;
-    crossPointFound_ = false;
+    crossingChanged_ = true;
 }
 
-void Looper::SetReadPos(float position)
+void Looper::SetInterpolation(Interpolation interpolation)
+{
+    readHeads_[0].SetInterpolation(interpolation);
+    readHeads_[1].SetInterpolation(interpolation);
+}
+
+void Looper::SetReadPos(double position)
 {
     readHeads_[0].SetIndex(position);
     readHeads_[1].SetIndex(position);
     readPos_ = position;
-    crossPointFound_ = false;
+    crossingChanged_ = true;
 }
 
-void Looper::SetWritePos(float position)
+void Looper::SetWritePos(double position)
 {
     writeHead_.SetIndex(position);
     writePos_ = position;
-    crossPointFound_ = false;
+    crossingChanged_ = true;
 }
 
 void Looper::SetLooping(bool looping)
@@ -312,7 +536,7 @@ void Looper::SetLooping(bool looping)
     readHeads_[0].SetLooping(looping);
     readHeads_[1].SetLooping(looping);
     looping_ = looping;
-    crossPointFound_ = false;
+    crossingChanged_ = true;
 }
 
 void Looper::SetLoopSync(bool loopSync)
@@ -331,11 +555,16 @@ void Looper::SetLoopSync(bool loopSync)
     readHeads_[0].SetLoopSync(loopSync_);
     readHeads_[1].SetLoopSync(loopSync_);
     writeHead_.SetLoopSync(loopSync_);
-    crossPointFound_ = false;
+    crossingChanged_ = true;
 }
 
 float Looper::Read()
 {
+    if (clearing_ || snapshotting_ || exporting_)
+    {
+        PreparePagesAroundHeads(kSincMaxTaps + 1);
+    }
+
     float value = readHeads_[activeReadHead_].Read();
 
     // Fade in reading.
@@ -352,6 +581,7 @@ float Looper::Read()
             readHeads_[0].SetActive(false);
             readHeads_[1].SetActive(false);
             readingActive_ = false;
+            crossingChanged_ = true;
             // If the looper had been re-triggered while playing, at the end of
             // the fade out we reset the heads and then fade in reading.
             if (triggered_)
@@ -383,6 +613,7 @@ float Looper::Read()
             {
                 writeHead_.SetIndex(readPos_);
             }
+            crossingChanged_ = true;
         }
         value = loopFade.GetOutput();
     }
@@ -390,7 +621,7 @@ float Looper::Read()
     if (freeze_ > 0)
     {
         // Crossfade with the frozen buffer.
-        value = Fader::EqualCrossFade(value, readHeads_[activeReadHead_].ReadFrozen(), freeze_);
+        value = value * freezeGains_.from + readHeads_[activeReadHead_].ReadFrozen() * freezeGains_.to;
     }
 
     // Handle fade on re-triggering.
@@ -405,6 +636,11 @@ float Looper::Read()
 
 void Looper::Write(float input)
 {
+    if (clearing_ || snapshotting_ || exporting_)
+    {
+        PreparePagesAroundHeads(kSincMaxTaps + 1);
+    }
+
     // Fade in writing.
     if (startWritingFade.IsActive())
     {
@@ -417,6 +653,7 @@ void Looper::Write(float input)
         if (Fader::FadeStatus::ENDED == stopWritingFade.Process(input, 0))
         {
             writingActive_ = false;
+            crossingChanged_ = true;
         }
         input = stopWritingFade.GetOutput();
     }
@@ -434,18 +671,101 @@ void Looper::Write(float input)
     writeHead_.Write(input);
 }
 
-float Looper::Degrade(float input)
+float Looper::GetDegradationGain()
 {
-    if (degradation_ > 0.f)
+    if (degradation_ <= 0.f)
     {
-        float d = 1.f - ((std::rand() / (float)RAND_MAX) * degradation_) * 0.5f;
+        return 1.f;
+    }
+    // Drawn for every sample, so that the blocks get the same sequence.
+    float gain = random_.NextGain(degradation_ * 0.5f);
+    UpdateDegradation();
+
+    // Apply degradation at fixed buffer points.
+    return IsDegraded(FindDegradationSpan(writeHead_.GetIntPosition())) ? gain : 1.f;
+}
 
-        // Use an Euclidean rhythm generator to apply degradation at fixed
-        // buffer points
-        return writeHead_.BresenhamEuclidean(eRand_ * 64, degradation_) ? input : input * d;
+void Looper::GetDegradationGains(float *gains, size_t size)
+{
+    if (degradation_ <= 0.f)
+    {
+        std::fill(gains, gains + size, 1.f);
+        return;
+    }
+    random_.FillGains(gains, size, degradation_ * 0.5f);
+    UpdateDegradation();
+    if (degradeAll_)
+    {
+        return;
     }
 
-    return input;
+    // In a block the writing positions only move one way, so the samples
+    // are walked a span at a time, restoring the ones left alone.
+    for (size_t i = 0; i < size;)
+    {
+        int32_t span = FindDegradationSpan(writeHead_.GetBlockIndex(i));
+        int32_t start = degradationBounds_[span];
+        int32_t end = degradationBounds_[span + 1];
+        size_t low = i + 1;
+        size_t high = size;
+        while (low < high)
+        {
+            size_t middle = (low + high) / 2;
+            int32_t index = writeHead_.GetBlockIndex(middle);
+            if (index >= start && index < end)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        if (!IsDegraded(span))
+        {
+            std::fill(gains + i, gains + low, 1.f);
+        }
+        i = low;
+    }
+}
+
+void Looper::UpdateDegradation()
+{
+    if (patternDegradation_ == degradation_ && patternBufferSamples_ == bufferSamples_ && patternPulses_ == degradationPulses_)
+    {
+        return;
+    }
+    patternDegradation_ = degradation_;
+    patternBufferSamples_ = bufferSamples_;
+    patternPulses_ = degradationPulses_;
+
+    float onsets = degradation_ * degradationPulses_;
+    degradeAll_ = onsets >= degradationPulses_;
+    degradationSpans_ = degradeAll_ ? 1 : std::max(static_cast<int32_t>(std::ceil(onsets)), 1);
+    degradationBounds_[0] = 0;
+    for (int32_t span = 1; span < degradationSpans_; span++)
+    {
+        degradationBounds_[span] = static_cast<int32_t>(std::ceil(span * (bufferSamples_ / static_cast<double>(onsets))));
+    }
+    degradationBounds_[degradationSpans_] = bufferSamples_;
+}
+
+int32_t Looper::FindDegradationSpan(int32_t index)
+{
+    // Start from the last span found, as the writing position mostly moves
+    // within it or to the next one.
+    int32_t span = std::min(degradationSpan_, degradationSpans_ - 1);
+    while (span > 0 && index < degradationBounds_[span])
+    {
+        span--;
+    }
+    while (span < degradationSpans_ - 1 && index >= degradationBounds_[span + 1])
+    {
+        span++;
+    }
+    degradationSpan_ = span;
+
+    return span;
 }
 
 void Looper::FadeReadingToResetPosition()
@@ -514,17 +834,24 @@ void Looper::UpdateReadPos()
         loopChanged_ = false;
     }
     // Here we handle normal looping in delay mode or when the loop length is
-    // small.
+    // small. Both the heads already have the new loop, so the change is done.
     else if (Head::Action::LOOP == action && (loopLength_ <= kMinSamplesForFlanger || loopSync_) && loopLength_ < bufferSamples_)
     {
         readHeads_[0].ResetPosition();
         readHeads_[1].ResetPosition();
+        loopChanged_ = false;
     }
     else if (Head::Action::STOP == action)
     {
         StopReading(false);
     }
 
+    // The heads crossing must be solved again after any jump.
+    if (Head::Action::NO_ACTION != action)
+    {
+        crossingChanged_ = true;
+    }
+
     readPos_ = readHeads_[activeReadHead_].GetPosition();
     readPosSeconds_ = readPos_ / sampleRate_;
 }
@@ -553,44 +880,207 @@ void Looper::UpdateWritePos()
         }
     }
 
-    // When reading and writing speeds differ or we're going backwards, we
-    // calculate the point where the two heads will meet and set up a writing
-    // fade at that point.
-    if (freeze_ < 1.f && !headsCrossFade.IsActive() && (readSpeed_ != writeSpeed_ || !IsGoingForward()))
+    if (Head::Action::NO_ACTION != action)
     {
-        headsDistance_ = CalculateDistance(readPos_, writePos_, readSpeed_, writeSpeed_, direction_);
+        crossingChanged_ = true;
+    }
+    AdvanceCrossing(1);
+}
 
-        // Calculate the cross point when the two heads are close enough.
-        if (!crossPointFound_ && headsDistance_ > 0 && headsDistance_ <= writeHead_.GetSamplesToFade() * 2)
+size_t Looper::GetSteadySamples(size_t size)
+{
+    // Loop changes and the crossfades between two sources must be handled
+    // sample by sample.
+    if (loopChanged_ || loopFade.IsActive() || headsCrossFade.IsActive())
+    {
+        return 0;
+    }
+    // Also, we must stop right at the next event of the heads crossing.
+    if (crossingChanged_)
+    {
+        ScheduleCrossing();
+        if (headsCrossFade.IsActive())
         {
-            CalculateCrossPoint();
+            return 0;
         }
+    }
+    size = static_cast<size_t>(std::min<int64_t>(size, crossingSamples_));
 
-        if (crossPointFound_)
+    // The other fades are applied as gains (see ComposeReadGains()), but
+    // their ends trigger actions that are handled sample by sample.
+    size = std::min(size, kMaxBlockSize);
+    for (Fader *fade : {&triggerFade, &startReadingFade, &stopReadingFade, &startWritingFade, &stopWritingFade})
+    {
+        if (fade->IsActive())
         {
-            float samples = CalculateDistance(writePos_, crossPoint_, writeSpeed_, 0, Direction::FORWARD);
-            // If the condition are met, set up the cross point fade.
-            if (samples > 0 && samples <= writeHead_.GetSamplesToFade())
+            size = std::min(size, fade->GetSamplesBeforeEnd());
+        }
+    }
+    size = std::min(size, readHeads_[activeReadHead_].SamplesToBoundary(size));
+    size = std::min(size, writeHead_.SamplesToBoundary(size));
+
+    // The heads must not get close to each other, otherwise the order of the
+    // reading and the writing would matter.
+    float speed = readRate_ + writeRate_;
+    double distance = std::abs(readPos_ - writePos_);
+    distance = std::min(distance, bufferSamples_ - distance) - 2;
+    if (distance <= 0)
+    {
+        return 0;
+    }
+    size = std::min(size, static_cast<size_t>(distance / speed));
+
+    return size;
+}
+
+void Looper::ReadBlock(float *output, size_t size)
+{
+    if (clearing_ || snapshotting_ || exporting_)
+    {
+        PreparePagesAroundHeads(static_cast<int32_t>(size * std::max(std::abs(readRate_), std::abs(writeRate_))) + kSincMaxTaps + 1);
+    }
+
+    if (!readingActive_)
+    {
+        std::fill(output, output + size, 0.f);
+
+        return;
+    }
+
+    Head &head = readHeads_[activeReadHead_];
+    head.ReadBlock(output, size);
+    if (ComposeReadGains(size))
+    {
+        // All the fades and the freeze mix in a single pass.
+        if (freeze_ > 0)
+        {
+            head.ReadFrozenBlock(frozenBlock_, size);
+            for (size_t i = 0; i < size; i++)
             {
-                crossPointFound_ = false;
-                headsCrossFade.Init(Fader::FadeType::FADE_OUT_IN, samples * 2, writeRate_);
+                output[i] = output[i] * readGains_[i] + frozenBlock_[i] * frozenGains_[i];
             }
         }
+        else
+        {
+            for (size_t i = 0; i < size; i++)
+            {
+                output[i] *= readGains_[i];
+            }
+        }
+    }
+    else if (freeze_ > 0)
+    {
+        // Crossfade with the frozen buffer.
+        head.ReadFrozenBlock(frozenBlock_, size);
+        for (size_t i = 0; i < size; i++)
+        {
+            output[i] = output[i] * freezeGains_.from + frozenBlock_[i] * freezeGains_.to;
+        }
     }
+
+    head.Advance(size);
+    readHeads_[!activeReadHead_].SetIndex(head.GetPosition());
+    readHeads_[!activeReadHead_].SetOffset(head.GetOffset());
+    readPos_ = head.GetPosition();
+    readPosSeconds_ = readPos_ / sampleRate_;
+}
+
+bool Looper::ComposeReadGains(size_t size)
+{
+    // The gains follow the order of Read(): the reading fade, then the mix
+    // with the frozen buffer and the trigger fade, applied to both.
+    Fader *readingFade = startReadingFade.IsActive() ? &startReadingFade : (stopReadingFade.IsActive() ? &stopReadingFade : nullptr);
+    if (!readingFade && !triggerFade.IsActive())
+    {
+        return false;
+    }
+
+    if (readingFade)
+    {
+        readingFade->ProcessGains(readGains_, size, readingFade == &startReadingFade);
+    }
+    else
+    {
+        std::fill(readGains_, readGains_ + size, 1.f);
+    }
+    float from = freeze_ > 0 ? freezeGains_.from : 1.f;
+    float to = freeze_ > 0 ? freezeGains_.to : 0.f;
+    if (triggerFade.IsActive())
+    {
+        triggerFade.ProcessGains(fadeGains_, size, true);
+        for (size_t i = 0; i < size; i++)
+        {
+            readGains_[i] *= from * fadeGains_[i];
+            frozenGains_[i] = to * fadeGains_[i];
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            readGains_[i] *= from;
+            frozenGains_[i] = to;
+        }
+    }
+
+    return true;
+}
+
+bool Looper::ComposeWriteGains(size_t size)
+{
+    Fader *writingFade = startWritingFade.IsActive() ? &startWritingFade : (stopWritingFade.IsActive() ? &stopWritingFade : nullptr);
+    if (!writingFade)
+    {
+        return false;
+    }
+    writingFade->ProcessGains(writeGains_, size, writingFade == &startWritingFade);
+
+    return true;
+}
+
+void Looper::WriteBlock(const float *input, size_t size)
+{
+    if (clearing_ || snapshotting_ || exporting_)
+    {
+        PreparePagesAroundHeads(static_cast<int32_t>(size * std::abs(writeRate_)) + 1);
+    }
+
+    if (writingActive_)
+    {
+        if (ComposeWriteGains(size))
+        {
+            for (size_t i = 0; i < size; i++)
+            {
+                writeBlock_[i] = input[i] * writeGains_[i];
+            }
+            input = writeBlock_;
+        }
+        writeHead_.WriteBlock(input, size);
+    }
+    writeHead_.Advance(size);
+    writePos_ = writeHead_.GetIntPosition();
+    AdvanceCrossing(size);
 }
 
 void Looper::ToggleDirection()
 {
     direction_ = readHeads_[0].ToggleDirection();
     readHeads_[1].ToggleDirection();
+    crossingChanged_ = true;
 }
 
 void Looper::SetFreeze(float amount)
 {
+    if (freeze_ <= 0.f && amount > 0.f)
+    {
+        TakeSnapshot();
+    }
     freeze_ = amount;
+    freezeGains_ = Fader::EqualCrossFadeGains(amount);
     readHeads_[0].SetFreeze(amount);
     readHeads_[1].SetFreeze(amount);
     writeHead_.SetFreeze(amount);
+    crossingChanged_ = true;
 }
 
 void Looper::SetDegradation(float amount)
@@ -598,7 +1088,7 @@ void Looper::SetDegradation(float amount)
     degradation_ = amount;
 }
 
-float Looper::CalculateDistance(float a, float b, float aSpeed, float bSpeed, Direction direction)
+double Looper::CalculateDistance(double a, double b, float aSpeed, float bSpeed, Direction direction)
 {
     if (a == b)
     {
@@ -628,55 +1118,123 @@ float Looper::CalculateDistance(float a, float b, float aSpeed, float bSpeed, Di
     return (!IsGoingForward() || bSpeed > aSpeed) ? loopLength_ - (b - a) : b - a;
 }
 
-void Looper::CalculateCrossPoint()
+void Looper::ScheduleCrossing()
 {
-    // Do not calculate the cross point if the write head is outside of
-    // the loop (this is especially true in looper mode, when it roams
-    // along all the buffer).
-    if ((loopEnd_ > loopStart_ && (writePos_ < loopStart_ || writePos_ > loopEnd_)) || (loopStart_ > loopEnd_ && writePos_ < loopStart_ && writePos_ > loopEnd_))
+    crossingChanged_ = false;
+    crossPointFound_ = false;
+    crossingSamples_ = std::numeric_limits<int64_t>::max();
+
+    if (headsCrossFade.IsActive())
     {
+        // Wait for the crossfade to end.
+        crossingSamples_ = 1;
+
         return;
     }
 
-    float relSpeed{writeSpeed_ > readSpeed_ ? writeSpeed_ - readSpeed_ : readSpeed_ - writeSpeed_};
-    if (!IsGoingForward())
+    // The heads only meet when the reading and writing speeds differ or
+    // we're going backwards, and the writing head always goes forward.
+    Head &readHead = readHeads_[activeReadHead_];
+    double readVelocity = readHead.GetRate() * readHead.GetDirection();
+    double velocity = readVelocity - writeRate_;
+    if (freeze_ >= 1.f || !readHead.IsActive() || !writingActive_ || writeRate_ <= 0.f || velocity == 0 || loopLength_ <= 0.f)
     {
-        relSpeed = writeSpeed_ + readSpeed_;
+        return;
     }
 
-    float deltaTime = headsDistance_ / relSpeed;
-    crossPoint_ = writePos_ + writeSpeed_ * deltaTime;
+    // The positions relative to the loop start, wrapping around the buffer
+    // when the loop is inverted. The heads' own, as the loop actions may
+    // just have moved them.
+    double length = loopLength_;
+    double writePos = writeHead_.GetPosition();
+    double readPos = readHead.GetPosition();
+    double writeOffset = writePos - loopStart_;
+    double readOffset = readPos - loopStart_;
+    if (loopStart_ > loopEnd_)
+    {
+        writeOffset += writeOffset < 0 ? bufferSamples_ : 0;
+        readOffset += readOffset < 0 ? bufferSamples_ : 0;
+    }
 
-    // Normal loop
-    if (loopEnd_ > loopStart_)
+    // When a head is outside of the loop (the writing head roams along all
+    // the buffer in looper mode), solve again when it enters it.
+    if (writeOffset < 0 || writeOffset >= length)
     {
-        // Wrap the crossing point if it's outside of the loop.
-        if (crossPoint_ > loopEnd_)
-        {
-            crossPoint_ = loopStart_ + std::fmod(crossPoint_, loopLength_);
-        }
-        else if (crossPoint_ < loopStart_)
-        {
-            crossPoint_ = loopStart_ + std::fmod(crossPoint_ + loopStart_, loopLength_);
-        }
+        double distance = loopStart_ - writePos;
+        distance += distance < 0 ? bufferSamples_ : 0;
+        crossingSamples_ = std::max(static_cast<int64_t>(std::ceil(distance / writeRate_)), static_cast<int64_t>(1));
+
+        return;
     }
-    // Inverted loop
-    else
+    if ((readOffset < 0 || readOffset >= length) && readVelocity != 0)
     {
-        // Wrap the crossing point if it's outside of the buffer.
-        if (crossPoint_ >= bufferSamples_)
-        {
-            crossPoint_ = std::fmod(crossPoint_, loopLength_);
-        }
-        // If the cross point falls just between the loop's start and end point,
-        // nudge it forward.
-        if (crossPoint_ > loopEnd_ && crossPoint_ < loopStart_)
-        {
-            crossPoint_ = loopStart_ + (crossPoint_ - loopEnd_);
-        }
+        double distance = readVelocity > 0 ? loopStart_ - readPos : readPos - loopEnd_;
+        distance += distance < 0 ? bufferSamples_ : 0;
+        crossingSamples_ = std::max(static_cast<int64_t>(std::ceil(distance / std::abs(readVelocity))), static_cast<int64_t>(1));
+
+        return;
+    }
+    // Likewise, the solution only holds until the writing head exits it.
+    double limit = std::numeric_limits<double>::max();
+    if (!loopSync_ && length < bufferSamples_)
+    {
+        limit = (length - writeOffset) / writeRate_;
     }
 
-    crossPoint_ = std::floor(crossPoint_);
+    // The gap between the heads changes by the relative velocity every
+    // sample, they meet when it wraps around the loop.
+    double gap = std::fmod(readOffset - writeOffset, length);
+    gap += gap < 0 ? length : 0;
+    crossingTime_ = velocity > 0 ? (length - gap) / velocity : (gap > 0 ? gap : length) / -velocity;
+    if (crossingTime_ >= limit)
+    {
+        crossingSamples_ = std::max(static_cast<int64_t>(std::ceil(limit)), static_cast<int64_t>(1));
 
+        return;
+    }
+
+    double crossPoint = std::fmod(writeOffset + writeRate_ * crossingTime_, length) + loopStart_;
+    crossPoint_ = std::floor(crossPoint >= bufferSamples_ ? crossPoint - bufferSamples_ : crossPoint);
     crossPointFound_ = true;
+
+    // The crossfade starts as soon as the writing head is close enough to
+    // the cross point, so that it's centered on it.
+    double start = crossingTime_ - writeHead_.GetSamplesToFade() / writeRate_;
+    crossingSamples_ = start > 0 ? static_cast<int64_t>(std::ceil(start)) : 0;
+    if (0 == crossingSamples_)
+    {
+        AdvanceCrossing(0);
+    }
+}
+
+void Looper::AdvanceCrossing(size_t samples)
+{
+    if (crossingChanged_)
+    {
+        ScheduleCrossing();
+
+        return;
+    }
+
+    crossingSamples_ -= samples;
+    crossingTime_ -= samples;
+    if (crossingSamples_ > 0)
+    {
+        return;
+    }
+
+    if (crossPointFound_)
+    {
+        crossPointFound_ = false;
+        float distance = crossingTime_ * writeRate_;
+        if (distance > 0 && !headsCrossFade.IsActive())
+        {
+            headsCrossFade.Init(Fader::FadeType::FADE_OUT_IN, distance * 2, writeRate_);
+            // Solve again when the crossfade is over.
+            crossingSamples_ = static_cast<int64_t>(std::ceil(distance * 2 / writeRate_));
+
+            return;
+        }
+    }
+    ScheduleCrossing();
 }
\ No newline at end of file
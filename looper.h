@@ -1,11 +1,15 @@
 #pragma once
 
 #include "head.h"
-#include <ctime>
+#include "loop_snapshot.h"
+#include "random.h"
 #include <cstdint>
 
 namespace wreath
 {
+    constexpr int32_t kPageSamplesPerFrame{64}; // Samples cleared or copied for each processed one
+    constexpr int32_t kDegradationPulses{64};   // The maximum pulses of the degradation pattern
+
     /**
      * @brief Represents the main looper, with a reading and a writing head.
      * @author Roberto Noris
@@ -22,14 +26,52 @@ namespace wreath
          *
          * @param sampleRate
          * @param buffer
+         * @param buffer2
          * @param maxBufferSamples
+         * @param stride 2 if the buffers are interleaved with another channel
+         * @param format How the samples are stored in the buffers
          */
-        void Init(int32_t sampleRate, float *buffer, float *buffer2, int32_t maxBufferSamples);
+        void Init(int32_t sampleRate, void *buffer, void *buffer2, int32_t maxBufferSamples, int32_t stride = 1, SampleFormat format = SampleFormat::FLOAT);
         /**
          * @brief Resets the looper when needed.
          */
         void Reset();
+        /**
+         * @brief Restarts the random sequence of the looper (the degradation
+         * pattern and amount) from the given seed, so that the same seed
+         * always renders the same. Call this after Init() and before
+         * processing.
+         *
+         * @param seed
+         */
+        void SetSeed(uint64_t seed);
+        /**
+         * @brief Starts clearing the buffers. This is done a bit at a time (see
+         * ProcessPages()), and any page of the buffers that is accessed
+         * before its turn is cleared right away, so that the clearing never
+         * takes longer than a few pages in a single call.
+         */
         void ClearBuffer();
+        /**
+         * @brief Starts copying the loop to the given snapshot, to be read by
+         * another thread (see LoopSnapshot). The pages are copied a bit at a
+         * time (see ProcessPages()), and before being written or cleared. Any
+         * snapshot still being copied is cancelled.
+         *
+         * @param snapshot
+         */
+        void StartExport(LoopSnapshot *snapshot);
+        /**
+         * @brief Goes on clearing the buffers and copying the snapshots,
+         * proportionally to the given number of processed frames. Call this
+         * once per block.
+         *
+         * @param frames
+         */
+        void ProcessPages(size_t frames);
+        inline bool IsClearing() { return clearing_; }
+        inline bool IsSnapshotting() { return snapshotting_; }
+        inline bool IsExporting() { return exporting_; }
         /**
          * @brief Writes the given value in the buffer during the buffering procedure.
          *
@@ -38,10 +80,28 @@ namespace wreath
          * @return false
          */
         bool Buffer(float value);
+        /**
+         * @brief Writes a block of values in the buffer during the buffering
+         * procedure. The values past the end of the buffer are dropped.
+         *
+         * @param input
+         * @param size
+         * @return true if the end of the buffer has been reached
+         */
+        bool BufferBlock(const float *input, size_t size);
         /**
          * @brief Completes the buffering procedure.
          */
         void StopBuffering();
+        /**
+         * @brief Sets the looper up as if the given number of samples had
+         * just been buffered, for when the buffers already hold them (e.g. a
+         * restored session). The freeze buffer is left as it is.
+         *
+         * @param bufferSamples
+         * @param freeze
+         */
+        void Restore(int32_t bufferSamples, float freeze);
         /**
          * @brief Starts the reading operation, either with a fade in or immediately
          * depending on the parameter.
@@ -88,13 +148,13 @@ namespace wreath
          *
          * @param start
          */
-        void SetLoopStart(float start);
+        void SetLoopStart(double start);
         /**
          * @brief Set the loop length, in samples.
          *
          * @param length
          */
-        void SetLoopLength(float length);
+        void SetLoopLength(double length);
         /**
          * @brief Sets the reading speed, in samples.
          *
@@ -119,18 +179,24 @@ namespace wreath
          * @param direction
          */
         void SetDirection(Direction direction);
+        /**
+         * @brief Sets the interpolation used by the reading heads.
+         *
+         * @param interpolation
+         */
+        void SetInterpolation(Interpolation interpolation);
         /**
          * @brief Sets the reading position.
          *
          * @param position
          */
-        void SetReadPos(float position);
+        void SetReadPos(double position);
         /**
          * @brief Sets the writing position.
          *
          * @param position
          */
-        void SetWritePos(float position);
+        void SetWritePos(double position);
         /**
          * @brief Sets whether the playback is looped or not.
          *
@@ -161,7 +227,23 @@ namespace wreath
          * @param input
          * @return float
          */
-        float Degrade(float input);
+        float Degrade(float input) { return input * GetDegradationGain(); }
+        /**
+         * @brief Returns the gain of the degradation at the writing position,
+         * 1 where the pattern leaves the signal alone.
+         *
+         * @return float
+         */
+        float GetDegradationGain();
+        /**
+         * @brief Fills a block with the gains of the degradation at the next
+         * writing positions, as GetDegradationGain() does sample by sample.
+         * The size must not exceed the steady samples.
+         *
+         * @param gains
+         * @param size
+         */
+        void GetDegradationGains(float *gains, size_t size);
         /**
          * @brief Sets up a fade between the two reading heads.
          */
@@ -200,9 +282,35 @@ namespace wreath
          * @param aSpeed
          * @param bSpeed
          * @param direction
-         * @return float
+         * @return double
+         */
+        double CalculateDistance(double a, double b, float aSpeed, float bSpeed, Direction direction);
+
+        /**
+         * @brief Returns how many of the next samples (up to size) can be
+         * processed as a block, that is with no active fades, no loop actions
+         * and with the heads far enough from each other.
+         *
+         * @param size
+         * @return size_t
+         */
+        size_t GetSteadySamples(size_t size);
+        /**
+         * @brief Reads a block of values and updates the reading position
+         * accordingly. The size must not exceed the steady samples.
+         *
+         * @param output
+         * @param size
+         */
+        void ReadBlock(float *output, size_t size);
+        /**
+         * @brief Writes a block of values and updates the writing position
+         * accordingly. The size must not exceed the steady samples.
+         *
+         * @param input
+         * @param size
          */
-        float CalculateDistance(float a, float b, float aSpeed, float bSpeed, Direction direction);
+        void WriteBlock(const float *input, size_t size);
 
         void SetReading(bool active) { readingActive_ = active; }
         void SetWriting(bool active) { writingActive_ = active; }
@@ -210,22 +318,23 @@ namespace wreath
         inline float GetSamplesToFade() { return readHeads_[activeReadHead_].GetSamplesToFade(); }
 
         inline int32_t GetBufferSamples() { return bufferSamples_; }
+        inline int32_t GetMaxBufferSamples() { return writeHead_.GetMaxBufferSamples(); }
         inline float GetBufferSeconds() { return bufferSeconds_; }
 
-        inline float GetLoopStart() { return loopStart_; }
+        inline double GetLoopStart() { return loopStart_; }
         inline float GetLoopStartSeconds() { return loopStartSeconds_; }
 
-        inline float GetLoopEnd() { return loopEnd_; }
+        inline double GetLoopEnd() { return loopEnd_; }
 
-        inline float GetLoopLength() { return loopLength_; }
+        inline double GetLoopLength() { return loopLength_; }
         inline float GetLoopLengthSeconds() { return loopLengthSeconds_; }
 
-        inline float GetReadPos() { return readPos_; }
+        inline double GetReadPos() { return readPos_; }
         inline float GetReadPosSeconds() { return readPosSeconds_; }
 
         inline float GetFreeze() { return freeze_; }
 
-        inline float GetWritePos() { return writePos_; }
+        inline double GetWritePos() { return writePos_; }
 
         inline float GetReadRate() { return readRate_; }
         inline float GetWriteRate() { return writeRate_; }
@@ -233,13 +342,16 @@ namespace wreath
 
         inline Movement GetMovement() { return movement_; }
         inline Direction GetDirection() { return direction_; }
+        inline Interpolation GetInterpolation() { return readHeads_[0].GetInterpolation(); }
         inline bool IsDrunkMovement() { return Movement::DRUNK == movement_; }
         inline bool IsGoingForward() { return Direction::FORWARD == direction_; }
 
-        inline float GetHeadsDistance() { return headsDistance_; }
-        inline float GetCrossPoint() { return crossPoint_; }
+        inline double GetHeadsDistance() { return CalculateDistance(readPos_, writePos_, readSpeed_, writeSpeed_, direction_); }
+        inline double GetCrossPoint() { return crossPoint_; }
         inline bool CrossPointFound() { return crossPointFound_; }
+        inline bool IsCrossFading() { return headsCrossFade.IsActive(); }
 
+        bool IsLoopSync() { return loopSync_; }
         bool IsReading() { return readingActive_; }
         bool IsWriting() { return writingActive_; }
 
@@ -254,15 +366,28 @@ namespace wreath
         };
 
         /**
-         * @brief Calculates where in the buffer the active reading head and the
-         * writing head will meet.
+         * @brief Solves for the next event of the heads crossing: either the
+         * start of the crossfade, centered on the point where the active
+         * reading head and the writing head will meet, or a point where the
+         * solution must be updated (e.g. when the writing head enters or
+         * exits the loop). This is done once, when any of the rates, the
+         * direction, the loop or the positions change, and not for every
+         * sample.
+         */
+        void ScheduleCrossing();
+        /**
+         * @brief Counts down to the next event of the heads crossing, after
+         * the writing head has moved by the given samples, and handles it
+         * when it's due.
+         *
+         * @param samples
          */
-        void CalculateCrossPoint();
+        void AdvanceCrossing(size_t samples);
 
         float *buffer_{};           // The buffer
         float *freezeBuffer_{};     // The buffer
         float bufferSeconds_{};     // Written buffer length in seconds
-        float readPos_{};           // The read position
+        double readPos_{};          // The read position
         float readPosSeconds_{};    // Read position in seconds
         float loopStartSeconds_{};  // Start of the loop in seconds
         float loopLengthSeconds_{}; // Length of the loop in seconds
@@ -271,14 +396,13 @@ namespace wreath
         float readSpeed_{};         // Actual read speed
         float writeSpeed_{};        // Actual write speed
         int32_t bufferSamples_{};   // The written buffer length in samples
-        float writePos_{};          // The write position
-        float loopStart_{};         // Loop start position
-        float loopEnd_{};           // Loop end position
-        float loopLength_{};        // Length of the loop in samples
+        double writePos_{};         // The write position
+        double loopStart_{};        // Loop start position
+        double loopEnd_{};          // Loop end position
+        double loopLength_{};       // Length of the loop in samples
         int32_t intLoopLength_{};
         int32_t intLoopStart_{}; // Loop start position
         int32_t intLoopEnd_{};   // Loop end position
-        float headsDistance_{};
         int32_t sampleRate_{}; // The sample rate
         Direction direction_{};
         float freeze_{};
@@ -287,8 +411,11 @@ namespace wreath
         bool looping_{};
         bool loopSync_{};
         bool mustSyncHeads_{};
-        float crossPoint_{};
-        bool crossPointFound_{};
+        double crossPoint_{};
+        bool crossPointFound_{};   // Whether the next event is the start of the crossfade
+        bool crossingChanged_{};   // Whether the next event must be solved again
+        int64_t crossingSamples_{}; // The samples before the next event
+        double crossingTime_{};     // The samples before the heads meet
         bool readingActive_{true};
         bool writingActive_{true};
         float lengthFadePos_{};
@@ -296,7 +423,119 @@ namespace wreath
         bool loopLengthGrown_{};
         bool triggered_{};
 
-        float eRand_{};
+        Random random_{};
+        int32_t degradationPulses_{};
+        // The pattern of the degradation, as the boundaries of its spans, see
+        // UpdateDegradation(). It's rebuilt when any of the values it was
+        // built for changes.
+        int32_t degradationSpans_{};
+        int32_t degradationBounds_[kDegradationPulses + 1]{};
+        int32_t degradationSpan_{}; // The last span found
+        bool degradeAll_{};
+        float patternDegradation_{};
+        int32_t patternBufferSamples_{};
+        int32_t patternPulses_{};
+
+        float frozenBlock_[kMaxBlockSize]{};
+        // The envelopes of the fades in the current block, see
+        // ComposeReadGains() and ComposeWriteGains().
+        float readGains_[kMaxBlockSize]{};
+        float frozenGains_[kMaxBlockSize]{};
+        float writeGains_[kMaxBlockSize]{};
+        float fadeGains_[kMaxBlockSize]{};
+        float writeBlock_[kMaxBlockSize]{};
+        Fader::Gains freezeGains_{1.f, 0.f}; // The crossfade with the frozen buffer
+
+        // The pages of the buffers. When clearing, the pending pages are
+        // zeroed. When freezing, the freeze buffer is a copy-on-write snapshot
+        // of the buffer: the pending pages are copied before being written or
+        // read, and in the background. When exporting, the pages of the loop
+        // are copied the same way, before being written or cleared.
+        int32_t pageSamples_{};
+        int32_t pageBudget_{}; // Samples that can be processed by the next call
+        bool clearing_{};
+        bool clearPending_[kBufferPages]{};
+        int32_t clearPage_{}; // The next page to be cleared
+        bool snapshotting_{};
+        bool snapshotPending_[kBufferPages]{};
+        int32_t snapshotPage_{}; // The next page to be copied
+        int32_t snapshotPages_{};
+        bool exporting_{};
+        bool exportPending_[kBufferPages]{};
+        int32_t exportPage_{}; // The next page to be exported
+        LoopSnapshot *export_{};
+
+        /**
+         * @brief Clears the given page if it's still pending.
+         *
+         * @param page
+         */
+        void ClearPage(int32_t page);
+        /**
+         * @brief Copies the given page to the freeze buffer if it's still
+         * pending.
+         *
+         * @param page
+         */
+        void CopyPage(int32_t page);
+        /**
+         * @brief Copies the given page to the export snapshot if it's still
+         * pending, and publishes it.
+         *
+         * @param page
+         */
+        void ExportPage(int32_t page);
+        /**
+         * @brief Lets the export snapshot go, with the given status.
+         *
+         * @param status
+         */
+        void ReleaseExport(LoopSnapshot::Status status);
+        /**
+         * @brief Rebuilds the pattern of the degradation if the amount, the
+         * buffer length or the pulses have changed. The buffer is split in
+         * alternating spans that are left alone (the even ones) or degraded
+         * (the odd ones), as many as the pulses times the amount.
+         */
+        void UpdateDegradation();
+        /**
+         * @brief Returns the span of the degradation pattern holding the
+         * given index.
+         *
+         * @param index
+         * @return int32_t
+         */
+        int32_t FindDegradationSpan(int32_t index);
+        inline bool IsDegraded(int32_t span) { return degradeAll_ || (span & 1); }
+        /**
+         * @brief Starts taking the snapshot of the buffer for freezing.
+         */
+        void TakeSnapshot();
+        /**
+         * @brief Composes the active fades of the reading into the gains of
+         * the read values and of the frozen ones, for the next block.
+         *
+         * @param size
+         * @return false if there are no fades, and the values only need the
+         * freeze mix
+         */
+        bool ComposeReadGains(size_t size);
+        /**
+         * @brief Composes the active fades of the writing into the gains of
+         * the written values, for the next block.
+         *
+         * @param size
+         * @return false if there are no fades
+         */
+        bool ComposeWriteGains(size_t size);
+        /**
+         * @brief Handles the pending pages that the heads may access in the
+         * next samples (the given distance around their position, and around
+         * the loop boundaries, where the interpolation wraps).
+         *
+         * @param distance
+         */
+        void PreparePagesAroundHeads(int32_t distance);
 
         Head writeHead_{Type::WRITE};
         Head readHeads_[2]{{Type::READ}, {Type::READ}};
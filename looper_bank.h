@@ -0,0 +1,301 @@
+#pragma once
+
+#include "stereo_looper.h"
+#include "command_queue.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace wreath
+{
+    constexpr size_t kBankControlQueueSize{1024}; // Must be a power of 2
+    constexpr int kWorkerSpins{64}; // Times an idle worker checks for a block before parking
+    constexpr std::chrono::milliseconds kWorkerParkTime{1}; // Time a worker stays parked, doubled while idle
+    constexpr std::chrono::milliseconds kWorkerMaxParkTime{100}; // Max time a worker stays parked
+
+    /**
+     * @brief A bank of independent stereo loopers (the voices), all fed with
+     * the same input, processed in blocks across a pool of worker threads and
+     * mixed together. The control changes go through a lock-free queue and are
+     * applied at the start of the next block, so the audio thread never blocks.
+     */
+    class LooperBank
+    {
+    public:
+        /**
+         * @brief A control change, applied to a voice by the audio thread.
+         * Captureless lambdas can be used as setters.
+         */
+        using Setter = void (*)(StereoLooper &voice, float value);
+
+        LooperBank() {}
+        ~LooperBank()
+        {
+            StopWorkers();
+        }
+
+        LooperBank(const LooperBank &) = delete;
+        LooperBank &operator=(const LooperBank &) = delete;
+
+        /**
+         * @brief Inits the bank, allocating the buffers of the voices and
+         * starting the workers. Not real-time safe.
+         *
+         * @param sampleRate
+         * @param conf The configuration of all the voices
+         * @param voices The number of voices
+         * @param bufferSamples The size of the buffers of each voice
+         * @param threads The number of threads, including the audio one
+         * @param format How the samples are stored in the buffers
+         */
+        void Init(int32_t sampleRate, StereoLooper::Conf conf, size_t voices, int32_t bufferSamples, size_t threads, SampleFormat format = SampleFormat::FLOAT)
+        {
+            size_t bufferBytes = storage::BufferBytes(format, bufferSamples, 2);
+            StopWorkers();
+
+            voices_.clear();
+            voices_.reserve(voices);
+            for (size_t i = 0; i < voices; i++)
+            {
+                voices_.emplace_back(new Voice(bufferBytes));
+                Voice &voice = *voices_.back();
+                // The channels are interleaved, as the voices are mostly linked.
+                uint8_t *buffers = voice.buffers.data();
+                voice.looper.Init(sampleRate, conf, {buffers, nullptr, buffers + bufferBytes, nullptr, bufferSamples, true, format});
+                // So that the voices don't degrade in unison.
+                voice.looper.SetSeed(i);
+            }
+
+            controls_.Clear();
+
+            StartWorkers(std::max<size_t>(threads, 1) - 1);
+        }
+
+        /**
+         * @brief Queues a control change for the given voice, or for all the
+         * voices if voice is negative. Call this from a single (control)
+         * thread.
+         *
+         * @param voice
+         * @param setter
+         * @param value
+         * @return false if the queue is full
+         */
+        bool Push(int32_t voice, Setter setter, float value)
+        {
+            return controls_.Push({voice, setter, value});
+        }
+
+        /**
+         * @brief Processes a block of all the voices and mixes their output.
+         *
+         * @param leftIn
+         * @param rightIn
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        void ProcessBlock(const float *leftIn, const float *rightIn, float *leftOut, float *rightOut, size_t size)
+        {
+            ApplyControls();
+
+            std::fill(leftOut, leftOut + size, 0.f);
+            std::fill(rightOut, rightOut + size, 0.f);
+
+            for (size_t i = 0; i < size; i += kMaxBlockSize)
+            {
+                size_t blockSize = std::min(size - i, kMaxBlockSize);
+                leftIn_ = leftIn + i;
+                rightIn_ = rightIn + i;
+                blockSize_ = blockSize;
+
+                // Publish the block and help the workers with it.
+                doneVoices_.store(0, std::memory_order_relaxed);
+                generation_ = (generation_ + 1) & 0xffffffff;
+                ticket_.store(generation_ << 32);
+                WakeWorkers();
+                ProcessVoices(generation_);
+                while (doneVoices_.load(std::memory_order_acquire) < voices_.size())
+                {
+                }
+
+                for (std::unique_ptr<Voice> &voice : voices_)
+                {
+                    for (size_t j = 0; j < blockSize; j++)
+                    {
+                        leftOut[i + j] += voice->leftOut[j];
+                        rightOut[i + j] += voice->rightOut[j];
+                    }
+                }
+            }
+        }
+
+        /**
+         * @brief Direct access to a voice. Only use this when the bank is not
+         * being processed (e.g. to set it up), otherwise use Push().
+         *
+         * @param voice
+         * @return StereoLooper&
+         */
+        StereoLooper &GetVoice(size_t voice) { return voices_[voice]->looper; }
+        size_t GetVoices() { return voices_.size(); }
+        size_t GetThreads() { return workers_.size() + 1; }
+
+    private:
+        struct alignas(64) Voice
+        {
+            Voice(size_t bufferBytes) : buffers(bufferBytes * 2) {}
+
+            StereoLooper looper;
+            std::vector<uint8_t> buffers;
+            float leftOut[kMaxBlockSize]{};
+            float rightOut[kMaxBlockSize]{};
+        };
+
+        struct Control
+        {
+            int32_t voice;
+            Setter setter;
+            float value;
+        };
+
+        void ApplyControls()
+        {
+            for (const Control *control = controls_.Front(); control; control = controls_.Front())
+            {
+                if (control->voice < 0)
+                {
+                    for (std::unique_ptr<Voice> &voice : voices_)
+                    {
+                        control->setter(voice->looper, control->value);
+                    }
+                }
+                else if (static_cast<size_t>(control->voice) < voices_.size())
+                {
+                    control->setter(voices_[control->voice]->looper, control->value);
+                }
+                controls_.Pop();
+            }
+        }
+
+        // Takes the voices of the given block one at a time, until there are
+        // none left. The ticket holds the block in the high bits and the next
+        // voice in the low ones, so that a late worker can't take a voice of
+        // the following block.
+        void ProcessVoices(uint64_t generation)
+        {
+            uint64_t count = voices_.size();
+            uint64_t ticket = ticket_.load(std::memory_order_acquire);
+            while ((ticket >> 32) == generation && (ticket & 0xffffffff) < count)
+            {
+                if (!ticket_.compare_exchange_weak(ticket, ticket + 1, std::memory_order_acquire))
+                {
+                    continue;
+                }
+                Voice &voice = *voices_[ticket & 0xffffffff];
+                voice.looper.ProcessBlock(leftIn_, rightIn_, voice.leftOut, voice.rightOut, blockSize_);
+                doneVoices_.fetch_add(1, std::memory_order_release);
+                ticket = ticket_.load(std::memory_order_acquire);
+            }
+        }
+
+        // Waits for the blocks and helps with them. After a block, a worker
+        // spins for a bit in case the next one is close, then parks until
+        // it's woken up.
+        void Work()
+        {
+            uint64_t generation = ticket_.load(std::memory_order_acquire) >> 32;
+            int spins{};
+            std::chrono::milliseconds parkTime{kWorkerParkTime};
+            while (running_.load(std::memory_order_relaxed))
+            {
+                uint64_t next = ticket_.load(std::memory_order_acquire) >> 32;
+                if (next == generation)
+                {
+                    if (spins < kWorkerSpins)
+                    {
+                        spins++;
+                        std::this_thread::yield();
+                    }
+                    else
+                    {
+                        Park(generation, parkTime);
+                        parkTime = std::min(parkTime * 2, kWorkerMaxParkTime);
+                    }
+                    continue;
+                }
+                generation = next;
+                ProcessVoices(generation);
+                spins = 0;
+                parkTime = kWorkerParkTime;
+            }
+        }
+
+        // The audio thread doesn't take the lock to wake the workers up, so a
+        // wake up can be missed: the worker is then back after the given time,
+        // while the audio thread processes the voices left.
+        void Park(uint64_t generation, std::chrono::milliseconds time)
+        {
+            std::unique_lock<std::mutex> lock{parkMutex_};
+            parkedWorkers_.fetch_add(1);
+            parked_.wait_for(lock, time, [this, generation]()
+                             { return (ticket_.load() >> 32) != generation || !running_.load(); });
+            parkedWorkers_.fetch_sub(1);
+        }
+
+        // Called after the ticket is published: both it and the parked count
+        // are sequentially consistent, so a worker that is parking either
+        // sees the block or is counted here.
+        void WakeWorkers()
+        {
+            if (parkedWorkers_.load() > 0)
+            {
+                parked_.notify_all();
+            }
+        }
+
+        void StartWorkers(size_t workers)
+        {
+            running_.store(true);
+            for (size_t i = 0; i < workers; i++)
+            {
+                workers_.emplace_back(&LooperBank::Work, this);
+            }
+        }
+
+        void StopWorkers()
+        {
+            running_.store(false);
+            parked_.notify_all();
+            for (std::thread &worker : workers_)
+            {
+                worker.join();
+            }
+            workers_.clear();
+        }
+
+        std::vector<std::unique_ptr<Voice>> voices_;
+        std::vector<std::thread> workers_;
+        std::atomic<bool> running_{};
+        std::mutex parkMutex_;
+        std::condition_variable parked_;
+        std::atomic<int> parkedWorkers_{};
+
+        // The block being processed.
+        const float *leftIn_{};
+        const float *rightIn_{};
+        size_t blockSize_{};
+        uint64_t generation_{};
+        alignas(64) std::atomic<uint64_t> ticket_{};
+        alignas(64) std::atomic<size_t> doneVoices_{};
+
+        CommandQueue<Control, kBankControlQueueSize> controls_;
+    };
+} // namespace wreath
@@ -0,0 +1,411 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <thread>
+#define WREATH_MAPPED_BUFFERS
+#endif
+
+namespace wreath
+{
+    constexpr float kPrefetchSeconds{2.f};  // How far ahead of the heads the pages are fetched
+    constexpr int32_t kPrefetchPeriodMs{5}; // How often the prefetcher wakes up
+    constexpr size_t kPageBytes{4096};
+
+    /**
+     * @brief A file mapped in memory, to be used as a loop buffer much longer
+     * than the available RAM: the pages are loaded on access and written back
+     * by the kernel. Only available on Linux and macOS. Use a Prefetcher to
+     * keep the pages the heads are about to reach in memory.
+     */
+    class MappedBuffer
+    {
+    public:
+        MappedBuffer() {}
+        ~MappedBuffer()
+        {
+            Unmap();
+        }
+
+        MappedBuffer(const MappedBuffer &) = delete;
+        MappedBuffer &operator=(const MappedBuffer &) = delete;
+
+        /**
+         * @brief Maps the given file, creating it or growing it to the given
+         * size (the new part reads as zeroes). Not real-time safe.
+         *
+         * @param path
+         * @param bytes Use storage::BufferBytes() to size it, 0 to map the
+         * whole existing file
+         * @return false if the file can't be mapped
+         */
+        bool Map(const char *path, size_t bytes)
+        {
+            Unmap();
+#ifdef WREATH_MAPPED_BUFFERS
+            int fd = open(path, O_RDWR | O_CREAT, 0644);
+            if (fd < 0)
+            {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (static_cast<size_t>(st.st_size) < bytes && ftruncate(fd, bytes) != 0))
+            {
+                close(fd);
+                return false;
+            }
+            bytes = bytes > 0 ? bytes : static_cast<size_t>(st.st_size);
+            if (0 == bytes)
+            {
+                close(fd);
+                return false;
+            }
+            void *data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            // The mapping keeps the file open.
+            close(fd);
+            if (MAP_FAILED == data)
+            {
+                return false;
+            }
+            data_ = data;
+            bytes_ = bytes;
+
+            return true;
+#else
+            (void)path;
+            (void)bytes;
+            return false;
+#endif
+        }
+
+        /**
+         * @brief Unmaps the file, the changes are written back by the kernel.
+         */
+        void Unmap()
+        {
+#ifdef WREATH_MAPPED_BUFFERS
+            if (data_)
+            {
+                munmap(data_, bytes_);
+            }
+#endif
+            data_ = nullptr;
+            bytes_ = 0;
+        }
+
+        /**
+         * @brief Starts writing the changes back to the file, without waiting
+         * for it.
+         */
+        void Flush()
+        {
+#ifdef WREATH_MAPPED_BUFFERS
+            if (data_)
+            {
+                msync(data_, bytes_, MS_ASYNC);
+            }
+#endif
+        }
+
+        inline void *GetData() { return data_; }
+        inline size_t GetBytes() { return bytes_; }
+        inline bool IsMapped() { return data_ != nullptr; }
+
+    private:
+        void *data_{};
+        size_t bytes_{};
+    };
+
+    /**
+     * @brief Keeps the pages the heads are about to reach in memory, so that
+     * the audio thread doesn't block on page faults when the buffers are
+     * mapped files. The audio thread publishes where the heads are and how
+     * they move (see StereoLooper::SetPrefetcher()), a background thread
+     * turns that into read-ahead hints and touches the pages along the path
+     * of the heads, wrapping around the loop.
+     */
+    class Prefetcher
+    {
+    public:
+        /**
+         * @brief Where the heads of a channel are, in samples, at which rate
+         * they move (negative if backwards) and the loops they go around. The
+         * writing head only follows the loop in delay mode, otherwise it goes
+         * through the whole buffer.
+         */
+        struct Heads
+        {
+            double readPos;
+            float readRate;
+            double writePos;
+            float writeRate;
+            double loopStart;
+            double loopLength;
+            double writeLoopStart;
+            double writeLoopLength;
+            int32_t bufferSamples;
+        };
+
+        Prefetcher() {}
+        ~Prefetcher()
+        {
+#ifdef WREATH_MAPPED_BUFFERS
+            Stop();
+#endif
+        }
+
+        Prefetcher(const Prefetcher &) = delete;
+        Prefetcher &operator=(const Prefetcher &) = delete;
+
+        /**
+         * @brief Sets the buffers of a channel. Call this before Start().
+         *
+         * @param channel 0 or 1
+         * @param buffer
+         * @param freezeBuffer
+         * @param samples The size of the buffers in samples
+         * @param pitch The distance in bytes between two samples
+         */
+        void SetChannel(size_t channel, const void *buffer, const void *freezeBuffer, int32_t samples, int32_t pitch)
+        {
+            channels_[channel].buffers[0] = static_cast<const uint8_t *>(buffer);
+            channels_[channel].buffers[1] = static_cast<const uint8_t *>(freezeBuffer);
+            channels_[channel].samples = samples;
+            channels_[channel].pitch = pitch;
+        }
+
+        /**
+         * @brief Publishes the position of the heads of a channel. Real-time
+         * safe, it's called by the audio thread.
+         *
+         * @param channel
+         * @param heads
+         */
+        void Publish(size_t channel, const Heads &heads)
+        {
+            Channel &c = channels_[channel];
+            c.readPos.store(heads.readPos, std::memory_order_relaxed);
+            c.readRate.store(heads.readRate, std::memory_order_relaxed);
+            c.writePos.store(heads.writePos, std::memory_order_relaxed);
+            c.writeRate.store(heads.writeRate, std::memory_order_relaxed);
+            c.loopStart.store(heads.loopStart, std::memory_order_relaxed);
+            c.loopLength.store(heads.loopLength, std::memory_order_relaxed);
+            c.writeLoopStart.store(heads.writeLoopStart, std::memory_order_relaxed);
+            c.writeLoopLength.store(heads.writeLoopLength, std::memory_order_relaxed);
+            c.bufferSamples.store(heads.bufferSamples, std::memory_order_relaxed);
+        }
+
+#ifdef WREATH_MAPPED_BUFFERS
+        /**
+         * @brief Starts the prefetching thread. Not real-time safe.
+         *
+         * @param sampleRate
+         * @param lookahead How far ahead of the heads, in seconds
+         */
+        void Start(int32_t sampleRate, float lookahead = kPrefetchSeconds)
+        {
+            Stop();
+            lookahead_ = sampleRate * lookahead;
+            running_.store(true);
+            thread_ = std::thread(&Prefetcher::Work, this);
+        }
+
+        void Stop()
+        {
+            running_.store(false);
+            if (thread_.joinable())
+            {
+                thread_.join();
+            }
+        }
+#endif
+
+        /**
+         * @brief Fetches the pages ahead of the heads once. This is what the
+         * thread does periodically, it can be called directly when there's
+         * no thread.
+         *
+         * @param lookahead How far ahead of the heads, in samples
+         */
+        void Prefetch(float lookahead)
+        {
+            for (Channel &channel : channels_)
+            {
+                if (!channel.buffers[0] || channel.samples <= 0)
+                {
+                    continue;
+                }
+                float readRate = channel.readRate.load(std::memory_order_relaxed);
+                Advise(channel, readRate);
+                FetchPath(channel, channel.readPos.load(std::memory_order_relaxed), readRate * lookahead, channel.loopStart.load(std::memory_order_relaxed), channel.loopLength.load(std::memory_order_relaxed), false);
+                FetchPath(channel, channel.writePos.load(std::memory_order_relaxed), channel.writeRate.load(std::memory_order_relaxed) * lookahead, channel.writeLoopStart.load(std::memory_order_relaxed), channel.writeLoopLength.load(std::memory_order_relaxed), true);
+            }
+        }
+
+    private:
+        enum class Advice
+        {
+            NONE,
+            SEQUENTIAL,
+            RANDOM,
+        };
+
+        struct Channel
+        {
+            const uint8_t *buffers[2]{};
+            int32_t samples{};
+            int32_t pitch{};
+            Advice advice{};
+            std::atomic<double> readPos{};
+            std::atomic<float> readRate{};
+            std::atomic<double> writePos{};
+            std::atomic<float> writeRate{};
+            std::atomic<double> loopStart{};
+            std::atomic<double> loopLength{};
+            std::atomic<double> writeLoopStart{};
+            std::atomic<double> writeLoopLength{};
+            std::atomic<int32_t> bufferSamples{};
+        };
+
+        // The kernel's read-ahead only goes forward: it helps when the read
+        // head moves forward at about the normal rate, otherwise it reads
+        // pages that won't be used and only the explicit fetching is left.
+        void Advise(Channel &channel, float readRate)
+        {
+            Advice advice = (readRate > 0.5f && readRate < 2.f) ? Advice::SEQUENTIAL : Advice::RANDOM;
+            if (advice == channel.advice)
+            {
+                return;
+            }
+            channel.advice = advice;
+#ifdef WREATH_MAPPED_BUFFERS
+            for (const uint8_t *buffer : channel.buffers)
+            {
+                if (buffer)
+                {
+                    uintptr_t start = reinterpret_cast<uintptr_t>(buffer) & ~(kPageBytes - 1);
+                    uintptr_t end = reinterpret_cast<uintptr_t>(buffer) + static_cast<size_t>(channel.samples) * channel.pitch;
+                    madvise(reinterpret_cast<void *>(start), end - start, Advice::SEQUENTIAL == advice ? MADV_SEQUENTIAL : MADV_RANDOM);
+                }
+            }
+#endif
+        }
+
+        // Fetches the samples the head will go through (distance, negative if
+        // backwards), wrapping around its loop (or the buffer, while it's
+        // being filled). The freeze buffer is only read, the path of the
+        // writing head is fetched for writing.
+        void FetchPath(Channel &channel, double position, float distance, double loopStart, double loopLength, bool writing)
+        {
+            int32_t bufferSamples = channel.bufferSamples.load(std::memory_order_relaxed);
+            if (bufferSamples <= 0)
+            {
+                bufferSamples = channel.samples;
+                loopStart = 0.f;
+                loopLength = bufferSamples;
+            }
+            int64_t length = static_cast<int64_t>(std::max(loopLength, 1.0));
+            int64_t samples = std::min(static_cast<int64_t>(std::abs(distance)) + 1, length);
+            int64_t start = static_cast<int64_t>(loopStart);
+            // The offset of the head in the loop.
+            int64_t offset = static_cast<int64_t>(position) - start;
+            offset = ((offset % bufferSamples) + bufferSamples) % bufferSamples;
+            offset = std::min(offset, length - 1);
+            int64_t from = distance >= 0.f ? offset : offset - samples + 1;
+
+            // At most two pieces: up to the loop end and from the loop start.
+            for (int64_t done = 0; done < samples;)
+            {
+                int64_t first = ((from + done) % length + length) % length;
+                int64_t count = std::min(samples - done, length - first);
+                Fetch(channel, 0, start + first, count, writing);
+                if (!writing)
+                {
+                    Fetch(channel, 1, start + first, count, false);
+                }
+                done += count;
+            }
+        }
+
+        // Fetches count samples from the given one, wrapping around the
+        // buffer.
+        void Fetch(Channel &channel, size_t buffer, int64_t from, int64_t count, bool writing)
+        {
+            const uint8_t *base = channel.buffers[buffer];
+            if (!base)
+            {
+                return;
+            }
+            from %= channel.samples;
+            int64_t head = std::min(count, channel.samples - from);
+            Touch(base + from * channel.pitch, head * channel.pitch, writing);
+            if (count > head)
+            {
+                Touch(base, (count - head) * channel.pitch, writing);
+            }
+        }
+
+        // Loads the pages of the range, so that the faults happen in this
+        // thread and not in the audio one. The pages that are going to be
+        // written are populated writable, so that the first write doesn't
+        // fault either. Where the kernel can't populate them, it reads a byte
+        // of each page (its value doesn't matter, even if the audio thread is
+        // writing it).
+        void Touch(const uint8_t *data, int64_t bytes, bool writing)
+        {
+            uintptr_t start = reinterpret_cast<uintptr_t>(data) & ~(kPageBytes - 1);
+            uintptr_t end = reinterpret_cast<uintptr_t>(data) + bytes;
+#ifdef WREATH_MAPPED_BUFFERS
+#ifdef MADV_POPULATE_WRITE
+            if (writing && 0 == madvise(reinterpret_cast<void *>(start), end - start, MADV_POPULATE_WRITE))
+            {
+                return;
+            }
+#endif
+#ifdef MADV_POPULATE_READ
+            if (0 == madvise(reinterpret_cast<void *>(start), end - start, MADV_POPULATE_READ))
+            {
+                return;
+            }
+#endif
+            madvise(reinterpret_cast<void *>(start), end - start, MADV_WILLNEED);
+#endif
+            // Stay inside of the range, its first page may start before it.
+            uint8_t sum{};
+            for (uintptr_t page = start; page < end; page += kPageBytes)
+            {
+                sum += *reinterpret_cast<const volatile uint8_t *>(std::max(page, reinterpret_cast<uintptr_t>(data)));
+            }
+            sink_ = sum;
+        }
+
+#ifdef WREATH_MAPPED_BUFFERS
+        void Work()
+        {
+            while (running_.load(std::memory_order_relaxed))
+            {
+                Prefetch(lookahead_);
+                std::this_thread::sleep_for(std::chrono::milliseconds(kPrefetchPeriodMs));
+            }
+        }
+#endif
+
+        Channel channels_[2];
+        volatile uint8_t sink_{};
+#ifdef WREATH_MAPPED_BUFFERS
+        float lookahead_{}; // In samples
+        std::atomic<bool> running_{};
+        std::thread thread_;
+#endif
+    };
+} // namespace wreath
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "fader.h"
+#include <algorithm>
+#include <cstddef>
+
+namespace wreath
+{
+    /**
+     * @brief Soft clips a block of samples, after applying the given gain.
+     * The result is the same as daisysp::SoftClip(), whose curve reaches ±1
+     * at ±3: clamping the input there replaces its branches, so the loop has
+     * none and is vectorized.
+     *
+     * @param input
+     * @param output It can be the same as input
+     * @param size
+     * @param gain
+     */
+    inline void SoftClipBlock(const float *input, float *output, size_t size, float gain = 1.f)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            float x = std::min(std::max(input[i] * gain, -3.f), 3.f);
+            output[i] = x * (27.f + x * x) / (27.f + 9.f * x * x);
+        }
+    }
+
+    /**
+     * @brief The output stage of StereoLooper: stereo widening of the wet
+     * signal, dry/wet mix and gain, then soft clipping. The mid/side matrix,
+     * the crossfade and the gain are folded into three coefficients, that are
+     * only calculated again when the parameters change, and a whole block is
+     * processed at once.
+     */
+    class OutputStage
+    {
+    public:
+        OutputStage() {}
+        ~OutputStage() {}
+
+        /**
+         * @brief Sets the parameters of the stage, updating the coefficients
+         * if any of them has changed.
+         *
+         * @param stereoWidth
+         * @param dryWetMix
+         * @param gain
+         */
+        void SetParameters(float stereoWidth, float dryWetMix, float gain)
+        {
+            if (initialized_ && stereoWidth == stereoWidth_ && dryWetMix == dryWetMix_ && gain == gain_)
+            {
+                return;
+            }
+            initialized_ = true;
+            stereoWidth_ = stereoWidth;
+            dryWetMix_ = dryWetMix;
+            gain_ = gain;
+
+            // Going to mid/side and back scales by 1/2, the side is scaled by
+            // the width: each wet channel gets (1 + width) / 2 of itself and
+            // (1 - width) / 2 of the other.
+            Fader::Gains gains = Fader::EqualCrossFadeGains(dryWetMix);
+            dry_ = gains.from * gain;
+            direct_ = 0.5f * (1.f + stereoWidth) * gains.to * gain;
+            cross_ = 0.5f * (1.f - stereoWidth) * gains.to * gain;
+        }
+
+        /**
+         * @brief Mixes a block of the dry and the wet signals to the output.
+         *
+         * @param leftDry
+         * @param rightDry
+         * @param leftWet
+         * @param rightWet
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        void Process(const float *leftDry, const float *rightDry, const float *leftWet, const float *rightWet, float *leftOut, float *rightOut, size_t size)
+        {
+            for (size_t i = 0; i < size; i++)
+            {
+                leftOut[i] = leftDry[i] * dry_ + leftWet[i] * direct_ + rightWet[i] * cross_;
+                rightOut[i] = rightDry[i] * dry_ + rightWet[i] * direct_ + leftWet[i] * cross_;
+            }
+            SoftClipBlock(leftOut, leftOut, size);
+            SoftClipBlock(rightOut, rightOut, size);
+        }
+
+        /**
+         * @brief Same as Process, but with no wet signal.
+         *
+         * @param leftDry
+         * @param rightDry
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        void ProcessDry(const float *leftDry, const float *rightDry, float *leftOut, float *rightOut, size_t size)
+        {
+            SoftClipBlock(leftDry, leftOut, size, dry_);
+            SoftClipBlock(rightDry, rightOut, size, dry_);
+        }
+
+    private:
+        bool initialized_{};
+        float stereoWidth_{};
+        float dryWetMix_{};
+        float gain_{};
+
+        float dry_{};    // The gain of the dry signal
+        float direct_{}; // The gain of each wet channel to its own output
+        float cross_{};  // The gain of each wet channel to the other output
+    };
+} // namespace wreath
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace wreath
+{
+    constexpr uint64_t kDefaultSeed{0x853c49e6748fea9bULL};
+
+    /**
+     * @brief A small and fast pseudo-random generator (PCG32), so that each
+     * looper has its own sequence: unlike std::rand() it has no global state
+     * to share (or lock) between instances and threads, and the same seed
+     * always gives the same sequence.
+     * @see https://www.pcg-random.org/
+     */
+    class Random
+    {
+    public:
+        Random(uint64_t seed = kDefaultSeed)
+        {
+            Seed(seed);
+        }
+        ~Random() {}
+
+        /**
+         * @brief Restarts the sequence from the given seed.
+         *
+         * @param seed
+         */
+        void Seed(uint64_t seed)
+        {
+            state_ = 0;
+            Next();
+            state_ += seed;
+            Next();
+        }
+
+        /**
+         * @brief Returns the next 32 random bits.
+         *
+         * @return uint32_t
+         */
+        inline uint32_t Next()
+        {
+            uint64_t state = state_;
+            state_ = state * 6364136223846793005ULL + kIncrement;
+            uint32_t xorShifted = static_cast<uint32_t>(((state >> 18) ^ state) >> 27);
+            uint32_t rotation = static_cast<uint32_t>(state >> 59);
+
+            return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+        }
+
+        /**
+         * @brief Returns a random value in [0, 1).
+         *
+         * @return float
+         */
+        inline float NextFloat()
+        {
+            return (Next() >> 8) * (1.f / 16777216.f);
+        }
+
+        /**
+         * @brief Returns a random gain in (1 - depth, 1].
+         *
+         * @param depth
+         * @return float
+         */
+        inline float NextGain(float depth)
+        {
+            return 1.f - NextFloat() * depth;
+        }
+
+        /**
+         * @brief Fills a block with random gains in (1 - depth, 1], as
+         * NextGain() does.
+         *
+         * @param gains
+         * @param size
+         * @param depth
+         */
+        void FillGains(float *gains, size_t size, float depth)
+        {
+            for (size_t i = 0; i < size; i++)
+            {
+                gains[i] = NextGain(depth);
+            }
+        }
+
+    private:
+        static constexpr uint64_t kIncrement{1442695040888963407ULL};
+
+        uint64_t state_{};
+    };
+} // namespace wreath
@@ -0,0 +1,4 @@
+#!/bin/sh
+
+clang++ -std=c++17 -stdlib=libc++ -O3 -march=native -pthread -I./DaisySP/Source bench.cpp looper.cpp -o bench
+./bench
\ No newline at end of file
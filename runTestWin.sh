@@ -1,4 +1,4 @@
 #!/bin/sh
 
-g++ -I./DaisySP/Source tests.cpp looper.cpp -o tests
+g++ -std=c++17 -pthread -I./DaisySP/Source tests.cpp looper.cpp -o tests
 ./tests
\ No newline at end of file
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace wreath
+{
+    /**
+     * @brief How the samples are stored in the buffers. The compact formats
+     * fit twice the samples (or more) in the same memory, at the cost of some
+     * quantization noise. The integer formats clip the values outside of
+     * [-1, 1].
+     */
+    enum SampleFormat
+    {
+        FLOAT,
+        INT16,
+        INT24,    // Packed, 3 bytes per sample
+        BFLOAT16, // The upper half of a float
+    };
+
+    /**
+     * @brief The conversions from and to each sample format.
+     *
+     * Load() and Store() convert a single sample, Decode() converts a vector
+     * of 32-bit words gathered at the samples' addresses (see
+     * interpolation::Vector::GatherBits()). Those words extend past the
+     * sample, so the buffers in a compact format must have a few bytes of
+     * padding at the end (see BufferBytes()). The samples are little-endian.
+     */
+    namespace storage
+    {
+        /**
+         * @brief Scales the value to the given full scale and rounds it,
+         * clipping it to [-1, 1] first.
+         *
+         * @param value
+         * @param scale
+         * @return int32_t
+         */
+        inline int32_t Quantize(float value, float scale)
+        {
+            value = (value < -1.f ? -1.f : (value > 1.f ? 1.f : value)) * scale;
+
+            return static_cast<int32_t>(value < 0.f ? value - 0.5f : value + 0.5f);
+        }
+
+        struct Float
+        {
+            static constexpr int32_t kBytes{4};
+
+            static float Load(const uint8_t *p)
+            {
+                float value;
+                std::memcpy(&value, p, sizeof(value));
+
+                return value;
+            }
+
+            static void Store(uint8_t *p, float value)
+            {
+                std::memcpy(p, &value, sizeof(value));
+            }
+
+            template <typename V>
+            static V Decode(V bits)
+            {
+                return bits;
+            }
+        };
+
+        struct Int16
+        {
+            static constexpr int32_t kBytes{2};
+            static constexpr float kScale{32767.f};
+
+            static float Load(const uint8_t *p)
+            {
+                int16_t value;
+                std::memcpy(&value, p, sizeof(value));
+
+                return value * (1.f / kScale);
+            }
+
+            static void Store(uint8_t *p, float value)
+            {
+                int16_t q = static_cast<int16_t>(Quantize(value, kScale));
+                std::memcpy(p, &q, sizeof(q));
+            }
+
+            template <typename V>
+            static V Decode(V bits)
+            {
+                return bits.template SignedToFloat<16>() * V::Set(1.f / kScale);
+            }
+        };
+
+        struct Int24
+        {
+            static constexpr int32_t kBytes{3};
+            static constexpr float kScale{8388607.f};
+
+            static float Load(const uint8_t *p)
+            {
+                uint32_t bits = p[0] << 8 | p[1] << 16 | static_cast<uint32_t>(p[2]) << 24;
+
+                return (static_cast<int32_t>(bits) >> 8) * (1.f / kScale);
+            }
+
+            static void Store(uint8_t *p, float value)
+            {
+                int32_t q = Quantize(value, kScale);
+                p[0] = q & 0xff;
+                p[1] = (q >> 8) & 0xff;
+                p[2] = (q >> 16) & 0xff;
+            }
+
+            template <typename V>
+            static V Decode(V bits)
+            {
+                return bits.template SignedToFloat<24>() * V::Set(1.f / kScale);
+            }
+        };
+
+        struct BFloat16
+        {
+            static constexpr int32_t kBytes{2};
+
+            static float Load(const uint8_t *p)
+            {
+                uint16_t half;
+                std::memcpy(&half, p, sizeof(half));
+                uint32_t bits = static_cast<uint32_t>(half) << 16;
+                float value;
+                std::memcpy(&value, &bits, sizeof(value));
+
+                return value;
+            }
+
+            static void Store(uint8_t *p, float value)
+            {
+                // Round to the nearest, ties to even.
+                uint32_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                bits += 0x7fff + ((bits >> 16) & 1);
+                uint16_t half = static_cast<uint16_t>(bits >> 16);
+                std::memcpy(p, &half, sizeof(half));
+            }
+
+            template <typename V>
+            static V Decode(V bits)
+            {
+                return bits.template ShiftLeft<16>();
+            }
+        };
+
+        inline int32_t BytesPerSample(SampleFormat format)
+        {
+            switch (format)
+            {
+            case SampleFormat::INT16:
+                return Int16::kBytes;
+            case SampleFormat::INT24:
+                return Int24::kBytes;
+            case SampleFormat::BFLOAT16:
+                return BFloat16::kBytes;
+            default:
+                return Float::kBytes;
+            }
+        }
+
+        /**
+         * @brief Returns the size in bytes of a buffer holding the given
+         * number of samples (of each of the stride channels, if interleaved),
+         * padding included.
+         *
+         * @param format
+         * @param samples
+         * @param stride
+         * @return size_t
+         */
+        inline size_t BufferBytes(SampleFormat format, int32_t samples, int32_t stride = 1)
+        {
+            int32_t bytes = BytesPerSample(format);
+
+            return static_cast<size_t>(samples) * stride * bytes + (Float::kBytes - bytes);
+        }
+    } // namespace storage
+} // namespace wreath
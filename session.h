@@ -0,0 +1,233 @@
+#pragma once
+
+#include "stereo_looper.h"
+#include "mapped_buffer.h"
+#include "sample_format.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace wreath
+{
+    constexpr uint32_t kSessionVersion{3};
+
+    /**
+     * @brief A looper saved to a file: a header with the state of the looper,
+     * followed by its buffers, each starting at a page boundary. Loading maps
+     * the file and the looper uses the buffers in place, so nothing has to be
+     * copied or recorded again and the looper is ready in a few milliseconds.
+     * As the mapping is shared, what the looper records afterwards ends up in
+     * the file as well. The header is written as is, so the sessions can only
+     * be loaded on the same architecture. Only available on Linux and macOS.
+     */
+    class Session
+    {
+    public:
+        struct Header
+        {
+            char magic[4];
+            uint32_t version;
+            int32_t sampleRate;
+            int32_t samples;
+            SampleFormat format;
+            bool interleaved;
+            uint64_t offsets[4]; // Left, right and their freeze buffers, 0 if missing
+            uint64_t bufferBytes;
+            StereoLooper::SessionState state;
+        };
+        static_assert(std::is_trivially_copyable<Header>::value, "The session header is written as is");
+
+        Session() {}
+        ~Session() {}
+
+        /**
+         * @brief Saves the looper and its buffers to the given file. Call this
+         * when the looper is not being processed. The file is written aside
+         * and then renamed, so that a session can be saved over the one the
+         * looper has been loaded from. Not real-time safe.
+         *
+         * @param path
+         * @param looper
+         * @return false if the file can't be written
+         */
+        static bool Save(const char *path, StereoLooper &looper)
+        {
+            const StereoLooper::Buffers &buffers = looper.GetBuffers();
+            const void *sources[4]{buffers.left, buffers.interleaved ? nullptr : buffers.right, buffers.leftFreeze, buffers.interleaved ? nullptr : buffers.rightFreeze};
+
+            Header header{};
+            std::memcpy(header.magic, "WRTH", sizeof(header.magic));
+            header.version = kSessionVersion;
+            header.sampleRate = looper.GetSampleRate();
+            header.samples = buffers.samples;
+            header.format = buffers.format;
+            header.interleaved = buffers.interleaved;
+            header.bufferBytes = storage::BufferBytes(buffers.format, buffers.samples, buffers.interleaved ? 2 : 1);
+            header.state = looper.GetSessionState();
+            uint64_t offset = PageAlign(sizeof(Header));
+            for (size_t i = 0; i < 4; i++)
+            {
+                if (sources[i])
+                {
+                    header.offsets[i] = offset;
+                    offset += PageAlign(header.bufferBytes);
+                }
+            }
+
+            std::string temp = std::string(path) + ".tmp";
+            FILE *file = std::fopen(temp.c_str(), "wb");
+            if (!file)
+            {
+                return false;
+            }
+            bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+            for (size_t i = 0; i < 4 && ok; i++)
+            {
+                if (sources[i])
+                {
+                    ok = std::fseek(file, static_cast<long>(header.offsets[i]), SEEK_SET) == 0 && std::fwrite(sources[i], header.bufferBytes, 1, file) == 1;
+                }
+            }
+            ok = std::fclose(file) == 0 && ok;
+            if (!ok || std::rename(temp.c_str(), path) != 0)
+            {
+                std::remove(temp.c_str());
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * @brief Maps the given session and restores the looper from it,
+         * using the buffers in the file. The session must stay open while
+         * the looper is in use. Not real-time safe.
+         *
+         * @param path
+         * @param looper
+         * @return false if the file can't be mapped or is not a valid session
+         */
+        bool Load(const char *path, StereoLooper &looper)
+        {
+            Close();
+            if (!file_.Map(path, 0))
+            {
+                return false;
+            }
+
+            uint8_t *data = static_cast<uint8_t *>(file_.GetData());
+            Header header;
+            if (!ReadHeader(data, file_.GetBytes(), header))
+            {
+                Close();
+                return false;
+            }
+
+            void *buffers[4]{};
+            for (size_t i = 0; i < 4; i++)
+            {
+                buffers[i] = header.offsets[i] ? data + header.offsets[i] : nullptr;
+            }
+            looper.Init(header.sampleRate, header.state.conf, {buffers[0], buffers[1], buffers[2], buffers[3], header.samples, header.interleaved, header.format});
+            looper.Restore(header.state);
+
+            return true;
+        }
+
+        /**
+         * @brief Unmaps the session. Only call this when the looper is not
+         * using its buffers anymore.
+         */
+        void Close()
+        {
+            file_.Unmap();
+        }
+
+        inline bool IsOpen() { return file_.IsMapped(); }
+
+    private:
+        MappedBuffer file_;
+
+        static uint64_t PageAlign(uint64_t bytes)
+        {
+            return (bytes + kPageBytes - 1) & ~static_cast<uint64_t>(kPageBytes - 1);
+        }
+
+        // Copies the header and checks that it describes a session that fits
+        // in the file.
+        static bool ReadHeader(const uint8_t *data, size_t bytes, Header &header)
+        {
+            if (bytes < sizeof(Header))
+            {
+                return false;
+            }
+            std::memcpy(&header, data, sizeof(header));
+            if (std::memcmp(header.magic, "WRTH", sizeof(header.magic)) != 0 || header.version != kSessionVersion || header.samples <= 0)
+            {
+                return false;
+            }
+            if (header.format < SampleFormat::FLOAT || header.format > SampleFormat::BFLOAT16 || !ReadState(header.state, header.samples))
+            {
+                return false;
+            }
+            if (header.bufferBytes != storage::BufferBytes(header.format, header.samples, header.interleaved ? 2 : 1))
+            {
+                return false;
+            }
+            for (size_t i = 0; i < 4; i++)
+            {
+                bool required = 0 == i || 2 == i || !header.interleaved;
+                if ((required && !header.offsets[i]) || header.offsets[i] + header.bufferBytes > bytes)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Checks that the saved state only refers to the buffers in the file,
+        // as the looper uses it as is.
+        static bool ReadState(const StereoLooper::SessionState &state, int32_t samples)
+        {
+            const StereoLooper::Conf &conf = state.conf;
+            if (conf.mode < StereoLooper::Mode::MONO || conf.mode >= StereoLooper::Mode::LAST_MODE || !IsValid(conf.movement) || !IsValid(conf.direction))
+            {
+                return false;
+            }
+            if (state.state < StereoLooper::State::STARTUP || state.state > StereoLooper::State::FROZEN)
+            {
+                return false;
+            }
+            for (const StereoLooper::SessionState::Channel &channel : state.channels)
+            {
+                if (channel.bufferSamples <= 0 || channel.bufferSamples > samples || !IsValid(channel.movement) || !IsValid(channel.direction))
+                {
+                    return false;
+                }
+                // Written so that NaNs are out of range as well.
+                for (double value : {channel.loopStart, channel.loopLength, channel.readPos, channel.writePos})
+                {
+                    if (!(value >= 0 && value <= channel.bufferSamples))
+                    {
+                        return false;
+                    }
+                }
+            }
+
+            return true;
+        }
+
+        static bool IsValid(Movement movement)
+        {
+            return movement >= Movement::NORMAL && movement <= Movement::DRUNK;
+        }
+
+        static bool IsValid(Direction direction)
+        {
+            return Direction::BACKWARDS == direction || Direction::FORWARD == direction;
+        }
+    };
+} // namespace wreath
@@ -2,10 +2,12 @@
 
 #include "head.h"
 #include "looper.h"
-#include "envelope_follower.h"
-#include "Utility/dsp.h"
-#include "Filters/svf.h"
-#include "dev/sdram.h"
+#include "daisy_compat.h"
+#include "feedback_filter.h"
+#include "output_stage.h"
+#include "command_queue.h"
+#include "mapped_buffer.h"
+#include <algorithm>
 #include <cmath>
 #include <stddef.h>
 
@@ -16,7 +18,9 @@ namespace wreath
     constexpr int32_t kSampleRate{48000};
     constexpr int kBufferSeconds{80}; // 1:20 minutes, max with 4 buffers
     const int32_t kBufferSamples{kSampleRate * kBufferSeconds};
+    constexpr size_t kCommandQueueSize{256}; // Must be a power of 2
 
+#ifdef WREATH_SDRAM_BUFFERS
     // Looper buffers.
     float DSY_SDRAM_BSS leftBuffer_[kBufferSamples];
     float DSY_SDRAM_BSS rightBuffer_[kBufferSamples];
@@ -24,6 +28,7 @@ namespace wreath
     // Freeze buffers.
     float DSY_SDRAM_BSS leftFreezeBuffer_[kBufferSamples];
     float DSY_SDRAM_BSS rightFreezeBuffer_[kBufferSamples];
+#endif
 
     /**
      * @brief The higher level class of the looper, this is the one you want to
@@ -82,11 +87,112 @@ namespace wreath
             Movement movement;
             Direction direction;
             float rate;
+            float startupSeconds{1.f}; // Silence before buffering starts, 0 to start right away
+            float fadeInSeconds{};     // Fade in of the output after the startup
         };
 
-        bool mustResetLooper{};
-        bool mustClearBuffer{};
-        bool mustStopBuffering{};
+        /**
+         * @brief The state of the looper, apart from the content of the
+         * buffers, to save a session and restore it later (see session.h).
+         */
+        struct SessionState
+        {
+            struct Channel
+            {
+                int32_t bufferSamples;
+                double loopStart;
+                double loopLength;
+                double readPos;
+                double writePos;
+                float readRate;
+                float writeRate;
+                float freeze;
+                Direction direction;
+                Movement movement;
+                bool reading;
+                bool writing;
+            };
+
+            Conf conf;
+            State state;
+            Channel channels[2];
+            float freeze;
+            float degradation;
+            float filterValue;
+            float inputGain;
+            float outputGain;
+            float dryWetMix;
+            float feedback;
+            float feedbackLevel;
+            bool feedbackOnly;
+            bool crossedFeedback;
+            float leftFeedbackPath;
+            float rightFeedbackPath;
+            float filterLevel;
+            float rateSlew;
+            float stereoWidth;
+            float dryLevel;
+            bool loopSync;
+            FilterType filterType;
+        };
+
+        /**
+         * @brief The memory used by a looper: the four buffers must each hold
+         * the given number of samples. If interleaved, the two channels share
+         * left (and leftFreeze) as L,R pairs, so that the loopers touch the
+         * same cache lines when their heads are close (e.g. in mono mode):
+         * those buffers must hold twice the samples, right and rightFreeze are
+         * not used. In a compact format, the buffers must be sized with
+         * storage::BufferBytes().
+         */
+        struct Buffers
+        {
+            void *left;
+            void *right;
+            void *leftFreeze;
+            void *rightFreeze;
+            int32_t samples;
+            bool interleaved{};
+            SampleFormat format{SampleFormat::FLOAT};
+        };
+
+        /**
+         * @brief A command for the looper, sent by the control thread and
+         * applied by the audio one when the given frame (see GetFrame()) is
+         * processed, or at the start of the next block if it has already
+         * passed (e.g. 0). Commands are applied in the order they are sent, so
+         * their frames must not decrease.
+         */
+        struct Command
+        {
+            enum Type
+            {
+                START,
+                STOP_BUFFERING,
+                RESET,
+                CLEAR_BUFFER,
+                RETRIGGER,
+                RESTART,
+                START_READING,
+                STOP_READING,
+                START_WRITING,
+                STOP_WRITING,
+                LOOP_START,
+                LOOP_LENGTH,
+                READ_RATE,
+                WRITE_RATE,
+                FREEZE,
+                DIRECTION,
+                MOVEMENT,
+                EXPORT,
+            };
+
+            Type type;
+            int channel{BOTH};
+            double value{}; // Double, for the positions in long buffers
+            uint64_t frame{};
+            LoopSnapshot *snapshots{}; // For EXPORT, one per channel
+        };
 
         float inputGain{1.f};
         float outputGain{1.f};
@@ -107,48 +213,20 @@ namespace wreath
         NoteMode noteModeLeft{};
         NoteMode noteModeRight{};
 
-        int32_t nextLeftLoopStart{};
-        int32_t nextRightLoopStart{};
-
-        Direction leftDirection{};
-        Direction rightDirection{};
-
-        int32_t nextLeftLoopLength{};
-        int32_t nextRightLoopLength{};
-
-        float nextLeftReadRate{};
-        float nextRightReadRate{};
-
-        float nextLeftWriteRate{};
-        float nextRightWriteRate{};
-
-        float nextLeftFreeze{};
-        float nextRightFreeze{};
-
-        bool mustStartReading{};
-        bool mustStopReading{};
-        bool mustStartWriting{};
-        bool mustStopWriting{};
-        bool mustStartWritingLeft{};
-        bool mustStopWritingLeft{};
-        bool mustStartWritingRight{};
-        bool mustStopWritingRight{};
-        bool mustRetrigger{};
-        bool mustRestart{};
-
         inline int32_t GetBufferSamples(int channel) { return loopers_[channel].GetBufferSamples(); }
         inline float GetBufferSeconds(int channel) { return loopers_[channel].GetBufferSeconds(); }
         inline float GetLoopStartSeconds(int channel) { return loopers_[channel].GetLoopStartSeconds(); }
         inline float GetLoopLengthSeconds(int channel) { return loopers_[channel].GetLoopLengthSeconds(); }
         inline float GetReadPosSeconds(int channel) { return loopers_[channel].GetReadPosSeconds(); }
-        inline float GetLoopStart(int channel) { return loopers_[channel].GetLoopStart(); }
-        inline float GetLoopEnd(int channel) { return loopers_[channel].GetLoopEnd(); }
-        inline float GetLoopLength(int channel) { return loopers_[channel].GetLoopLength(); }
-        inline float GetReadPos(int channel) { return loopers_[channel].GetReadPos(); }
-        inline float GetWritePos(int channel) { return loopers_[channel].GetWritePos(); }
+        inline double GetLoopStart(int channel) { return loopers_[channel].GetLoopStart(); }
+        inline double GetLoopEnd(int channel) { return loopers_[channel].GetLoopEnd(); }
+        inline double GetLoopLength(int channel) { return loopers_[channel].GetLoopLength(); }
+        inline double GetReadPos(int channel) { return loopers_[channel].GetReadPos(); }
+        inline double GetWritePos(int channel) { return loopers_[channel].GetWritePos(); }
         inline float GetReadRate(int channel) { return loopers_[channel].GetReadRate(); }
         inline Movement GetMovement(int channel) { return loopers_[channel].GetMovement(); }
         inline bool IsGoingForward(int channel) { return loopers_[channel].IsGoingForward(); }
+        inline Interpolation GetInterpolation(int channel) { return loopers_[channel].GetInterpolation(); }
         inline int32_t GetCrossPoint(int channel) { return loopers_[channel].GetCrossPoint(); }
         inline int32_t GetHeadsDistance(int channel) { return loopers_[channel].GetHeadsDistance(); }
 
@@ -164,24 +242,63 @@ namespace wreath
         inline Mode GetMode() { return conf_.mode; }
         inline bool GetLoopSync() { return loopSync_; }
         inline float GetFilterValue() { return filterValue_; }
+        inline uint64_t GetFrame() { return frame_; }
+        inline int32_t GetSampleRate() { return sampleRate_; }
+        inline const Buffers &GetBuffers() { return buffers_; }
 
 
+#ifdef WREATH_SDRAM_BUFFERS
         /**
-         * @brief Inits the looper. Call this before setting up the AudioCallback.
+         * @brief Inits the looper with the buffers in the SDRAM. Call this
+         * before setting up the AudioCallback. As the buffers are shared, only
+         * one looper can be initialized this way.
          *
          * @param sampleRate
          * @param conf
          */
         void Init(int32_t sampleRate, Conf conf)
+        {
+            Init(sampleRate, conf, {leftBuffer_, rightBuffer_, leftFreezeBuffer_, rightFreezeBuffer_, kBufferSamples});
+        }
+#endif
+
+        /**
+         * @brief Inits the looper with the given buffers, that must outlive
+         * it. Call this before setting up the AudioCallback.
+         *
+         * @param sampleRate
+         * @param conf
+         * @param buffers
+         */
+        void Init(int32_t sampleRate, Conf conf, Buffers buffers)
         {
             sampleRate_ = sampleRate;
-            loopers_[LEFT].Init(sampleRate_, leftBuffer_, leftFreezeBuffer_, kBufferSamples);
-            loopers_[RIGHT].Init(sampleRate_, rightBuffer_, rightFreezeBuffer_, kBufferSamples);
+            buffers_ = buffers;
+            if (buffers.interleaved)
+            {
+                int32_t bytes = storage::BytesPerSample(buffers.format);
+                loopers_[LEFT].Init(sampleRate_, buffers.left, buffers.leftFreeze, buffers.samples, 2, buffers.format);
+                loopers_[RIGHT].Init(sampleRate_, static_cast<uint8_t *>(buffers.left) + bytes, static_cast<uint8_t *>(buffers.leftFreeze) + bytes, buffers.samples, 2, buffers.format);
+            }
+            else
+            {
+                loopers_[LEFT].Init(sampleRate_, buffers.left, buffers.leftFreeze, buffers.samples, 1, buffers.format);
+                loopers_[RIGHT].Init(sampleRate_, buffers.right, buffers.rightFreeze, buffers.samples, 1, buffers.format);
+            }
             state_ = State::STARTUP;
+            startupSamples_ = static_cast<int32_t>(std::round(conf.startupSeconds * sampleRate_));
+            startupIndex_ = 0;
+            fadeInSamples_ = static_cast<int32_t>(std::round(conf.fadeInSeconds * sampleRate_));
+            fadeInIndex_ = 0;
+            frame_ = 0;
+            publishedFrame_ = 0;
+            CancelCommands();
             feedbackFilter_.Init(sampleRate_);
 
             // Process configuration and reset the looper.
             conf_ = conf;
+            leftDirection_ = conf.direction;
+            rightDirection_ = conf.direction;
             loopers_[LEFT].Reset();
             loopers_[RIGHT].Reset();
         }
@@ -233,6 +350,20 @@ namespace wreath
             loopers_[RIGHT].SetDegradation(value);
         }
 
+        /**
+         * @brief Sets the seed of the random sequences of the loopers (see
+         * Looper::SetSeed()), e.g. for reproducible renders. Each channel
+         * gets its own sequence. Call this after Init() and before
+         * processing.
+         *
+         * @param seed
+         */
+        void SetSeed(uint64_t seed)
+        {
+            loopers_[LEFT].SetSeed(seed * 2);
+            loopers_[RIGHT].SetSeed(seed * 2 + 1);
+        }
+
         /**
          * @brief Sets whether the loopers should stop at the end or continue
          * looping indefinitely.
@@ -255,16 +386,7 @@ namespace wreath
          */
         void SetMovement(int channel, Movement movement)
         {
-            if (BOTH == channel)
-            {
-                loopers_[LEFT].SetMovement(movement);
-                loopers_[RIGHT].SetMovement(movement);
-                conf_.movement = movement;
-            }
-            else
-            {
-                loopers_[channel].SetMovement(movement);
-            }
+            commands_.Push({Command::MOVEMENT, channel, static_cast<float>(movement)});
         }
 
         /**
@@ -274,25 +396,27 @@ namespace wreath
          * @param direction
          */
         void SetDirection(int channel, Direction direction)
+        {
+            commands_.Push({Command::DIRECTION, channel, static_cast<float>(direction)});
+        }
+
+        /**
+         * @brief Sets the interpolation used when reading, trading quality for
+         * CPU. The sinc interpolation also filters the aliasing when reading
+         * faster than 1x.
+         *
+         * @param channel
+         * @param interpolation
+         */
+        void SetInterpolation(int channel, Interpolation interpolation)
         {
             if (LEFT == channel || BOTH == channel)
             {
-                leftDirection = direction;
+                loopers_[LEFT].SetInterpolation(interpolation);
             }
             if (RIGHT == channel || BOTH == channel)
             {
-                rightDirection = direction;
-            }
-            if (BOTH == channel)
-            {
-                conf_.direction = direction;
-            }
-            // Before the looper starts, if the direction is backwards set the
-            // reading head at the end of the loop.
-            if (State::READY == state_ && Direction::BACKWARDS == direction)
-            {
-                loopers_[LEFT].SetReadPos(loopers_[LEFT].GetLoopEnd());
-                loopers_[RIGHT].SetReadPos(loopers_[RIGHT].GetLoopEnd());
+                loopers_[RIGHT].SetInterpolation(interpolation);
             }
         }
 
@@ -302,16 +426,9 @@ namespace wreath
          * @param channel
          * @param value
          */
-        void SetLoopStart(int channel, float value)
+        void SetLoopStart(int channel, double value)
         {
-            if (LEFT == channel || BOTH == channel)
-            {
-                nextLeftLoopStart = std::min(std::max(value, 0.f), loopers_[LEFT].GetBufferSamples() - 1.f);
-            }
-            if (RIGHT == channel || BOTH == channel)
-            {
-                nextRightLoopStart = std::min(std::max(value, 0.f), loopers_[RIGHT].GetBufferSamples() - 1.f);
-            }
+            commands_.Push({Command::LOOP_START, channel, value});
         }
 
         /**
@@ -322,19 +439,7 @@ namespace wreath
          */
         void SetFreeze(int channel, float amount)
         {
-            if (LEFT == channel || BOTH == channel)
-            {
-                nextLeftFreeze = amount;
-            }
-            if (RIGHT == channel || BOTH == channel)
-            {
-                nextRightFreeze = amount;
-            }
-            freeze_ = amount;
-            if (State::READY != state_)
-            {
-                state_ = amount == 1.f ? State::FROZEN : State::RECORDING;
-            }
+            commands_.Push({Command::FREEZE, channel, amount});
         }
 
         /**
@@ -345,15 +450,7 @@ namespace wreath
          */
         void SetReadRate(int channel, float rate)
         {
-            if (LEFT == channel || BOTH == channel)
-            {
-                nextLeftReadRate = rate;
-            }
-            if (RIGHT == channel || BOTH == channel)
-            {
-                nextRightReadRate = rate;
-            }
-            conf_.rate = rate;
+            commands_.Push({Command::READ_RATE, channel, rate});
         }
 
         /**
@@ -364,14 +461,7 @@ namespace wreath
          */
         void SetWriteRate(int channel, float rate)
         {
-            if (LEFT == channel || BOTH == channel)
-            {
-                nextLeftWriteRate = rate;
-            }
-            if (RIGHT == channel || BOTH == channel)
-            {
-                nextRightWriteRate = rate;
-            }
+            commands_.Push({Command::WRITE_RATE, channel, rate});
         }
 
         /**
@@ -381,34 +471,9 @@ namespace wreath
          * @param channel
          * @param length
          */
-        void SetLoopLength(int channel, float length)
+        void SetLoopLength(int channel, double length)
         {
-            if (LEFT == channel || BOTH == channel)
-            {
-                nextLeftLoopLength = std::min(std::max(length, kMinLoopLengthSamples), static_cast<float>(loopers_[LEFT].GetBufferSamples()));
-                noteModeLeft = NoteMode::NO_MODE;
-                if (length <= kMinLoopLengthSamples)
-                {
-                    noteModeLeft = NoteMode::NOTE;
-                }
-                else if (length >= kMinSamplesForTone && length <= kMinSamplesForFlanger)
-                {
-                    noteModeLeft = NoteMode::FLANGER;
-                }
-            }
-            if (RIGHT == channel || BOTH == channel)
-            {
-                nextRightLoopLength = std::min(std::max(length, kMinLoopLengthSamples), static_cast<float>(loopers_[RIGHT].GetBufferSamples()));
-                noteModeRight = NoteMode::NO_MODE;
-                if (length <= kMinLoopLengthSamples)
-                {
-                    noteModeRight = NoteMode::NOTE;
-                }
-                else if (length >= kMinSamplesForTone && length <= kMinSamplesForFlanger)
-                {
-                    noteModeRight = NoteMode::FLANGER;
-                }
-            }
+            commands_.Push({Command::LOOP_LENGTH, channel, length});
         }
 
         /**
@@ -417,368 +482,1290 @@ namespace wreath
          */
         void Start()
         {
-            if (State::READY == state_)
-            {
-                loopers_[LEFT].StartReading(true);
-                loopers_[RIGHT].StartReading(true);
-                state_ = freeze_ == 1.f ? State::FROZEN : State::RECORDING;
-            }
+            commands_.Push({Command::START});
         }
 
         /**
-         * @brief Processes the input signals and outputs something. This goes
-         * in the main loop of your code.
+         * @brief Stops buffering, when the looper doesn't need to fill the
+         * whole buffer.
+         */
+        void StopBuffering()
+        {
+            commands_.Push({Command::STOP_BUFFERING});
+        }
+
+        /**
+         * @brief Stops the looper and starts buffering again.
+         */
+        void ResetLooper()
+        {
+            commands_.Push({Command::RESET});
+        }
+
+        /**
+         * @brief Clears the buffers.
+         */
+        void ClearBuffer()
+        {
+            commands_.Push({Command::CLEAR_BUFFER});
+        }
+
+        /**
+         * @brief Retriggers the loop, from the current position.
+         */
+        void Retrigger()
+        {
+            commands_.Push({Command::RETRIGGER});
+        }
+
+        /**
+         * @brief Restarts the loop, from its start.
+         */
+        void Restart()
+        {
+            commands_.Push({Command::RESTART});
+        }
+
+        /**
+         * @brief Starts the reading heads.
+         */
+        void StartReading()
+        {
+            commands_.Push({Command::START_READING});
+        }
+
+        /**
+         * @brief Stops the reading heads.
+         */
+        void StopReading()
+        {
+            commands_.Push({Command::STOP_READING});
+        }
+
+        /**
+         * @brief Starts writing. With BOTH, the heads of both the channels
+         * are started at once.
          *
-         * @param leftIn
-         * @param rightIn
-         * @param leftOut
-         * @param rightOut
+         * @param channel
          */
-        void Process(const float leftIn, const float rightIn, float &leftOut, float &rightOut)
+        void StartWriting(int channel)
         {
-            // Input gain stage.
-            float leftDry = SoftClip(leftIn * inputGain);
-            float rightDry = SoftClip(rightIn * inputGain);
+            commands_.Push({Command::START_WRITING, channel});
+        }
 
-            float leftWet{};
-            float rightWet{};
+        /**
+         * @brief Stops writing. With BOTH, the heads of both the channels
+         * are stopped at once.
+         *
+         * @param channel
+         */
+        void StopWriting(int channel)
+        {
+            commands_.Push({Command::STOP_WRITING, channel});
+        }
 
-            float leftFeedback{};
-            float rightFeedback{};
+        /**
+         * @brief Starts copying the current loop of each channel to the given
+         * snapshots, that can be read while the looper keeps running (see
+         * LoopSnapshot and Exporter). The snapshots must be WAITING and big
+         * enough for the buffers; they are cancelled if the looper is not
+         * running.
+         *
+         * @param snapshots Left and right
+         * @return false if the queue is full
+         */
+        bool Export(LoopSnapshot snapshots[2])
+        {
+            return commands_.Push({Command::EXPORT, BOTH, 0.f, 0, snapshots});
+        }
 
-            switch (state_)
-            {
-            case State::STARTUP:
+        /**
+         * @brief Fills the buffers with the given samples, as if they had been
+         * recorded, and gets the looper READY to be started. Consecutive
+         * calls with last false append the samples, e.g. while reading them
+         * from a file (see Importer). The samples past the end of the buffers
+         * are dropped. Call this when the looper is not being processed.
+         *
+         * @param left
+         * @param right nullptr to use left for both the channels
+         * @param samples
+         * @param last false if more samples follow
+         * @return true if the buffers are full, and the looper READY
+         */
+        bool Import(const float *left, const float *right, size_t samples, bool last = true)
+        {
+            if (State::BUFFERING != state_)
             {
-                static int32_t fadeIndex{0};
-                if (fadeIndex > sampleRate_)
-                {
-                    fadeIndex = 0;
-                    state_ = State::BUFFERING;
-                }
-                fadeIndex++;
-
-                // Return now, so we don't emit any sound.
-                return;
+                loopers_[LEFT].StopReading(true);
+                loopers_[RIGHT].StopReading(true);
+                Reset();
+                state_ = State::BUFFERING;
             }
-            case State::BUFFERING:
+            bool doneLeft{loopers_[LEFT].BufferBlock(left, samples)};
+            bool doneRight{loopers_[RIGHT].BufferBlock(right ? right : left, samples)};
+            if (last || (doneLeft && doneRight))
             {
-                bool doneLeft{loopers_[LEFT].Buffer(leftDry)};
-                bool doneRight{loopers_[RIGHT].Buffer(rightDry)};
-                if ((doneLeft && doneRight) || mustStopBuffering)
-                {
-                    mustStopBuffering = false;
-                    loopers_[LEFT].StopBuffering();
-                    loopers_[RIGHT].StopBuffering();
+                FinishBuffering();
+            }
 
-                    state_ = State::READY;
-                }
+            return doneLeft && doneRight;
+        }
 
-                // Pass the audio through.
-                leftWet = leftDry;
-                rightWet = rightDry;
+        /**
+         * @brief Sends a command to the looper, to be applied at the given
+         * frame. The setters above send their commands to be applied as soon
+         * as possible. Call this (and the setters) from a single thread.
+         *
+         * @param command
+         * @return false if the queue is full
+         */
+        bool Push(const Command &command)
+        {
+            return commands_.Push(command);
+        }
 
-                break;
-            }
-            case State::READY:
+        /**
+         * @brief Returns the state of the looper, to be saved in a session.
+         * Call this from the audio thread, or when the looper is not being
+         * processed.
+         *
+         * @return SessionState
+         */
+        SessionState GetSessionState()
+        {
+            SessionState session{};
+            session.conf = conf_;
+            session.state = state_;
+            for (size_t channel : {LEFT, RIGHT})
             {
-                nextLeftLoopLength = loopers_[LEFT].GetLoopLength();
-                nextRightLoopLength = loopers_[RIGHT].GetLoopLength();
-                nextLeftLoopStart = loopers_[LEFT].GetLoopStart();
-                nextRightLoopStart = loopers_[RIGHT].GetLoopStart();
-                nextLeftReadRate = 1.f;
-                nextRightReadRate = 1.f;
-                nextLeftWriteRate = 1.f;
-                nextRightWriteRate = 1.f;
-                nextLeftFreeze = 0.f;
-                nextRightFreeze = 0.f;
+                Looper &looper = loopers_[channel];
+                session.channels[channel] = {looper.GetBufferSamples(), looper.GetLoopStart(), looper.GetLoopLength(), looper.GetReadPos(), looper.GetWritePos(), looper.GetReadRate(), looper.GetWriteRate(), looper.GetFreeze(), looper.GetDirection(), looper.GetMovement(), looper.IsReading(), looper.IsWriting()};
+            }
+            session.freeze = freeze_;
+            session.degradation = degradation_;
+            session.filterValue = filterValue_;
+            session.inputGain = inputGain;
+            session.outputGain = outputGain;
+            session.dryWetMix = dryWetMix;
+            session.feedback = feedback;
+            session.feedbackLevel = feedbackLevel;
+            session.feedbackOnly = feedbackOnly;
+            session.crossedFeedback = crossedFeedback;
+            session.leftFeedbackPath = leftFeedbackPath;
+            session.rightFeedbackPath = rightFeedbackPath;
+            session.filterLevel = filterLevel;
+            session.rateSlew = rateSlew;
+            session.stereoWidth = stereoWidth;
+            session.dryLevel = dryLevel;
+            session.loopSync = loopSync_;
+            session.filterType = filterType;
+
+            return session;
+        }
 
-                break;
+        /**
+         * @brief Restores a saved state. Call this right after Init(), with
+         * buffers that already hold the saved content: the looper skips the
+         * buffering and is ready to start, or running if it was.
+         *
+         * @param session
+         */
+        void Restore(const SessionState &session)
+        {
+            conf_ = session.conf;
+            inputGain = session.inputGain;
+            outputGain = session.outputGain;
+            dryWetMix = session.dryWetMix;
+            feedback = session.feedback;
+            feedbackLevel = session.feedbackLevel;
+            feedbackOnly = session.feedbackOnly;
+            crossedFeedback = session.crossedFeedback;
+            leftFeedbackPath = session.leftFeedbackPath;
+            rightFeedbackPath = session.rightFeedbackPath;
+            filterLevel = session.filterLevel;
+            rateSlew = session.rateSlew;
+            stereoWidth = session.stereoWidth;
+            dryLevel = session.dryLevel;
+            filterType = session.filterType;
+            SetFilterValue(session.filterValue);
+            SetDegradation(session.degradation);
+            SetLoopSync(BOTH, session.loopSync);
+
+            for (size_t channel : {LEFT, RIGHT})
+            {
+                const SessionState::Channel &saved = session.channels[channel];
+                Looper &looper = loopers_[channel];
+                looper.Restore(saved.bufferSamples, saved.freeze);
+                looper.SetMovement(saved.movement);
+                looper.SetDirection(saved.direction);
+                looper.SetLoopLength(saved.loopLength);
+                looper.SetLoopStart(saved.loopStart);
+                looper.SetReadRate(saved.readRate);
+                looper.SetWriteRate(saved.writeRate);
+                looper.SetReadPos(saved.readPos);
+                looper.SetWritePos(saved.writePos);
             }
-            case State::RECORDING:
-            case State::FROZEN:
+            leftDirection_ = session.channels[LEFT].direction;
+            rightDirection_ = session.channels[RIGHT].direction;
+            ResetParameters();
+            nextLeftReadRate_ = session.channels[LEFT].readRate;
+            nextRightReadRate_ = session.channels[RIGHT].readRate;
+            nextLeftWriteRate_ = session.channels[LEFT].writeRate;
+            nextRightWriteRate_ = session.channels[RIGHT].writeRate;
+            nextLeftFreeze_ = session.channels[LEFT].freeze;
+            nextRightFreeze_ = session.channels[RIGHT].freeze;
+            freeze_ = session.freeze;
+
+            state_ = State::READY;
+            if (State::RECORDING == session.state || State::FROZEN == session.state)
             {
-                UpdateParameters();
-
-                if (mustClearBuffer)
-                {
-                    mustClearBuffer = false;
-                    loopers_[LEFT].ClearBuffer();
-                    loopers_[RIGHT].ClearBuffer();
-                }
-
-                if (mustResetLooper)
+                for (size_t channel : {LEFT, RIGHT})
                 {
-                    mustResetLooper = false;
-                    loopers_[LEFT].StopReading(true);
-                    loopers_[RIGHT].StopReading(true);
-                    Reset();
-                    state_ = State::BUFFERING;
-
-                    break;
+                    loopers_[channel].StartReading(true);
+                    if (!session.channels[channel].writing)
+                    {
+                        loopers_[channel].StopWriting(true);
+                    }
+                    if (!session.channels[channel].reading)
+                    {
+                        loopers_[channel].StopReading(true);
+                    }
                 }
+                state_ = session.state;
+            }
+        }
 
-                if (mustRetrigger)
-                {
-                    loopers_[LEFT].Trigger(false);
-                    loopers_[RIGHT].Trigger(false);
-                    mustRetrigger = false;
-                }
+        /**
+         * @brief Lets the given prefetcher follow the heads, to keep the pages
+         * they are about to reach in memory when the buffers are mapped files
+         * (see MappedBuffer). Call this after Init() and before processing,
+         * then start the prefetcher.
+         *
+         * @param prefetcher nullptr to stop publishing the heads
+         */
+        void SetPrefetcher(Prefetcher *prefetcher)
+        {
+            prefetcher_ = prefetcher;
+            if (!prefetcher_)
+            {
+                return;
+            }
+            int32_t bytes = storage::BytesPerSample(buffers_.format);
+            if (buffers_.interleaved)
+            {
+                const uint8_t *left = static_cast<const uint8_t *>(buffers_.left);
+                const uint8_t *leftFreeze = static_cast<const uint8_t *>(buffers_.leftFreeze);
+                prefetcher_->SetChannel(LEFT, left, leftFreeze, buffers_.samples, bytes * 2);
+                prefetcher_->SetChannel(RIGHT, left + bytes, leftFreeze + bytes, buffers_.samples, bytes * 2);
+            }
+            else
+            {
+                prefetcher_->SetChannel(LEFT, buffers_.left, buffers_.leftFreeze, buffers_.samples, bytes);
+                prefetcher_->SetChannel(RIGHT, buffers_.right, buffers_.rightFreeze, buffers_.samples, bytes);
+            }
+            PublishHeads();
+        }
 
-                if (mustRestart)
-                {
-                    loopers_[LEFT].Trigger(true);
-                    loopers_[RIGHT].Trigger(true);
-                    mustRestart = false;
-                }
+        /**
+         * @brief Processes the input signals and outputs something. This goes
+         * in the main loop of your code.
+         *
+         * @param leftIn
+         * @param rightIn
+         * @param leftOut
+         * @param rightOut
+         */
+        void Process(const float leftIn, const float rightIn, float &leftOut, float &rightOut)
+        {
+            ProcessBlock(&leftIn, &rightIn, &leftOut, &rightOut, 1);
+        }
+
+        /**
+         * @brief Processes a block of input samples, of any size. The pending
+         * commands are applied at their frame, splitting the block if needed,
+         * then the audio runs in tight loops over sub-blocks of at most
+         * kMaxBlockSize samples.
+         *
+         * @param leftIn
+         * @param rightIn
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        void ProcessBlock(const float *leftIn, const float *rightIn, float *leftOut, float *rightOut, size_t size)
+        {
+            for (size_t i = 0; i < size;)
+            {
+                size_t samples = ApplyCommands(std::min(size - i, kMaxBlockSize));
+                ProcessSegment(leftIn + i, rightIn + i, leftOut + i, rightOut + i, samples);
+                frame_ += samples;
+                i += samples;
+            }
+
+            if (prefetcher_ && frame_ - publishedFrame_ >= kMaxBlockSize)
+            {
+                PublishHeads();
+            }
+        }
+
+    private:
+        Looper loopers_[2];
+        State state_{}; // The current state of the looper
+        FeedbackFilter feedbackFilter_{};
+        int32_t sampleRate_{};
+        OutputStage outputStage_{};
+        int32_t startupSamples_{};
+        int32_t startupIndex_{};
+        int32_t fadeInSamples_{};
+        int32_t fadeInIndex_{};
+        uint64_t frame_{}; // The frames processed since Init()
+        Buffers buffers_{};
+        Prefetcher *prefetcher_{};
+        uint64_t publishedFrame_{};
+        float freeze_{};
+        float degradation_{};
+        float filterValue_{};
+        Conf conf_{};
 
-                if (mustStartReading)
+        // The parameters that are applied (and slewed) at the next block.
+        double nextLeftLoopStart_{};
+        double nextRightLoopStart_{};
+        double nextLeftLoopLength_{};
+        double nextRightLoopLength_{};
+        float nextLeftReadRate_{};
+        float nextRightReadRate_{};
+        float nextLeftWriteRate_{};
+        float nextRightWriteRate_{};
+        float nextLeftFreeze_{};
+        float nextRightFreeze_{};
+        Direction leftDirection_{};
+        Direction rightDirection_{};
+
+        CommandQueue<Command, kCommandQueueSize> commands_;
+
+        // Scratch buffers for the block processing.
+        float leftDry_[kMaxBlockSize]{};
+        float rightDry_[kMaxBlockSize]{};
+        float leftWet_[kMaxBlockSize]{};
+        float rightWet_[kMaxBlockSize]{};
+        float leftWrite_[kMaxBlockSize]{};
+        float rightWrite_[kMaxBlockSize]{};
+        float leftDegradation_[kMaxBlockSize]{};
+        float rightDegradation_[kMaxBlockSize]{};
+        float leftFeedback_[kMaxBlockSize]{};
+        float rightFeedback_[kMaxBlockSize]{};
+        float leftFiltered_[kMaxBlockSize]{};
+        float rightFiltered_[kMaxBlockSize]{};
+
+        /**
+         * @brief Processes a stretch of samples with no commands in between.
+         *
+         * @param leftIn
+         * @param rightIn
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        void ProcessSegment(const float *leftIn, const float *rightIn, float *leftOut, float *rightOut, size_t size)
+        {
+            // Clearing the buffers and copying the freeze snapshot are spread
+            // over many blocks.
+            loopers_[LEFT].ProcessPages(size);
+            loopers_[RIGHT].ProcessPages(size);
+            outputStage_.SetParameters(stereoWidth, dryWetMix, outputGain);
+
+            // Nothing is emitted until the startup time has passed.
+            size_t silent = State::STARTUP == state_ ? ProcessStartup(leftOut, rightOut, size) : 0;
+            if (silent < size)
+            {
+                ProcessState(leftIn + silent, rightIn + silent, leftOut + silent, rightOut + silent, size - silent);
+                if (fadeInIndex_ < fadeInSamples_)
+                {
+                    FadeIn(leftOut + silent, rightOut + silent, size - silent);
+                }
+            }
+        }
+
+        /**
+         * @brief Outputs silence until the startup time has passed, then
+         * moves on to buffering.
+         *
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         * @return size_t The samples still in the startup, up to size
+         */
+        size_t ProcessStartup(float *leftOut, float *rightOut, size_t size)
+        {
+            size_t silent = std::min(size, static_cast<size_t>(startupSamples_ - startupIndex_));
+            std::fill(leftOut, leftOut + silent, 0.f);
+            std::fill(rightOut, rightOut + silent, 0.f);
+            startupIndex_ += silent;
+            if (startupIndex_ >= startupSamples_)
+            {
+                startupIndex_ = 0;
+                state_ = State::BUFFERING;
+            }
+
+            return silent;
+        }
+
+        /**
+         * @brief Fades the output in, after the startup.
+         *
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        void FadeIn(float *leftOut, float *rightOut, size_t size)
+        {
+            size_t samples = std::min(size, static_cast<size_t>(fadeInSamples_ - fadeInIndex_));
+            float step = 1.f / fadeInSamples_;
+            for (size_t i = 0; i < samples; i++)
+            {
+                float gain = (fadeInIndex_ + i) * step;
+                leftOut[i] *= gain;
+                rightOut[i] *= gain;
+            }
+            fadeInIndex_ += samples;
+        }
+
+        /**
+         * @brief Processes a stretch of samples according to the state of the
+         * looper, after the startup.
+         *
+         * @param leftIn
+         * @param rightIn
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        void ProcessState(const float *leftIn, const float *rightIn, float *leftOut, float *rightOut, size_t size)
+        {
+            switch (state_)
+            {
+            case State::BUFFERING:
+            {
+                ProcessBuffering(leftIn, rightIn, leftOut, rightOut, size);
+
+                return;
+            }
+            case State::READY:
+            {
+                ResetParameters();
+
+                break;
+            }
+            case State::RECORDING:
+            case State::FROZEN:
+            {
+                UpdateParameters(size);
+                ProcessRunning(leftIn, rightIn, leftOut, rightOut, size);
+
+                return;
+            }
+            default:
+                break;
+            }
+
+            // Only the dry signal goes through, in chunks as big as the
+            // scratch blocks.
+            for (size_t i = 0; i < size; i += kMaxBlockSize)
+            {
+                size_t samples = std::min(size - i, kMaxBlockSize);
+                SoftClipBlock(leftIn + i, leftDry_, samples, inputGain);
+                SoftClipBlock(rightIn + i, rightDry_, samples, inputGain);
+                ProcessDryOutput(leftDry_, rightDry_, leftOut + i, rightOut + i, samples);
+            }
+        }
+
+        /**
+         * @brief Resets the loopers to their initial state.
+         */
+        void Reset()
+        {
+            loopers_[LEFT].Reset();
+            loopers_[RIGHT].Reset();
+
+            // SetMode(conf_.mode);
+            ApplyMovement(BOTH, conf_.movement);
+            ApplyDirection(BOTH, conf_.direction);
+            ApplyReadRate(BOTH, conf_.rate);
+            ApplyWriteRate(BOTH, conf_.rate);
+        }
+
+        /**
+         * @brief Simple mixing and clipping of two signals.
+         *
+         * @param a
+         * @param b
+         * @return float
+         */
+        float Mix(float a, float b)
+        {
+            return SoftClip(a + b);
+        }
+
+        /**
+         * @brief Returns the output of the feedback filter for the current
+         * filter type.
+         *
+         * @return FeedbackFilter::Output
+         */
+        FeedbackFilter::Output GetFilterOutput()
+        {
+            switch (filterType)
+            {
+            case FilterType::HP:
+                return FeedbackFilter::Output::HIGH;
+            case FilterType::LP:
+                return FeedbackFilter::Output::LOW;
+            default:
+                return FeedbackFilter::Output::BAND;
+            }
+        }
+
+        /**
+         * @brief Aligns the next parameters with the loopers' current ones.
+         */
+        void ResetParameters()
+        {
+            nextLeftLoopLength_ = loopers_[LEFT].GetLoopLength();
+            nextRightLoopLength_ = loopers_[RIGHT].GetLoopLength();
+            nextLeftLoopStart_ = loopers_[LEFT].GetLoopStart();
+            nextRightLoopStart_ = loopers_[RIGHT].GetLoopStart();
+            nextLeftReadRate_ = 1.f;
+            nextRightReadRate_ = 1.f;
+            nextLeftWriteRate_ = 1.f;
+            nextRightWriteRate_ = 1.f;
+            nextLeftFreeze_ = 0.f;
+            nextRightFreeze_ = 0.f;
+        }
+
+        // Tells the prefetcher where the heads are, once per block at most.
+        // Unless in delay mode, the writing head goes through the whole
+        // buffer.
+        void PublishHeads()
+        {
+            for (size_t channel : {LEFT, RIGHT})
+            {
+                Looper &looper = loopers_[channel];
+                bool sync = looper.IsLoopSync();
+                double writeLoopStart = sync ? looper.GetLoopStart() : 0.0;
+                double writeLoopLength = sync ? looper.GetLoopLength() : looper.GetBufferSamples();
+                prefetcher_->Publish(channel, {looper.GetReadPos(), looper.GetReadRate() * looper.GetDirection(), looper.GetWritePos(), looper.GetWriteRate(), looper.GetLoopStart(), looper.GetLoopLength(), writeLoopStart, writeLoopLength, looper.GetBufferSamples()});
+            }
+            publishedFrame_ = frame_;
+        }
+
+        /**
+         * @brief Applies the commands due by the current frame and returns
+         * how many of the given samples can be processed before the next one.
+         *
+         * @param size
+         * @return size_t
+         */
+        size_t ApplyCommands(size_t size)
+        {
+            const Command *command = commands_.Front();
+            for (; command && command->frame <= frame_; command = commands_.Front())
+            {
+                Apply(*command);
+                commands_.Pop();
+            }
+
+            return command ? std::min(size, static_cast<size_t>(command->frame - frame_)) : size;
+        }
+
+        /**
+         * @brief Drops the commands still in the queue, cancelling the
+         * exports among them so that nothing waits for them.
+         */
+        void CancelCommands()
+        {
+            for (const Command *command = commands_.Front(); command; command = commands_.Front())
+            {
+                if (Command::EXPORT == command->type)
+                {
+                    command->snapshots[LEFT].status.store(LoopSnapshot::CANCELLED, std::memory_order_release);
+                    command->snapshots[RIGHT].status.store(LoopSnapshot::CANCELLED, std::memory_order_release);
+                }
+                commands_.Pop();
+            }
+        }
+
+        /**
+         * @brief Applies a single command. The ones controlling the transport
+         * are ignored if the looper is not in the right state.
+         *
+         * @param command
+         */
+        void Apply(const Command &command)
+        {
+            switch (command.type)
+            {
+            case Command::START:
+                if (State::READY == state_)
                 {
                     loopers_[LEFT].StartReading(true);
                     loopers_[RIGHT].StartReading(true);
-                    mustStartReading = false;
+                    state_ = freeze_ == 1.f ? State::FROZEN : State::RECORDING;
                 }
-
-                if (mustStopReading)
+                break;
+            case Command::STOP_BUFFERING:
+                if (State::BUFFERING == state_)
+                {
+                    FinishBuffering();
+                }
+                break;
+            case Command::RESET:
+                if (IsRunning())
                 {
                     loopers_[LEFT].StopReading(true);
                     loopers_[RIGHT].StopReading(true);
-                    mustStopReading = false;
+                    Reset();
+                    state_ = State::BUFFERING;
                 }
-
-                if (mustStartWriting)
+                break;
+            case Command::CLEAR_BUFFER:
+                if (IsRunning())
                 {
-                    loopers_[LEFT].StartWriting(true);
-                    loopers_[RIGHT].StartWriting(true);
-                    mustStartWriting = false;
+                    loopers_[LEFT].ClearBuffer();
+                    loopers_[RIGHT].ClearBuffer();
                 }
-
-                if (mustStopWriting)
+                break;
+            case Command::RETRIGGER:
+            case Command::RESTART:
+                if (IsRunning())
                 {
-                    loopers_[LEFT].StopWriting(true);
-                    loopers_[RIGHT].StopWriting(true);
-                    mustStopWriting = false;
+                    loopers_[LEFT].Trigger(Command::RESTART == command.type);
+                    loopers_[RIGHT].Trigger(Command::RESTART == command.type);
                 }
-
-                if (mustStartWritingLeft)
+                break;
+            case Command::START_READING:
+                if (IsRunning())
                 {
-                    loopers_[LEFT].StartWriting(false);
-                    mustStartWritingLeft = false;
+                    loopers_[LEFT].StartReading(true);
+                    loopers_[RIGHT].StartReading(true);
                 }
-
-                if (mustStopWritingLeft)
+                break;
+            case Command::STOP_READING:
+                if (IsRunning())
                 {
-                    loopers_[LEFT].StopWriting(false);
-                    mustStopWritingLeft = false;
+                    loopers_[LEFT].StopReading(true);
+                    loopers_[RIGHT].StopReading(true);
                 }
-
-                if (mustStartWritingRight)
+                break;
+            case Command::START_WRITING:
+                if (IsRunning())
                 {
-                    loopers_[RIGHT].StartWriting(false);
-                    mustStartWritingRight = false;
+                    if (BOTH == command.channel)
+                    {
+                        loopers_[LEFT].StartWriting(true);
+                        loopers_[RIGHT].StartWriting(true);
+                    }
+                    else
+                    {
+                        loopers_[command.channel].StartWriting(false);
+                    }
                 }
-
-                if (mustStopWritingRight)
+                break;
+            case Command::STOP_WRITING:
+                if (IsRunning())
                 {
-                    loopers_[RIGHT].StopWriting(false);
-                    mustStopWritingRight = false;
+                    if (BOTH == command.channel)
+                    {
+                        loopers_[LEFT].StopWriting(true);
+                        loopers_[RIGHT].StopWriting(true);
+                    }
+                    else
+                    {
+                        loopers_[command.channel].StopWriting(false);
+                    }
                 }
-
-                leftWet = loopers_[LEFT].Read();
-                rightWet = loopers_[RIGHT].Read();
-
-                if (feedback > 0.f)
+                break;
+            case Command::MOVEMENT:
+                ApplyMovement(command.channel, static_cast<Movement>(static_cast<int>(command.value)));
+                break;
+            case Command::DIRECTION:
+                ApplyDirection(command.channel, static_cast<Direction>(static_cast<int>(command.value)));
+                break;
+            case Command::LOOP_START:
+                ApplyLoopStart(command.channel, command.value);
+                break;
+            case Command::FREEZE:
+                ApplyFreeze(command.channel, command.value);
+                break;
+            case Command::READ_RATE:
+                ApplyReadRate(command.channel, command.value);
+                break;
+            case Command::WRITE_RATE:
+                ApplyWriteRate(command.channel, command.value);
+                break;
+            case Command::EXPORT:
+                for (int channel : {LEFT, RIGHT})
                 {
-                    if (crossedFeedback)
+                    if (IsRunning())
                     {
-                        leftFeedback = loopers_[LEFT].Degrade(Mix(leftWet * (1.f - leftFeedbackPath), rightWet * (1.f - rightFeedbackPath)) * feedback);
-                        rightFeedback = loopers_[RIGHT].Degrade(Mix(leftWet * leftFeedbackPath, rightWet * rightFeedbackPath) * feedback);
+                        loopers_[channel].StartExport(&command.snapshots[channel]);
                     }
                     else
                     {
-                        leftFeedback = loopers_[LEFT].Degrade(leftWet * feedback);
-                        rightFeedback = loopers_[RIGHT].Degrade(rightWet * feedback);
+                        command.snapshots[channel].status.store(LoopSnapshot::CANCELLED, std::memory_order_release);
                     }
-                    float leftFiltered = filterLevel * Filter(leftFeedback) * feedback;
-                    float rightFiltered = filterLevel * Filter(rightFeedback) * feedback;
-                    leftFiltered *= (feedbackLevel - filterEnvelope_.GetEnv(leftFiltered));
-                    rightFiltered *= (feedbackLevel - filterEnvelope_.GetEnv(rightFiltered));
-                    leftFeedback = Mix(leftFeedback, leftFiltered);
-                    rightFeedback = Mix(rightFeedback, rightFiltered);
                 }
+                break;
+            case Command::LOOP_LENGTH:
+                ApplyLoopLength(command.channel, command.value);
+                break;
+            }
+        }
+
+        /**
+         * @brief Applies a new movement, see SetMovement().
+         */
+        void ApplyMovement(int channel, Movement movement)
+        {
+            if (BOTH == channel)
+            {
+                loopers_[LEFT].SetMovement(movement);
+                loopers_[RIGHT].SetMovement(movement);
+                conf_.movement = movement;
+            }
+            else
+            {
+                loopers_[channel].SetMovement(movement);
+            }
+        }
+
+        /**
+         * @brief Applies a new direction, see SetDirection().
+         */
+        void ApplyDirection(int channel, Direction direction)
+        {
+            if (LEFT == channel || BOTH == channel)
+            {
+                leftDirection_ = direction;
+            }
+            if (RIGHT == channel || BOTH == channel)
+            {
+                rightDirection_ = direction;
+            }
+            if (BOTH == channel)
+            {
+                conf_.direction = direction;
+            }
+            // Before the looper starts, if the direction is backwards set the
+            // reading head at the end of the loop.
+            if (State::READY == state_ && Direction::BACKWARDS == direction)
+            {
+                loopers_[LEFT].SetReadPos(loopers_[LEFT].GetLoopEnd());
+                loopers_[RIGHT].SetReadPos(loopers_[RIGHT].GetLoopEnd());
+            }
+        }
+
+        /**
+         * @brief Applies a new loop start, see SetLoopStart().
+         */
+        void ApplyLoopStart(int channel, double value)
+        {
+            if (LEFT == channel || BOTH == channel)
+            {
+                nextLeftLoopStart_ = std::min(std::max(value, 0.0), loopers_[LEFT].GetBufferSamples() - 1.0);
+            }
+            if (RIGHT == channel || BOTH == channel)
+            {
+                nextRightLoopStart_ = std::min(std::max(value, 0.0), loopers_[RIGHT].GetBufferSamples() - 1.0);
+            }
+        }
+
+        /**
+         * @brief Applies a new freeze amount, see SetFreeze().
+         */
+        void ApplyFreeze(int channel, float amount)
+        {
+            if (LEFT == channel || BOTH == channel)
+            {
+                nextLeftFreeze_ = amount;
+            }
+            if (RIGHT == channel || BOTH == channel)
+            {
+                nextRightFreeze_ = amount;
+            }
+            freeze_ = amount;
+            if (State::READY != state_)
+            {
+                state_ = amount == 1.f ? State::FROZEN : State::RECORDING;
+            }
+        }
+
+        /**
+         * @brief Applies a new reading rate, see SetReadRate().
+         */
+        void ApplyReadRate(int channel, float rate)
+        {
+            if (LEFT == channel || BOTH == channel)
+            {
+                nextLeftReadRate_ = rate;
+            }
+            if (RIGHT == channel || BOTH == channel)
+            {
+                nextRightReadRate_ = rate;
+            }
+            conf_.rate = rate;
+        }
+
+        /**
+         * @brief Applies a new writing rate, see SetWriteRate().
+         */
+        void ApplyWriteRate(int channel, float rate)
+        {
+            if (LEFT == channel || BOTH == channel)
+            {
+                nextLeftWriteRate_ = rate;
+            }
+            if (RIGHT == channel || BOTH == channel)
+            {
+                nextRightWriteRate_ = rate;
+            }
+        }
+
+        /**
+         * @brief Applies a new loop length, see SetLoopLength().
+         */
+        void ApplyLoopLength(int channel, double length)
+        {
+            if (LEFT == channel || BOTH == channel)
+            {
+                nextLeftLoopLength_ = std::min(std::max(length, static_cast<double>(kMinLoopLengthSamples)), static_cast<double>(loopers_[LEFT].GetBufferSamples()));
+                noteModeLeft = NoteMode::NO_MODE;
+                if (length <= kMinLoopLengthSamples)
+                {
+                    noteModeLeft = NoteMode::NOTE;
+                }
+                else if (length >= kMinSamplesForTone && length <= kMinSamplesForFlanger)
+                {
+                    noteModeLeft = NoteMode::FLANGER;
+                }
+            }
+            if (RIGHT == channel || BOTH == channel)
+            {
+                nextRightLoopLength_ = std::min(std::max(length, static_cast<double>(kMinLoopLengthSamples)), static_cast<double>(loopers_[RIGHT].GetBufferSamples()));
+                noteModeRight = NoteMode::NO_MODE;
+                if (length <= kMinLoopLengthSamples)
+                {
+                    noteModeRight = NoteMode::NOTE;
+                }
+                else if (length >= kMinSamplesForTone && length <= kMinSamplesForFlanger)
+                {
+                    noteModeRight = NoteMode::FLANGER;
+                }
+            }
+        }
 
-                loopers_[LEFT].UpdateReadPos();
-                loopers_[RIGHT].UpdateReadPos();
+        /**
+         * @brief Stops buffering and gets the looper ready to start.
+         */
+        void FinishBuffering()
+        {
+            loopers_[LEFT].StopBuffering();
+            loopers_[RIGHT].StopBuffering();
+            // The looper may be started before the next block, so the
+            // parameters must be in place already.
+            ResetParameters();
 
-                loopers_[LEFT].Write(Mix(leftDry * dryLevel, leftFeedback));
-                loopers_[RIGHT].Write(Mix(rightDry * dryLevel, rightFeedback));
+            state_ = State::READY;
+        }
 
-                loopers_[LEFT].UpdateWritePos();
-                loopers_[RIGHT].UpdateWritePos();
+        /**
+         * @brief Fills the buffers with the input, passing the audio through.
+         *
+         * @param leftIn
+         * @param rightIn
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        void ProcessBuffering(const float *leftIn, const float *rightIn, float *leftOut, float *rightOut, size_t size)
+        {
+            // The scratch blocks hold kMaxBlockSize samples.
+            for (size_t i = 0; i < size; i += kMaxBlockSize)
+            {
+                size_t samples = std::min(size - i, kMaxBlockSize);
+                SoftClipBlock(leftIn + i, leftWet_, samples, inputGain);
+                SoftClipBlock(rightIn + i, rightWet_, samples, inputGain);
+
+                // The audio passes through while it's buffered, then only the
+                // dry signal goes.
+                size_t buffered{};
+                if (State::BUFFERING == state_)
+                {
+                    buffered = std::min(samples, static_cast<size_t>(loopers_[LEFT].GetMaxBufferSamples() - loopers_[LEFT].GetBufferSamples()));
+                    bool doneLeft{loopers_[LEFT].BufferBlock(leftWet_, buffered)};
+                    bool doneRight{loopers_[RIGHT].BufferBlock(rightWet_, buffered)};
+                    if (doneLeft && doneRight)
+                    {
+                        FinishBuffering();
+                    }
+                }
 
-                // Mix some of the filtered fed back signal with the wet when frozen.
-                leftWet = Mix(leftWet, filterLevel * Filter(leftFeedback) * freeze_);
-                rightWet = Mix(rightWet, filterLevel * Filter(rightFeedback) * freeze_);
+                ProcessOutput(leftWet_, rightWet_, leftWet_, rightWet_, nullptr, nullptr, leftOut + i, rightOut + i, buffered);
+                ProcessDryOutput(leftWet_ + buffered, rightWet_ + buffered, leftOut + i + buffered, rightOut + i + buffered, samples - buffered);
             }
-            default:
-                break;
+        }
+
+        /**
+         * @brief The actual looping, with reading, feedback and writing. The
+         * steady stretches (no fades, no loop actions) are processed in
+         * blocks, the rest one sample at a time.
+         *
+         * @param leftIn
+         * @param rightIn
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        void ProcessRunning(const float *leftIn, const float *rightIn, float *leftOut, float *rightOut, size_t size)
+        {
+            // The feedback settings don't change within a segment, so the
+            // version of ProcessSteady() without their branches is chosen
+            // once.
+            using SteadyProcessor = void (StereoLooper::*)(const float *, const float *, float *, float *, size_t);
+            static constexpr SteadyProcessor kSteadyProcessors[2][2]{
+                {&StereoLooper::ProcessSteady<false, false>, &StereoLooper::ProcessSteady<false, true>},
+                {&StereoLooper::ProcessSteady<true, false>, &StereoLooper::ProcessSteady<true, true>},
+            };
+            SteadyProcessor processSteady = kSteadyProcessors[feedback > 0.f][crossedFeedback];
+
+            size_t i = 0;
+            while (i < size)
+            {
+                size_t samples = GetSteadySamples(size - i);
+                if (samples > 0)
+                {
+                    (this->*processSteady)(leftIn + i, rightIn + i, leftOut + i, rightOut + i, samples);
+                    i += samples;
+                }
+                else
+                {
+                    ProcessFrame(leftIn[i], rightIn[i], leftOut[i], rightOut[i]);
+                    i++;
+                }
             }
+        }
 
-            // Mid-side processing for stereo widening.
-            float mid = (leftWet + rightWet) / fastroot(2, 10);
-            float side = ((leftWet - rightWet) / fastroot(2, 10)) * stereoWidth;
-            float stereoLeft = (mid + side) / fastroot(2, 10);
-            float stereoRight = (mid - side) / fastroot(2, 10);
+        /**
+         * @brief Returns how many of the next samples can be processed as a
+         * block by both the loopers.
+         *
+         * @param size
+         * @return size_t
+         */
+        size_t GetSteadySamples(size_t size)
+        {
+            size = loopers_[LEFT].GetSteadySamples(size);
 
-            // Output gain stage.
-            leftOut = SoftClip(Fader::EqualCrossFade(leftDry, stereoLeft, dryWetMix) * outputGain);
-            rightOut = SoftClip(Fader::EqualCrossFade(rightDry, stereoRight, dryWetMix) * outputGain);
+            return size > 0 ? loopers_[RIGHT].GetSteadySamples(size) : 0;
+        }
 
-            if (feedbackOnly)
+        /**
+         * @brief Processes a block of samples in which the loopers' heads
+         * simply move forward, reading and writing in one go. Specialized by
+         * whether there's feedback, and whether it's crossed.
+         *
+         * @param leftIn
+         * @param rightIn
+         * @param leftOut
+         * @param rightOut
+         * @param size
+         */
+        template <bool kFeedback, bool kCrossed>
+        void ProcessSteady(const float *leftIn, const float *rightIn, float *leftOut, float *rightOut, size_t size)
+        {
+            loopers_[LEFT].ReadBlock(leftWet_, size);
+            loopers_[RIGHT].ReadBlock(rightWet_, size);
+            if (kFeedback)
+            {
+                loopers_[LEFT].GetDegradationGains(leftDegradation_, size);
+                loopers_[RIGHT].GetDegradationGains(rightDegradation_, size);
+                ProcessFeedback<kCrossed>(leftWet_, rightWet_, leftDegradation_, rightDegradation_, size);
+            }
+            else
+            {
+                ClearFeedback(size);
+            }
+
+            // Input gain stage.
+            SoftClipBlock(leftIn, leftDry_, size, inputGain);
+            SoftClipBlock(rightIn, rightDry_, size, inputGain);
+
+            // Mix some of the filtered fed back signal with the wet when frozen.
+            float frozenLevel = filterLevel * freeze_;
+            for (size_t i = 0; i < size; i++)
             {
-                leftOut = SoftClip(leftFeedback);
-                rightOut = SoftClip(rightFeedback);
+                leftWrite_[i] = leftDry_[i] * dryLevel + leftFeedback_[i];
+                rightWrite_[i] = rightDry_[i] * dryLevel + rightFeedback_[i];
+                leftWet_[i] += leftFiltered_[i] * frozenLevel;
+                rightWet_[i] += rightFiltered_[i] * frozenLevel;
             }
+            SoftClipBlock(leftWrite_, leftWrite_, size);
+            SoftClipBlock(rightWrite_, rightWrite_, size);
+            SoftClipBlock(leftWet_, leftWet_, size);
+            SoftClipBlock(rightWet_, rightWet_, size);
+
+            loopers_[LEFT].WriteBlock(leftWrite_, size);
+            loopers_[RIGHT].WriteBlock(rightWrite_, size);
+
+            ProcessOutput(leftDry_, rightDry_, leftWet_, rightWet_, leftFeedback_, rightFeedback_, leftOut, rightOut, size);
         }
 
-    private:
-        Looper loopers_[2];
-        State state_{}; // The current state of the looper
-        EnvFollow filterEnvelope_{};
-        Svf feedbackFilter_;
-        int32_t sampleRate_{};
-        float freeze_{};
-        float degradation_{};
-        float filterValue_{};
-        Conf conf_{};
+        /**
+         * @brief Processes a single frame, moving the heads one sample at a
+         * time.
+         *
+         * @param leftIn
+         * @param rightIn
+         * @param leftOut
+         * @param rightOut
+         */
+        void ProcessFrame(float leftIn, float rightIn, float &leftOut, float &rightOut)
+        {
+            // Input gain stage.
+            float leftDry = SoftClip(leftIn * inputGain);
+            float rightDry = SoftClip(rightIn * inputGain);
+
+            float leftWet = loopers_[LEFT].Read();
+            float rightWet = loopers_[RIGHT].Read();
+
+            if (feedback > 0.f)
+            {
+                float leftDegradation = loopers_[LEFT].GetDegradationGain();
+                float rightDegradation = loopers_[RIGHT].GetDegradationGain();
+                if (crossedFeedback)
+                {
+                    ProcessFeedback<true>(&leftWet, &rightWet, &leftDegradation, &rightDegradation, 1);
+                }
+                else
+                {
+                    ProcessFeedback<false>(&leftWet, &rightWet, &leftDegradation, &rightDegradation, 1);
+                }
+            }
+            else
+            {
+                ClearFeedback(1);
+            }
+            float leftFeedback = leftFeedback_[0];
+            float rightFeedback = rightFeedback_[0];
+
+            loopers_[LEFT].UpdateReadPos();
+            loopers_[RIGHT].UpdateReadPos();
+
+            loopers_[LEFT].Write(Mix(leftDry * dryLevel, leftFeedback));
+            loopers_[RIGHT].Write(Mix(rightDry * dryLevel, rightFeedback));
+
+            loopers_[LEFT].UpdateWritePos();
+            loopers_[RIGHT].UpdateWritePos();
+
+            // Mix some of the filtered fed back signal with the wet when frozen.
+            leftWet = Mix(leftWet, filterLevel * leftFiltered_[0] * freeze_);
+            rightWet = Mix(rightWet, filterLevel * rightFiltered_[0] * freeze_);
+
+            ProcessOutput(&leftDry, &rightDry, &leftWet, &rightWet, &leftFeedback, &rightFeedback, &leftOut, &rightOut, 1);
+        }
 
         /**
-         * @brief Resets the loopers to their initial state.
+         * @brief Calculates the signal to be fed back to the loopers, in
+         * leftFeedback_ and rightFeedback_, and the output of the filter, in
+         * leftFiltered_ and rightFiltered_. Both the channels go through the
+         * filter at once.
+         *
+         * @param leftWet
+         * @param rightWet
+         * @param leftDegradation The gains of the degradation, see Looper::GetDegradationGains()
+         * @param rightDegradation
+         * @param size
          */
-        void Reset()
+        template <bool kCrossed>
+        void ProcessFeedback(const float *leftWet, const float *rightWet, const float *leftDegradation, const float *rightDegradation, size_t size)
         {
-            loopers_[LEFT].Reset();
-            loopers_[RIGHT].Reset();
+            FeedbackFilter::Output output = GetFilterOutput();
+            StereoPair filterGain = StereoPair::Set(filterLevel * feedback);
+            StereoPair level = StereoPair::Set(feedbackLevel);
+            for (size_t i = 0; i < size; i++)
+            {
+                float left = leftWet[i];
+                float right = rightWet[i];
+                if (kCrossed)
+                {
+                    left = Mix(leftWet[i] * (1.f - leftFeedbackPath), rightWet[i] * (1.f - rightFeedbackPath));
+                    right = Mix(leftWet[i] * leftFeedbackPath, rightWet[i] * rightFeedbackPath);
+                }
+                StereoPair input = StereoPair::Set(left * feedback * leftDegradation[i], right * feedback * rightDegradation[i]);
+                StereoPair filtered = feedbackFilter_.Process(input, output);
+                StereoPair shaped = filtered * filterGain;
+                shaped = shaped * (level - feedbackFilter_.GetEnv(shaped));
+                StereoPair mixed = input + shaped;
+
+                leftFiltered_[i] = filtered.Left();
+                rightFiltered_[i] = filtered.Right();
+                leftFeedback_[i] = mixed.Left();
+                rightFeedback_[i] = mixed.Right();
+            }
+            SoftClipBlock(leftFeedback_, leftFeedback_, size);
+            SoftClipBlock(rightFeedback_, rightFeedback_, size);
+        }
 
-            // SetMode(conf_.mode);
-            SetMovement(BOTH, conf_.movement);
-            SetDirection(BOTH, conf_.direction);
-            SetReadRate(BOTH, conf_.rate);
-            SetWriteRate(BOTH, conf_.rate);
+        /**
+         * @brief Clears the feedback and the output of the filter, when
+         * there's no feedback.
+         *
+         * @param size
+         */
+        void ClearFeedback(size_t size)
+        {
+            std::fill(leftFeedback_, leftFeedback_ + size, 0.f);
+            std::fill(rightFeedback_, rightFeedback_ + size, 0.f);
+            std::fill(leftFiltered_, leftFiltered_ + size, 0.f);
+            std::fill(rightFiltered_, rightFiltered_ + size, 0.f);
         }
 
         /**
-         * @brief Simple mixing and clipping of two signals.
+         * @brief The output stage, with stereo widening, dry/wet mix and gain
+         * (see OutputStage), or the feedback alone.
          *
-         * @param a
-         * @param b
-         * @return float
+         * @param leftDry
+         * @param rightDry
+         * @param leftWet
+         * @param rightWet
+         * @param leftFeedback nullptr when there's no feedback
+         * @param rightFeedback
+         * @param leftOut
+         * @param rightOut
+         * @param size
          */
-        float Mix(float a, float b)
+        void ProcessOutput(const float *leftDry, const float *rightDry, const float *leftWet, const float *rightWet, const float *leftFeedback, const float *rightFeedback, float *leftOut, float *rightOut, size_t size)
         {
-            return SoftClip(a + b);
+            if (!feedbackOnly)
+            {
+                outputStage_.Process(leftDry, rightDry, leftWet, rightWet, leftOut, rightOut, size);
+            }
+            else if (leftFeedback)
+            {
+                SoftClipBlock(leftFeedback, leftOut, size);
+                SoftClipBlock(rightFeedback, rightOut, size);
+            }
+            else
+            {
+                std::fill(leftOut, leftOut + size, 0.f);
+                std::fill(rightOut, rightOut + size, 0.f);
+            }
         }
 
         /**
-         * @brief Filters the provided signal and returns the result.
+         * @brief Same as ProcessOutput, with the dry signal only.
          *
-         * @param value
-         * @return float
+         * @param leftDry
+         * @param rightDry
+         * @param leftOut
+         * @param rightOut
+         * @param size
          */
-        float Filter(float value)
+        void ProcessDryOutput(const float *leftDry, const float *rightDry, float *leftOut, float *rightOut, size_t size)
         {
-            feedbackFilter_.Process(value);
-            switch (filterType)
+            if (feedbackOnly)
             {
-            case FilterType::BP:
-                return feedbackFilter_.Band();
-            case FilterType::HP:
-                return feedbackFilter_.High();
-            case FilterType::LP:
-                return feedbackFilter_.Low();
-            default:
-                return feedbackFilter_.Band();
+                std::fill(leftOut, leftOut + size, 0.f);
+                std::fill(rightOut, rightOut + size, 0.f);
+
+                return;
             }
+            outputStage_.ProcessDry(leftDry, rightDry, leftOut, rightOut, size);
         }
 
         /**
          * @brief Updates the loopers' parameters. This is called at the
-         * beginning of the Process() method to ensure that the parameters are
+         * beginning of each processed block to ensure that the parameters are
          * changed at the right moment.
+         *
+         * @param size The block size, used to scale the rate slew
          */
-        void UpdateParameters()
+        void UpdateParameters(size_t size)
         {
-            if (leftDirection != loopers_[LEFT].GetDirection())
+            // The one-pole slew is applied once per block, so its coefficient
+            // is compounded over the block size.
+            float coeff = rateSlew > 0 ? 1.f / (rateSlew * sampleRate_) : 1.f;
+            if (size > 1 && coeff < 1.f)
+            {
+                coeff = 1.f - std::pow(1.f - coeff, static_cast<float>(size));
+            }
+
+            if (leftDirection_ != loopers_[LEFT].GetDirection())
             {
-                loopers_[LEFT].SetDirection(leftDirection);
+                loopers_[LEFT].SetDirection(leftDirection_);
             }
-            if (rightDirection != loopers_[RIGHT].GetDirection())
+            if (rightDirection_ != loopers_[RIGHT].GetDirection())
             {
-                loopers_[RIGHT].SetDirection(rightDirection);
+                loopers_[RIGHT].SetDirection(rightDirection_);
             }
 
             float leftReadRate = loopers_[LEFT].GetReadRate();
-            if (leftReadRate != nextLeftReadRate)
+            if (leftReadRate != nextLeftReadRate_)
             {
-                float coeff = rateSlew > 0 ? 1.f / (rateSlew * sampleRate_) : 1.f;
-                fonepole(leftReadRate, nextLeftReadRate, coeff);
+                fonepole(leftReadRate, nextLeftReadRate_, coeff);
                 loopers_[LEFT].SetReadRate(leftReadRate);
             }
             float rightReadRate = loopers_[RIGHT].GetReadRate();
-            if (rightReadRate != nextRightReadRate)
+            if (rightReadRate != nextRightReadRate_)
             {
-                float coeff = rateSlew > 0 ? 1.f / (rateSlew * sampleRate_) : 1.f;
-                fonepole(rightReadRate, nextRightReadRate, coeff);
+                fonepole(rightReadRate, nextRightReadRate_, coeff);
                 loopers_[RIGHT].SetReadRate(rightReadRate);
             }
 
             float leftWriteRate = loopers_[LEFT].GetWriteRate();
-            if (leftWriteRate != nextLeftWriteRate)
+            if (leftWriteRate != nextLeftWriteRate_)
             {
-                float coeff = rateSlew > 0 ? 1.f / (rateSlew * sampleRate_) : 1.f;
-                fonepole(leftWriteRate, nextLeftWriteRate, coeff);
+                fonepole(leftWriteRate, nextLeftWriteRate_, coeff);
                 loopers_[LEFT].SetWriteRate(leftWriteRate);
             }
             float rightWriteRate = loopers_[RIGHT].GetWriteRate();
-            if (rightWriteRate != nextRightWriteRate)
+            if (rightWriteRate != nextRightWriteRate_)
             {
-                float coeff = rateSlew > 0 ? 1.f / (rateSlew * sampleRate_) : 1.f;
-                fonepole(rightWriteRate, nextRightWriteRate, coeff);
+                fonepole(rightWriteRate, nextRightWriteRate_, coeff);
                 loopers_[RIGHT].SetWriteRate(rightWriteRate);
             }
 
-            float leftLoopLength = loopers_[LEFT].GetLoopLength();
-            if (leftLoopLength != nextLeftLoopLength)
+            double leftLoopLength = loopers_[LEFT].GetLoopLength();
+            if (leftLoopLength != nextLeftLoopLength_)
             {
-                loopers_[LEFT].SetLoopLength(nextLeftLoopLength);
+                loopers_[LEFT].SetLoopLength(nextLeftLoopLength_);
             }
-            float rightLoopLength = loopers_[RIGHT].GetLoopLength();
-            if (rightLoopLength != nextRightLoopLength)
+            double rightLoopLength = loopers_[RIGHT].GetLoopLength();
+            if (rightLoopLength != nextRightLoopLength_)
             {
-                loopers_[RIGHT].SetLoopLength(nextRightLoopLength);
+                loopers_[RIGHT].SetLoopLength(nextRightLoopLength_);
             }
 
-            float leftLoopStart = loopers_[LEFT].GetLoopStart();
-            if (leftLoopStart != nextLeftLoopStart)
+            double leftLoopStart = loopers_[LEFT].GetLoopStart();
+            if (leftLoopStart != nextLeftLoopStart_)
             {
-                loopers_[LEFT].SetLoopStart(nextLeftLoopStart);
+                loopers_[LEFT].SetLoopStart(nextLeftLoopStart_);
             }
-            float rightLoopStart = loopers_[RIGHT].GetLoopStart();
-            if (rightLoopStart != nextRightLoopStart)
+            double rightLoopStart = loopers_[RIGHT].GetLoopStart();
+            if (rightLoopStart != nextRightLoopStart_)
             {
-                loopers_[RIGHT].SetLoopStart(nextRightLoopStart);
+                loopers_[RIGHT].SetLoopStart(nextRightLoopStart_);
             }
 
             float leftFreeze = loopers_[LEFT].GetFreeze();
-            if (leftFreeze != nextLeftFreeze)
+            if (leftFreeze != nextLeftFreeze_)
             {
-                loopers_[LEFT].SetFreeze(nextLeftFreeze);
+                loopers_[LEFT].SetFreeze(nextLeftFreeze_);
             }
 
             float rightFreeze = loopers_[RIGHT].GetFreeze();
-            if (rightFreeze != nextRightFreeze)
+            if (rightFreeze != nextRightFreeze_)
             {
-                loopers_[RIGHT].SetFreeze(nextRightFreeze);
+                loopers_[RIGHT].SetFreeze(nextRightFreeze_);
             }
         }
     };
@@ -1,10 +1,15 @@
 #include "head.h"
 #include "looper.h"
+#include "command_queue.h"
+#include "mapped_buffer.h"
+#include "stereo_looper.h"
+#include "session.h"
 #include <ctime>
 #include <cstdlib>
 #include <iostream>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 
 using namespace wreath;
 
@@ -14,6 +19,9 @@ constexpr int32_t bufferSamples = 48000;
 
 float buffer[48000];
 float buffer2[48000];
+float interleavedBuffer[48000 * 2];
+uint8_t formatBuffer[48000 * 4];
+uint8_t formatBuffer2[48000 * 4];
 Looper looper;
 
 bool Compare (float a, float b)
@@ -71,6 +79,21 @@ std::string MapDirection(Direction direction)
     }
 }
 
+std::string MapInterpolation(Interpolation interpolation)
+{
+    switch (interpolation)
+    {
+    case Interpolation::HERMITE:
+        return "Hermite";
+    case Interpolation::LAGRANGE:
+        return "Lagrange";
+    case Interpolation::SINC:
+        return "Sinc";
+    default:
+        return "Linear";
+    }
+}
+
 void TestBoundaries()
 {
     Buffer(false);
@@ -443,6 +466,1035 @@ void TestHeadsDistance()
     }
 }
 
+void TestCrossingSchedule()
+{
+    struct Scenario
+    {
+        std::string desc{};
+        double loopLength{};
+        double loopStart{};
+        Direction direction{};
+        float readRate{};
+        float writeRate{};
+        double readPos{};
+        double writePos{};
+    };
+
+    static Scenario scenarios[] =
+    {
+        { "1 - regular, forward, rs > ws", 20000, 10000, Direction::FORWARD, 1.5f, 1.f, 12000, 20000 },
+        { "2 - regular, forward, ws > rs", 20000, 10000, Direction::FORWARD, 0.5f, 1.f, 20000, 12000 },
+        { "3 - regular, forward, unequal rates", 20000, 10000, Direction::FORWARD, 1.37f, 0.8f, 26000, 14000 },
+        { "4 - regular, backwards, equal rates", 20000, 10000, Direction::BACKWARDS, 1.f, 1.f, 12000, 20000 },
+        { "5 - regular, backwards, unequal rates", 30000, 5000, Direction::BACKWARDS, 0.7f, 1.3f, 30000, 10000 },
+        { "6 - inverted, forward, rs > ws", 20000, 40000, Direction::FORWARD, 1.25f, 1.f, 42000, 5000 },
+        { "7 - inverted, backwards, rs > ws", 20000, 40000, Direction::BACKWARDS, 2.5f, 1.f, 10000, 40000 },
+        { "8 - regular, forward, rates above 1", 30000, 10000, Direction::FORWARD, 3.2f, 1.6f, 14000, 30000 },
+    };
+
+    std::cout << "\n";
+
+    // The crossfade scheduled from the heads' velocities must start where a
+    // brute-force run, following the heads' distance sample by sample, puts
+    // it: ahead of the crossing by the fade time, centered on the cross
+    // point.
+    for (Scenario scenario : scenarios)
+    {
+        Buffer(false);
+        looper.SetMovement(Movement::NORMAL);
+        looper.SetLoopSync(true);
+        looper.SetFreeze(0.f);
+        // Both the reading heads get the loop while not reading, and setting
+        // the same length again settles it, so that they don't fade to it.
+        looper.StopReading(true);
+        looper.SetLoopStart(scenario.loopStart);
+        looper.SetLoopLength(scenario.loopLength);
+        looper.SetLoopLength(scenario.loopLength);
+        looper.SetDirection(scenario.direction);
+        looper.SetReadRate(scenario.readRate);
+        looper.SetWriteRate(scenario.writeRate);
+        looper.SetReadPos(scenario.readPos);
+        looper.SetWritePos(scenario.writePos);
+        looper.StartReading(true);
+        looper.StartWriting(true);
+
+        double velocity = std::abs(scenario.readRate * scenario.direction - scenario.writeRate);
+        double tolerance = 2 / velocity + 2;
+        double fadeTime = looper.GetSamplesToFade() / scenario.writeRate;
+        double length = looper.GetLoopLength();
+        int64_t fadeStart{-1};
+        int64_t crossing{-1};
+        double crossPoint{};
+        double crossWritePos{};
+        bool fadingAtCrossing{};
+        double distance = looper.GetHeadsDistance();
+        for (int64_t t = 0; t < 200000 && crossing < 0; t++)
+        {
+            looper.Write(0.f);
+            looper.UpdateReadPos();
+            looper.UpdateWritePos();
+            if (fadeStart < 0 && looper.IsCrossFading())
+            {
+                fadeStart = t;
+                crossPoint = looper.GetCrossPoint();
+            }
+            // The distance wraps around the loop when the heads cross.
+            double next = looper.GetHeadsDistance();
+            if (next - distance > length / 2)
+            {
+                crossing = t;
+                crossWritePos = looper.GetWritePos();
+                fadingAtCrossing = looper.IsCrossFading();
+            }
+            distance = next;
+        }
+        // Let the crossfade end, before the next scenario.
+        while (looper.IsCrossFading())
+        {
+            looper.Write(0.f);
+            looper.UpdateReadPos();
+            looper.UpdateWritePos();
+        }
+
+        // The distance along the loop between the cross point and where the
+        // writing head actually was.
+        auto offset = [](double pos)
+        {
+            double value = pos - looper.GetLoopStart();
+            return value < 0 ? value + looper.GetBufferSamples() : value;
+        };
+        double pointError = std::fabs(offset(crossPoint) - offset(crossWritePos));
+        pointError = std::min(pointError, length - pointError);
+
+        std::cout << "Scenario " << scenario.desc << "\n";
+        std::cout << "Crossing at: " << crossing << ", crossfade start: " << fadeStart << " (expected " << crossing - fadeTime << ")\n";
+        std::cout << "Cross point: " << crossPoint << ", write position at the crossing: " << crossWritePos << "\n\n";
+        assert(crossing > fadeTime && fadeStart >= 0);
+        assert(std::fabs(crossing - fadeTime - fadeStart) <= tolerance);
+        assert(fadingAtCrossing);
+        assert(pointError <= tolerance * scenario.writeRate + 1);
+    }
+    looper.SetReadRate(1.f);
+    looper.SetWriteRate(1.f);
+    looper.SetDirection(Direction::FORWARD);
+}
+
+void TestReadBlock()
+{
+    Buffer(false);
+
+    struct Scenario
+    {
+        std::string desc{};
+        float loopLength{};
+        float loopStart{};
+        float index{};
+        float rate{};
+        Direction direction{};
+        int32_t samples{};
+    };
+
+    static Scenario scenarios[] =
+    {
+        { "1 - Regular, 1x speed, forward", 20000, 10000, 10000, 1.f, FORWARD, 256 },
+        { "2 - Regular, 0.375x speed, forward, up to the loop end", 20000, 10000, 29900.25f, 0.375f, FORWARD, 266 },
+        { "3 - Regular, 2.5x speed, backwards, up to the loop start", 20000, 10000, 10500.5f, 2.5f, BACKWARDS, 200 },
+        { "4 - Inverted, 1.25x speed, forward, across the buffer end", 10000, 40000, 47800.25f, 1.25f, FORWARD, 300 },
+        { "5 - Inverted, 0.75x speed, backwards, across the buffer start", 10000, 40000, 150.75f, 0.75f, BACKWARDS, 300 },
+    };
+
+    std::cout << "\n";
+
+    static Interpolation interpolations[] = {LINEAR, HERMITE, LAGRANGE, SINC};
+
+    std::cout << "\n";
+
+    for (Scenario scenario : scenarios)
+    {
+        std::cout << "Scenario " << scenario.desc << "\n";
+
+        for (Interpolation interpolation : interpolations)
+        {
+            Head head{Type::READ};
+            head.Init(buffer, buffer2, bufferSamples);
+            head.InitBuffer(bufferSamples);
+            head.SetActive(true);
+            head.SetLooping(true);
+            head.SetLoopStartAndLength(scenario.loopStart, scenario.loopLength);
+            head.SetRate(scenario.rate);
+            head.SetDirection(scenario.direction);
+            head.SetInterpolation(interpolation);
+            head.SetIndex(scenario.index);
+
+            float block[512]{};
+            head.ReadBlock(block, scenario.samples);
+
+            float maxError{};
+            for (int32_t i = 0; i < scenario.samples; i++)
+            {
+                maxError = std::max(maxError, std::fabs(block[i] - head.Read()));
+                head.UpdatePosition();
+            }
+            std::cout << "Max error (" << MapInterpolation(interpolation) << "): " << maxError << "\n";
+            assert(maxError < 1e-3f);
+
+            // The same block, read from an interleaved copy of the buffer.
+            for (int32_t i = 0; i < bufferSamples; i++)
+            {
+                interleavedBuffer[i * 2] = buffer[i];
+            }
+            Head interleaved{Type::READ};
+            interleaved.Init(interleavedBuffer, nullptr, bufferSamples, 2);
+            interleaved.InitBuffer(bufferSamples);
+            interleaved.SetActive(true);
+            interleaved.SetLooping(true);
+            interleaved.SetLoopStartAndLength(scenario.loopStart, scenario.loopLength);
+            interleaved.SetRate(scenario.rate);
+            interleaved.SetDirection(scenario.direction);
+            interleaved.SetInterpolation(interpolation);
+            interleaved.SetIndex(scenario.index);
+
+            float interleavedBlock[512]{};
+            interleaved.ReadBlock(interleavedBlock, scenario.samples);
+            for (int32_t i = 0; i < scenario.samples; i++)
+            {
+                assert(interleavedBlock[i] == block[i]);
+            }
+        }
+        std::cout << "\n";
+    }
+}
+
+void TestSamplesToBoundary()
+{
+    Buffer(false);
+
+    struct Scenario
+    {
+        std::string desc{};
+        float loopLength{};
+        float loopStart{};
+        float index{};
+        float rate{};
+        Direction direction{};
+        bool looping{};
+    };
+
+    static Scenario scenarios[] =
+    {
+        { "1 - Regular, 1x speed, forward, looping", 20000, 10000, 29800, 1.f, FORWARD, true },
+        { "2 - Regular, 2.5x speed, backwards, looping", 20000, 10000, 10500.5f, 2.5f, BACKWARDS, true },
+        { "3 - Regular, 0.5x speed, forward, not looping", 20000, 10000, 24900, 0.5f, FORWARD, false },
+        { "4 - Inverted, 1.25x speed, forward, end segment", 10000, 40000, 47800.25f, 1.25f, FORWARD, true },
+        { "5 - Inverted, 1.25x speed, forward, start segment", 10000, 40000, 1800.25f, 1.25f, FORWARD, true },
+        { "6 - Inverted, 0.75x speed, backwards, start segment", 10000, 40000, 150.75f, 0.75f, BACKWARDS, true },
+        { "7 - Inverted, 0.75x speed, backwards, end segment", 10000, 40000, 40150.75f, 0.75f, BACKWARDS, true },
+    };
+
+    std::cout << "\n";
+
+    for (Scenario scenario : scenarios)
+    {
+        Head head{Type::READ};
+        head.Init(buffer, buffer2, bufferSamples);
+        head.InitBuffer(bufferSamples);
+        head.SetActive(true);
+        head.SetLooping(scenario.looping);
+        head.SetLoopStartAndLength(scenario.loopStart, scenario.loopLength);
+        head.SetRate(scenario.rate);
+        head.SetDirection(scenario.direction);
+        head.SetIndex(scenario.index);
+
+        std::cout << "Scenario " << scenario.desc << "\n";
+
+        size_t samples = head.SamplesToBoundary(1024);
+        std::cout << "Samples to boundary: " << samples << "\n";
+
+        float index = head.GetPosition() + scenario.rate * scenario.direction * samples;
+        for (size_t i = 0; i < samples; i++)
+        {
+            assert(Head::Action::NO_ACTION == head.UpdatePosition());
+        }
+        std::cout << "Position: " << head.GetPosition() << " (expected " << index << ")\n\n";
+        assert(Compare(head.GetPosition(), index));
+    }
+}
+
+void TestLongBufferPositions()
+{
+    // Past 2^24 samples a float can't hold every index, the head and the loop
+    // points must keep the fractional positions.
+    const int32_t longSamples{(1 << 24) + 2};
+    Head head{Type::READ};
+    head.Init(buffer, buffer2, longSamples);
+    head.InitBuffer(longSamples);
+    head.SetActive(true);
+    head.SetLooping(true);
+    head.SetRate(1.f);
+    head.SetIndex((1 << 24) + 0.5);
+    head.UpdatePosition();
+
+    std::cout << "\nLong buffer, loop end: " << head.GetLoopEnd() << ", position: " << head.GetPosition() << "\n";
+    assert((1 << 24) + 1.0 == head.GetLoopEnd());
+    assert((1 << 24) + 1.5 == head.GetPosition());
+
+    head.SetLoopStartAndLength((1 << 24) - 0.5, 2.0);
+    assert((1 << 24) + 0.5 == head.GetLoopEnd());
+}
+
+void TestCommandQueue()
+{
+    struct Command
+    {
+        int type{};
+        uint64_t frame{};
+    };
+
+    CommandQueue<Command, 8> queue;
+
+    std::cout << "\n";
+
+    // Fill it up, then read and write across the end of the ring.
+    int pushed{};
+    while (queue.Push({pushed, static_cast<uint64_t>(pushed * 64)}))
+    {
+        pushed++;
+    }
+    std::cout << "Pushed until full: " << pushed << " (expected 8)\n";
+    assert(8 == pushed);
+
+    int popped{};
+    for (int i = 0; i < 20; i++)
+    {
+        const Command *command = queue.Front();
+        assert(command && popped == command->type && command->frame == static_cast<uint64_t>(popped * 64));
+        queue.Pop();
+        popped++;
+        assert(queue.Push({pushed, static_cast<uint64_t>(pushed * 64)}));
+        pushed++;
+    }
+    while (queue.Front())
+    {
+        assert(popped == queue.Front()->type);
+        queue.Pop();
+        popped++;
+    }
+    std::cout << "Popped in order: " << popped << " (expected " << pushed << ")\n";
+    assert(popped == pushed);
+}
+
+void TestClearBuffer()
+{
+    looper.Reset();
+    Buffer(false);
+    looper.SetLoopLength(bufferSamples);
+
+    std::cout << "\n";
+
+    // Keep writing while the buffers are being cleared: what is written must
+    // survive, and the rest must be cleared.
+    looper.ClearBuffer();
+    int32_t written{};
+    int32_t blocks{};
+    while (looper.IsClearing())
+    {
+        for (size_t i = 0; i < 48; i++)
+        {
+            looper.Read();
+            looper.UpdateReadPos();
+            looper.Write(1.f);
+            looper.UpdateWritePos();
+            written++;
+        }
+        looper.ProcessPages(48);
+        blocks++;
+    }
+
+    int32_t ones{};
+    int32_t others{};
+    for (int32_t i = 0; i < bufferSamples; i++)
+    {
+        ones += 1.f == buffer[i];
+        others += 0.f != buffer[i] && 1.f != buffer[i];
+    }
+    std::cout << "Cleared in " << blocks << " blocks, written: " << written << ", found: " << ones << ", not cleared: " << others << "\n";
+    assert(blocks > 1);
+    assert(written == ones);
+    assert(0 == others);
+}
+
+void TestFreezeSnapshot()
+{
+    looper.Reset();
+    Buffer(false);
+    looper.SetLoopLength(bufferSamples);
+
+    std::cout << "\n";
+
+    // Freeze and keep writing while the snapshot is being taken: the freeze
+    // buffer must hold the buffer as it was, apart from where the writing
+    // fades out.
+    looper.SetFreeze(1.f);
+    int32_t written{};
+    while (looper.IsSnapshotting())
+    {
+        for (size_t i = 0; i < 48; i++)
+        {
+            looper.Read();
+            looper.UpdateReadPos();
+            looper.Write(1.f);
+            looper.UpdateWritePos();
+            written++;
+        }
+        looper.ProcessPages(48);
+    }
+
+    float f = 1.f / bufferSamples;
+    int32_t different{};
+    int32_t faded{};
+    for (int32_t i = 0; i < bufferSamples; i++)
+    {
+        bool fading = buffer[i] != Sine(f, i);
+        different += !fading && buffer2[i] != Sine(f, i);
+        faded += fading;
+    }
+    std::cout << "Snapshot taken while writing " << written << " samples (found " << faded << "), different samples: " << different << "\n";
+    assert(written == faded);
+    assert(0 == different);
+
+    looper.SetFreeze(0.f);
+}
+
+void TestBufferBlock()
+{
+    std::cout << "\n";
+
+    // Buffering in blocks, past the end of the buffer: it must end where
+    // buffering one sample at a time does, with the same content.
+    static float input[700];
+    looper.Reset();
+    float f = 1.f / bufferSamples;
+    bool end{};
+    int32_t blocks{};
+    for (int32_t i = 0; !end; i += 700, blocks++)
+    {
+        for (int32_t j = 0; j < 700; j++)
+        {
+            input[j] = Sine(f, i + j);
+        }
+        end = looper.BufferBlock(input, 700);
+        assert(end == (i + 700 >= bufferSamples));
+    }
+    looper.StopBuffering();
+
+    int32_t different{};
+    for (int32_t i = 0; i < bufferSamples; i++)
+    {
+        different += buffer[i] != Sine(f, i);
+    }
+    std::cout << "Buffered in " << blocks << " blocks, samples: " << looper.GetBufferSamples() << ", different samples: " << different << "\n";
+    assert(bufferSamples == looper.GetBufferSamples());
+    assert(0 == different);
+}
+
+void TestFreezeFadeBlock()
+{
+    static float buffers[2][2][bufferSamples];
+
+    std::cout << "\n";
+
+    // Writing in blocks through the freeze and unfreeze fades must leave the
+    // buffers as writing one sample at a time does, and end the fades at the
+    // same time. The rate keeps the positions exact, so that both write at
+    // the same indexes.
+    Head heads[2]{Head{Type::WRITE}, Head{Type::WRITE}};
+    for (size_t h = 0; h < 2; h++)
+    {
+        std::fill(buffers[h][1], buffers[h][1] + bufferSamples, 0.5f);
+        heads[h].Init(buffers[h][0], buffers[h][1], bufferSamples);
+        heads[h].InitBuffer(bufferSamples);
+        heads[h].SetActive(true);
+        heads[h].SetLooping(true);
+        heads[h].SetRate(0.75f);
+    }
+    static float input[96];
+    float f = 1.f / 480;
+    int32_t differentStates{};
+    for (int32_t t = 0; t < 20000; t += 96)
+    {
+        if (0 == t || 9984 == t)
+        {
+            heads[0].SetFreeze(t > 0 ? 0.f : 1.f);
+            heads[1].SetFreeze(t > 0 ? 0.f : 1.f);
+        }
+        for (int32_t i = 0; i < 96; i++)
+        {
+            input[i] = Sine(f, t + i);
+        }
+        heads[0].WriteBlock(input, 96);
+        heads[0].Advance(96);
+        for (int32_t i = 0; i < 96; i++)
+        {
+            heads[1].Write(input[i]);
+            heads[1].UpdatePosition();
+        }
+        differentStates += heads[0].IsFrozen() != heads[1].IsFrozen();
+    }
+    float maxError{};
+    for (int32_t i = 0; i < bufferSamples; i++)
+    {
+        maxError = std::max(maxError, std::fabs(buffers[0][0][i] - buffers[1][0][i]));
+        maxError = std::max(maxError, std::fabs(buffers[0][1][i] - buffers[1][1][i]));
+    }
+    std::cout << "Freeze fades in blocks, max error: " << maxError << ", different states: " << differentStates << "\n";
+    assert(maxError < 1e-5f);
+    assert(0 == differentStates);
+}
+
+void TestExport()
+{
+    static float samples[48000];
+    static LoopSnapshot snapshot;
+
+    looper.Reset();
+    Buffer(false);
+    looper.SetLoopLength(bufferSamples);
+
+    std::cout << "\n";
+
+    // Keep writing while the loop is being exported: the snapshot must hold
+    // the loop as it was.
+    snapshot.samples = samples;
+    snapshot.capacity = 48000;
+    snapshot.status.store(LoopSnapshot::WAITING);
+    looper.StartExport(&snapshot);
+    int32_t written{};
+    while (looper.IsExporting())
+    {
+        for (size_t i = 0; i < 48; i++)
+        {
+            looper.Write(1.f);
+            looper.UpdateWritePos();
+            written++;
+        }
+        looper.ProcessPages(48);
+    }
+
+    float f = 1.f / bufferSamples;
+    int32_t different{};
+    for (int32_t i = 0; i < snapshot.loopLength; i++)
+    {
+        different += !snapshot.IsPublished(i) || samples[i] != Sine(f, i);
+    }
+    std::cout << "Loop exported while writing " << written << " samples, different samples: " << different << "\n";
+    assert(LoopSnapshot::COMPLETE == snapshot.status.load());
+    assert(bufferSamples == snapshot.loopLength);
+    assert(0 == different);
+}
+
+void TestCrossFades()
+{
+    std::cout << "\n";
+
+    // The table must follow the sine, and the ramp the single gains.
+    static float fromGains[1000];
+    static float toGains[1000];
+    Fader::EqualCrossFadeRamp(0.f, 1.f / 999, fromGains, toGains, 1000);
+    float maxError{};
+    int32_t different{};
+    for (int32_t i = 0; i < 1000; i++)
+    {
+        float pos = i / 999.f;
+        float expected = std::sin(pos * 1.570796326794897f) + 0.5f * std::sin((1.f - pos) * 1.570796326794897f);
+        maxError = std::max(maxError, std::abs(Fader::CrossFade(0.5f, 1.f, pos) - expected));
+        Fader::Gains gains = Fader::EqualCrossFadeGains(1.f / 999 * i);
+        different += fromGains[i] != gains.from || toGains[i] != gains.to;
+    }
+    std::cout << "Crossfade table, max error: " << maxError << ", different ramp gains: " << different << "\n";
+    assert(maxError < 1e-5f);
+    assert(0 == different);
+
+    // A fade processed as gains, in blocks, must match the one processed
+    // sample by sample, and end at the same sample.
+    Fader fader;
+    Fader blockFader;
+    fader.Init(Fader::FadeType::FADE_SINGLE, 1000.f, 1.3f);
+    blockFader.Init(Fader::FadeType::FADE_SINGLE, 1000.f, 1.3f);
+    different = 0;
+    int32_t samples{};
+    while (blockFader.IsActive())
+    {
+        size_t size = std::min<size_t>(64, blockFader.GetSamplesBeforeEnd());
+        size = blockFader.ProcessGains(fromGains, std::max<size_t>(size, 1), false);
+        for (size_t i = 0; i < size; i++, samples++)
+        {
+            fader.Process(0.5f, 0.f);
+            different += fader.GetOutput() != 0.5f * fromGains[i];
+        }
+    }
+    std::cout << "Fade in blocks, samples: " << samples << ", different samples: " << different << "\n";
+    assert(!fader.IsActive());
+    assert(0 == different);
+}
+
+void TestSeed()
+{
+    static float degraded[2][4800];
+    static float block[48];
+
+    std::cout << "\n";
+
+    // The same seed must give the same degradation, either sample by sample
+    // or in blocks.
+    for (size_t run = 0; run < 2; run++)
+    {
+        looper.Reset();
+        looper.SetSeed(7);
+        Buffer(false);
+        looper.SetDegradation(0.5f);
+        for (size_t i = 0; i < 4800; i += 48)
+        {
+            if (0 == run)
+            {
+                for (size_t j = 0; j < 48; j++)
+                {
+                    degraded[run][i + j] = looper.Degrade(1.f);
+                    looper.UpdateWritePos();
+                }
+            }
+            else
+            {
+                looper.GetDegradationGains(degraded[run] + i, 48);
+                looper.WriteBlock(block, 48);
+            }
+        }
+    }
+    looper.SetDegradation(0.f);
+    int32_t different{};
+    int32_t attenuated{};
+    for (size_t i = 0; i < 4800; i++)
+    {
+        different += degraded[0][i] != degraded[1][i];
+        attenuated += degraded[0][i] < 1.f;
+    }
+    std::cout << "Degraded twice with the same seed, attenuated samples: " << attenuated << ", different samples: " << different << "\n";
+    assert(attenuated > 0 && attenuated < 4800);
+    assert(0 == different);
+}
+
+void TestSampleFormats()
+{
+    struct Scenario
+    {
+        std::string desc{};
+        SampleFormat format{};
+        float maxError{};
+    };
+
+    static Scenario scenarios[] =
+    {
+        { "Float", SampleFormat::FLOAT, 0.f },
+        { "Int16", SampleFormat::INT16, 1e-4f },
+        { "Int24", SampleFormat::INT24, 1e-6f },
+        { "BFloat16", SampleFormat::BFLOAT16, 4e-3f },
+    };
+
+    static Interpolation interpolations[] = {LINEAR, HERMITE, LAGRANGE, SINC};
+
+    std::cout << "\n";
+
+    float f = 1.f / bufferSamples;
+    for (int32_t i = 0; i < bufferSamples; i++)
+    {
+        buffer[i] = Sine(f, i);
+    }
+
+    for (Scenario scenario : scenarios)
+    {
+        assert(storage::BufferBytes(scenario.format, bufferSamples) <= sizeof(formatBuffer));
+
+        Head writer{Type::WRITE};
+        writer.Init(formatBuffer, formatBuffer2, bufferSamples, 1, scenario.format);
+        for (int32_t i = 0; i < bufferSamples; i++)
+        {
+            writer.Buffer(Sine(f, i));
+        }
+
+        for (Interpolation interpolation : interpolations)
+        {
+            Head head{Type::READ};
+            head.Init(formatBuffer, formatBuffer2, bufferSamples, 1, scenario.format);
+            head.InitBuffer(bufferSamples);
+            head.SetActive(true);
+            head.SetLooping(true);
+            head.SetRate(1.37f);
+            head.SetInterpolation(interpolation);
+            head.SetIndex(100.25f);
+
+            float block[256]{};
+            head.ReadBlock(block, 256);
+
+            // The block read must match the per-sample one, and be close to
+            // the float version.
+            Head reference{Type::READ};
+            reference.Init(buffer, buffer2, bufferSamples);
+            reference.InitBuffer(bufferSamples);
+            reference.SetActive(true);
+            reference.SetLooping(true);
+            reference.SetRate(1.37f);
+            reference.SetInterpolation(interpolation);
+            reference.SetIndex(100.25f);
+
+            float blockError{};
+            float maxError{};
+            for (int32_t i = 0; i < 256; i++)
+            {
+                blockError = std::max(blockError, std::fabs(block[i] - head.Read()));
+                maxError = std::max(maxError, std::fabs(block[i] - reference.Read()));
+                head.UpdatePosition();
+                reference.UpdatePosition();
+            }
+            std::cout << scenario.desc << " (" << MapInterpolation(interpolation) << "), block error: " << blockError << ", max error: " << maxError << "\n";
+            assert(blockError < 1e-5f);
+            assert(maxError <= scenario.maxError + 1e-6f);
+        }
+    }
+}
+
+void TestMappedBuffer()
+{
+#ifdef WREATH_MAPPED_BUFFERS
+    const char *path = "/tmp/wreath_test_buffer.raw";
+    std::remove(path);
+    size_t bytes = storage::BufferBytes(SampleFormat::INT16, bufferSamples);
+
+    // Fill the buffer through a head, then map the file again.
+    MappedBuffer mapped;
+    bool ok = mapped.Map(path, bytes);
+    assert(ok);
+    Head writer{Type::WRITE};
+    writer.Init(mapped.GetData(), formatBuffer2, bufferSamples, 1, SampleFormat::INT16);
+    float f = 1.f / bufferSamples;
+    for (int32_t i = 0; i < bufferSamples; i++)
+    {
+        writer.Buffer(Sine(f, i));
+    }
+    mapped.Unmap();
+
+    ok = mapped.Map(path, bytes);
+    assert(ok);
+    Head reader{Type::READ};
+    reader.Init(mapped.GetData(), formatBuffer2, bufferSamples, 1, SampleFormat::INT16);
+    reader.InitBuffer(bufferSamples);
+    reader.SetActive(true);
+    reader.SetLooping(true);
+    reader.SetRate(1.f);
+    float maxError{};
+    for (int32_t i = 0; i < bufferSamples; i++)
+    {
+        maxError = std::max(maxError, std::fabs(reader.Read() - Sine(f, i)));
+        reader.UpdatePosition();
+    }
+
+    // The path of the heads wraps around the loop in both directions.
+    Prefetcher prefetcher;
+    prefetcher.SetChannel(0, mapped.GetData(), formatBuffer2, bufferSamples, storage::BytesPerSample(SampleFormat::INT16));
+    prefetcher.Publish(0, {47000.5f, -1.5f, 46000.f, 1.f, 40000.f, 10000.f, 0.f, bufferSamples, bufferSamples});
+    prefetcher.Prefetch(bufferSamples);
+    prefetcher.Publish(0, {100.f, 2.f, 40.f, 1.f, 45000.f, 6000.f, 45000.f, 6000.f, bufferSamples});
+    prefetcher.Prefetch(1000.f);
+
+    std::cout << "\nMapped buffer, max error: " << maxError << "\n";
+    assert(maxError < 1e-4f);
+
+    mapped.Unmap();
+    std::remove(path);
+
+#ifdef __linux__
+    // Outside of delay mode the writing head goes through the whole buffer:
+    // the pages of its path must be loaded even if they are outside of the
+    // loop (the read-ahead is off, as the reading head is fast).
+    const int32_t mappedSamples{1 << 22};
+    ok = mapped.Map(path, storage::BufferBytes(SampleFormat::INT16, mappedSamples));
+    assert(ok);
+    Prefetcher writePrefetcher;
+    writePrefetcher.SetChannel(0, mapped.GetData(), nullptr, mappedSamples, storage::BytesPerSample(SampleFormat::INT16));
+    writePrefetcher.Publish(0, {0.f, 3.f, 3000000.f, 1.f, 0.f, 10000.f, 0.f, mappedSamples, mappedSamples});
+    writePrefetcher.Prefetch(4000.f);
+    uintptr_t data = reinterpret_cast<uintptr_t>(mapped.GetData());
+    uintptr_t from = (data + 3000000 * 2) & ~(kPageBytes - 1);
+    size_t pages = (data + 3004000 * 2 - from + kPageBytes - 1) / kPageBytes;
+    unsigned char resident[8]{};
+    ok = 0 == mincore(reinterpret_cast<void *>(from), pages * kPageBytes, resident);
+    int32_t missing{};
+    for (size_t i = 0; i < pages; i++)
+    {
+        missing += !(resident[i] & 1);
+    }
+    std::cout << "Pages of the writing head's path: " << pages << ", not loaded: " << missing << "\n";
+    assert(ok && pages <= 8);
+    assert(0 == missing);
+
+    mapped.Unmap();
+    std::remove(path);
+#endif
+#endif
+}
+
+void TestLargeBlocks()
+{
+    static float buffers[2][4][48000];
+    static float input[2][1024];
+    static float output[2][2][1024];
+    static StereoLooper loopers[2];
+
+    std::cout << "\n";
+
+    // Blocks bigger than kMaxBlockSize are split: processing 1024 frames at a
+    // time must give what processing them 128 at a time does, while
+    // buffering and while running.
+    StereoLooper::Conf conf{StereoLooper::Mode::MONO, Movement::NORMAL, Direction::FORWARD, 1.f, 0.f};
+    for (size_t i = 0; i < 2; i++)
+    {
+        loopers[i].Init(48000, conf, {buffers[i][0], buffers[i][1], buffers[i][2], buffers[i][3], bufferSamples});
+    }
+    float f = 1.f / 480;
+    int32_t different{};
+    for (int32_t t = 0; t < bufferSamples * 2; t += 1024)
+    {
+        for (int32_t j = 0; j < 1024; j++)
+        {
+            input[StereoLooper::LEFT][j] = 0.5f * Sine(f, t + j);
+            input[StereoLooper::RIGHT][j] = -0.5f * Sine(f, t + j);
+        }
+        for (size_t i = 0; i < 2; i++)
+        {
+            if (loopers[i].IsReady())
+            {
+                loopers[i].Start();
+                loopers[i].SetReadRate(StereoLooper::BOTH, 1.37f);
+                loopers[i].feedback = 0.5f;
+            }
+        }
+        loopers[0].ProcessBlock(input[StereoLooper::LEFT], input[StereoLooper::RIGHT], output[0][StereoLooper::LEFT], output[0][StereoLooper::RIGHT], 1024);
+        for (size_t j = 0; j < 1024; j += kMaxBlockSize)
+        {
+            loopers[1].ProcessBlock(input[StereoLooper::LEFT] + j, input[StereoLooper::RIGHT] + j, output[1][StereoLooper::LEFT] + j, output[1][StereoLooper::RIGHT] + j, kMaxBlockSize);
+        }
+        for (size_t j = 0; j < 1024; j++)
+        {
+            different += output[0][StereoLooper::LEFT][j] != output[1][StereoLooper::LEFT][j] || output[0][StereoLooper::RIGHT][j] != output[1][StereoLooper::RIGHT][j];
+        }
+    }
+    std::cout << "Processed in blocks of 1024 and " << kMaxBlockSize << " frames, running: " << (loopers[0].IsRunning() ? "YES" : "NO") << ", different samples: " << different << "\n";
+    assert(loopers[0].IsRunning());
+    assert(0 == different);
+}
+
+void TestBufferingLargeBlock()
+{
+    static float buffers[4][48000];
+    static float input[2][512];
+    static float output[2][512];
+    static StereoLooper looper;
+
+    std::cout << "\n";
+
+    // A block longer than kMaxBlockSize while buffering: each channel must
+    // get its own input, in the buffers and in the output.
+    StereoLooper::Conf conf{StereoLooper::Mode::DUAL, Movement::NORMAL, Direction::FORWARD, 1.f, 0.f};
+    looper.Init(48000, conf, {buffers[0], buffers[1], buffers[2], buffers[3], bufferSamples});
+    std::fill(input[StereoLooper::LEFT], input[StereoLooper::LEFT] + 512, 0.1f);
+    std::fill(input[StereoLooper::RIGHT], input[StereoLooper::RIGHT] + 512, -0.1f);
+    looper.ProcessBlock(input[StereoLooper::LEFT], input[StereoLooper::RIGHT], output[StereoLooper::LEFT], output[StereoLooper::RIGHT], 512);
+    int32_t wrong{};
+    for (size_t i = 0; i < 512; i++)
+    {
+        wrong += !(buffers[0][i] > 0.f) + !(buffers[1][i] < 0.f);
+        wrong += output[StereoLooper::LEFT][i] < 0.f || output[StereoLooper::RIGHT][i] > 0.f;
+    }
+    std::cout << "Buffered a block of 512 frames, samples with the wrong sign: " << wrong << "\n";
+    assert(0 == wrong);
+
+    // The same once ready, when only the dry signal goes through.
+    while (!looper.IsReady())
+    {
+        looper.ProcessBlock(input[StereoLooper::LEFT], input[StereoLooper::RIGHT], output[StereoLooper::LEFT], output[StereoLooper::RIGHT], 512);
+    }
+    looper.ProcessBlock(input[StereoLooper::LEFT], input[StereoLooper::RIGHT], output[StereoLooper::LEFT], output[StereoLooper::RIGHT], 512);
+    wrong = 0;
+    for (size_t i = 0; i < 512; i++)
+    {
+        wrong += !(output[StereoLooper::LEFT][i] > 0.f) + !(output[StereoLooper::RIGHT][i] < 0.f);
+    }
+    std::cout << "Dry block of 512 frames when ready, samples with the wrong sign: " << wrong << "\n";
+    assert(0 == wrong);
+}
+
+void TestFractionalLoop()
+{
+    static float buffers[4][48000];
+    static float input[2][kMaxBlockSize];
+    static float output[2][kMaxBlockSize];
+    static StereoLooper looper;
+
+    std::cout << "\n";
+
+    // The loop points set through the commands keep their fractional part.
+    StereoLooper::Conf conf{StereoLooper::Mode::DUAL, Movement::NORMAL, Direction::FORWARD, 1.f, 0.f};
+    looper.Init(48000, conf, {buffers[0], buffers[1], buffers[2], buffers[3], bufferSamples});
+    while (!looper.IsReady())
+    {
+        looper.ProcessBlock(input[StereoLooper::LEFT], input[StereoLooper::RIGHT], output[StereoLooper::LEFT], output[StereoLooper::RIGHT], kMaxBlockSize);
+    }
+    looper.Start();
+    looper.SetLoopLength(StereoLooper::LEFT, 12345.5);
+    looper.SetLoopStart(StereoLooper::RIGHT, 1000.25);
+    for (int32_t t = 0; t < bufferSamples; t += static_cast<int32_t>(kMaxBlockSize))
+    {
+        looper.ProcessBlock(input[StereoLooper::LEFT], input[StereoLooper::RIGHT], output[StereoLooper::LEFT], output[StereoLooper::RIGHT], kMaxBlockSize);
+    }
+    std::cout << "Fractional loop, left length: " << looper.GetLoopLength(StereoLooper::LEFT) << ", right start: " << looper.GetLoopStart(StereoLooper::RIGHT) << "\n";
+    assert(12345.5 == looper.GetLoopLength(StereoLooper::LEFT));
+    assert(1000.25 == looper.GetLoopStart(StereoLooper::RIGHT));
+}
+
+void TestSession()
+{
+#ifdef WREATH_MAPPED_BUFFERS
+    const char *path = "/tmp/wreath_test_session.wrth";
+    static float buffers[4][48000];
+    static float input[2][kMaxBlockSize];
+    static float output[2][kMaxBlockSize];
+    static float freezeBuffers[2][48000];
+    static StereoLooper looper;
+    static StereoLooper restored;
+
+    std::cout << "\n";
+
+    // Record, then freeze with a shorter loop and different rates.
+    StereoLooper::Conf conf{StereoLooper::Mode::DUAL, Movement::NORMAL, Direction::FORWARD, 1.f, 0.f};
+    looper.Init(48000, conf, {buffers[0], buffers[1], buffers[2], buffers[3], bufferSamples});
+    float f = 1.f / 480;
+    bool started{};
+    for (int32_t t = 0; t < bufferSamples * 2; t += kMaxBlockSize)
+    {
+        for (size_t j = 0; j < kMaxBlockSize; j++)
+        {
+            input[StereoLooper::LEFT][j] = 0.5f * Sine(f, t + j);
+            input[StereoLooper::RIGHT][j] = -0.25f * Sine(f, t + j);
+        }
+        if (looper.IsReady())
+        {
+            looper.Start();
+            started = true;
+        }
+        if (started && t >= bufferSamples + static_cast<int32_t>(kMaxBlockSize) * 8 && t < bufferSamples + static_cast<int32_t>(kMaxBlockSize) * 9)
+        {
+            looper.SetLoopStart(StereoLooper::BOTH, 1000.25);
+            looper.SetLoopLength(StereoLooper::BOTH, 20000.5);
+            looper.SetReadRate(StereoLooper::LEFT, 1.37f);
+            looper.SetReadRate(StereoLooper::RIGHT, 0.8f);
+            looper.SetFreeze(StereoLooper::BOTH, 0.7f);
+        }
+        looper.ProcessBlock(input[StereoLooper::LEFT], input[StereoLooper::RIGHT], output[StereoLooper::LEFT], output[StereoLooper::RIGHT], kMaxBlockSize);
+    }
+    assert(looper.IsRunning());
+
+    bool ok = Session::Save(path, looper);
+    assert(ok);
+    Session session;
+    ok = session.Load(path, restored);
+    assert(ok);
+
+    // The buffers and the state come back as they were saved.
+    const StereoLooper::Buffers &loaded = restored.GetBuffers();
+    const void *loadedBuffers[4]{loaded.left, loaded.right, loaded.leftFreeze, loaded.rightFreeze};
+    int32_t differentBuffers{};
+    for (size_t i = 0; i < 4; i++)
+    {
+        differentBuffers += 0 != std::memcmp(loadedBuffers[i], buffers[i], sizeof(buffers[i]));
+    }
+    StereoLooper::SessionState saved = looper.GetSessionState();
+    StereoLooper::SessionState state = restored.GetSessionState();
+    assert(restored.IsRunning());
+    assert(0 == differentBuffers);
+    for (size_t channel : {StereoLooper::LEFT, StereoLooper::RIGHT})
+    {
+        const StereoLooper::SessionState::Channel &a = saved.channels[channel];
+        const StereoLooper::SessionState::Channel &b = state.channels[channel];
+        std::cout << "Session channel " << channel << ", loop: " << b.loopStart << "+" << b.loopLength << " (saved " << a.loopStart << "+" << a.loopLength << "), read rate: " << b.readRate << " (saved " << a.readRate << "), freeze: " << b.freeze << " (saved " << a.freeze << ")\n";
+        assert(a.loopStart == b.loopStart && a.loopLength == b.loopLength);
+        assert(1000.25 == b.loopStart && 20000.5 == b.loopLength);
+        assert(a.readPos == b.readPos && a.writePos == b.writePos);
+        assert(a.readRate == b.readRate && a.writeRate == b.writeRate);
+        assert(a.freeze == b.freeze && 0.7f == b.freeze);
+    }
+
+    // The restored freeze buffers already hold the frozen content: the
+    // writing head must not fade into them.
+    std::memcpy(freezeBuffers[0], loaded.leftFreeze, sizeof(freezeBuffers[0]));
+    std::memcpy(freezeBuffers[1], loaded.rightFreeze, sizeof(freezeBuffers[1]));
+    for (int32_t t = 0; t < bufferSamples / 4; t += kMaxBlockSize)
+    {
+        restored.ProcessBlock(input[StereoLooper::LEFT], input[StereoLooper::RIGHT], output[StereoLooper::LEFT], output[StereoLooper::RIGHT], kMaxBlockSize);
+    }
+    int32_t changed = 0 != std::memcmp(freezeBuffers[0], loaded.leftFreeze, sizeof(freezeBuffers[0]));
+    changed += 0 != std::memcmp(freezeBuffers[1], loaded.rightFreeze, sizeof(freezeBuffers[1]));
+    std::cout << "Restored freeze buffers changed: " << changed << "\n";
+    assert(0 == changed);
+
+    // Nor the fractional loop changes on the first blocks.
+    assert(1000.25 == restored.GetLoopStart(StereoLooper::LEFT) && 20000.5 == restored.GetLoopLength(StereoLooper::LEFT));
+    assert(1000.25 == restored.GetLoopStart(StereoLooper::RIGHT) && 20000.5 == restored.GetLoopLength(StereoLooper::RIGHT));
+
+    session.Close();
+
+    // A tampered header must not drive the looper out of the buffers.
+    const char *tamperedPath = "/tmp/wreath_test_session_tampered.wrth";
+    static uint8_t file[sizeof(Session::Header) + 2 * 4 * 48000 + 8 * kPageBytes];
+    FILE *in = std::fopen(path, "rb");
+    assert(in);
+    size_t bytes = std::fread(file, 1, sizeof(file), in);
+    std::fclose(in);
+    Session::Header header;
+    std::memcpy(&header, file, sizeof(header));
+    using Tamper = void (*)(Session::Header &);
+    static const Tamper tampers[] =
+    {
+        [](Session::Header &h) { h.state.channels[0].bufferSamples = h.samples + 1; },
+        [](Session::Header &h) { h.state.channels[1].bufferSamples = 0; },
+        [](Session::Header &h) { h.state.channels[0].loopLength = h.state.channels[0].bufferSamples + 1.0; },
+        [](Session::Header &h) { h.state.channels[1].loopStart = -1.0; },
+        [](Session::Header &h) { h.state.channels[0].readPos = std::nan(""); },
+        [](Session::Header &h) { h.state.channels[1].writePos = 1e9; },
+        [](Session::Header &h) { h.state.channels[0].movement = static_cast<Movement>(7); },
+        [](Session::Header &h) { h.state.channels[1].direction = static_cast<Direction>(0); },
+        [](Session::Header &h) { h.state.state = static_cast<StereoLooper::State>(9); },
+        [](Session::Header &h) { h.format = static_cast<SampleFormat>(12); },
+    };
+    int32_t accepted{};
+    for (Tamper tamper : tampers)
+    {
+        Session::Header tampered = header;
+        tamper(tampered);
+        std::memcpy(file, &tampered, sizeof(tampered));
+        FILE *out = std::fopen(tamperedPath, "wb");
+        assert(out);
+        std::fwrite(file, 1, bytes, out);
+        std::fclose(out);
+        Session tamperedSession;
+        accepted += tamperedSession.Load(tamperedPath, restored);
+        tamperedSession.Close();
+    }
+    std::cout << "Tampered sessions loaded: " << accepted << "\n";
+    assert(0 == accepted);
+
+    std::remove(tamperedPath);
+    std::remove(path);
+#endif
+}
+
 int main()
 {
     looper.Init(48000, buffer, buffer2, 48000);
@@ -452,6 +1504,24 @@ int main()
     //TestLeds();
     //TestCrossPoint();
     TestHeadsDistance();
+    TestCrossingSchedule();
+    TestReadBlock();
+    TestSamplesToBoundary();
+    TestLongBufferPositions();
+    TestCommandQueue();
+    TestClearBuffer();
+    TestFreezeSnapshot();
+    TestBufferBlock();
+    TestFreezeFadeBlock();
+    TestExport();
+    TestCrossFades();
+    TestSeed();
+    TestSampleFormats();
+    TestMappedBuffer();
+    TestLargeBlocks();
+    TestBufferingLargeBlock();
+    TestFractionalLoop();
+    TestSession();
 
     return 0;
 }